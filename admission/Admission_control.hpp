@@ -0,0 +1,325 @@
+#ifndef ADMISSION_CONTROL_H
+#define ADMISSION_CONTROL_H
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "../logger/Logger.hpp"
+
+// the client ips with nothing open are forgotten every this many new connections,
+// once their token bucket is full again (they would get the same tokens back anyway).
+constexpr uint64_t ADMISSION_SWEEP_INTERVAL = 1024;
+// the counters are logged when something has been shed, at most once in this many seconds.
+constexpr int ADMISSION_STATS_INTERVAL_SEC = 10;
+constexpr size_t ADMISSION_DEFAULT_MEMORY_BUDGET_MB = 256;
+
+namespace AdmissionUtils {
+    // why a connection or a request has been shed.
+    enum Reason {
+        ADMITTED = 0,
+        CONNECTIONS, // too many connections from the ip
+        RATE,        // the token bucket of the ip is empty
+        INFLIGHT,    // too many requests of the ip waiting for their responses
+        MEMORY       // the responses waiting to be sent to the clients take too much memory
+    };
+
+    inline const char* ReasonName(Reason reason) {
+        switch (reason) {
+            case CONNECTIONS: return "connections";
+            case RATE: return "rate";
+            case INFLIGHT: return "inflight";
+            case MEMORY: return "memory";
+            default: return "admitted";
+        }
+    }
+
+    // the limits, from the environment variables, 0 is no limit:
+    // PROXY_MAX_CONNECTIONS_PER_IP: the open connections of one client ip
+    // PROXY_MAX_INFLIGHT_PER_IP: the requests of one client ip which have not been answered yet
+    // PROXY_RATE_LIMIT: the requests per second of one client ip (token bucket)
+    // PROXY_RATE_BURST: the size of the bucket, default 2 seconds of PROXY_RATE_LIMIT
+    // PROXY_MEMORY_BUDGET_MB: the bytes in the response queue of all the clients, default 256
+    struct Config {
+        size_t max_connections = 0;
+        size_t max_inflight = 0;
+        double rate = 0;
+        double burst = 0;
+        size_t memory_budget = ADMISSION_DEFAULT_MEMORY_BUDGET_MB * 1024 * 1024;
+
+        Config() {
+            const char* env = std::getenv("PROXY_MAX_CONNECTIONS_PER_IP");
+            if (env != nullptr && std::atoi(env) > 0) {
+                max_connections = std::atoi(env);
+            }
+            env = std::getenv("PROXY_MAX_INFLIGHT_PER_IP");
+            if (env != nullptr && std::atoi(env) > 0) {
+                max_inflight = std::atoi(env);
+            }
+            env = std::getenv("PROXY_RATE_LIMIT");
+            if (env != nullptr && std::atof(env) > 0) {
+                rate = std::atof(env);
+                burst = std::max(1.0, rate * 2);
+            }
+            env = std::getenv("PROXY_RATE_BURST");
+            if (rate > 0 && env != nullptr && std::atof(env) >= 1) {
+                burst = std::atof(env);
+            }
+            env = std::getenv("PROXY_MEMORY_BUDGET_MB");
+            if (env != nullptr && std::atoll(env) >= 0) {
+                memory_budget = (size_t)std::atoll(env) * 1024 * 1024;
+            }
+        }
+    };
+
+    struct Client {
+        size_t connections = 0;
+        size_t inflight = 0;
+        double tokens = 0;
+        std::chrono::steady_clock::time_point refilled_at;
+    };
+
+    struct Connection {
+        in_addr_t ip;
+        size_t inflight = 0;
+    };
+
+    struct Stats {
+        std::atomic<uint64_t> connections{0};      // admitted
+        std::atomic<uint64_t> requests{0};         // admitted
+        std::atomic<uint64_t> shed_connections{0};
+        std::atomic<uint64_t> shed_rate{0};
+        std::atomic<uint64_t> shed_inflight{0};
+        std::atomic<uint64_t> shed_memory{0};
+    };
+
+    inline std::string IpString(in_addr_t ip) {
+        char buffer[INET_ADDRSTRLEN];
+        in_addr addr;
+        addr.s_addr = ip;
+        return inet_ntop(AF_INET, &addr, buffer, sizeof(buffer)) != nullptr ? buffer : "?";
+    }
+}
+
+// AdmissionControl decides, before any work is done for them, whether a new connection or a new request
+// is taken, or shed with "503 Service Unavailable" and Retry-After.
+// One client ip is limited in its connections, its requests per second and its requests in flight,
+// and all the clients together in the bytes waiting in the response queue.
+// A request is in flight from its admission until the last piece of its response has left the queue.
+class AdmissionControl {
+private:
+    AdmissionUtils::Config config;
+    AdmissionUtils::Stats stats;
+    std::atomic<size_t> queued_bytes{0};
+    // when the counters were logged (steady clock, ms), and the sheds counted then.
+    std::atomic<int64_t> stats_logged_at{0};
+    std::atomic<uint64_t> stats_logged_shed{0};
+
+    // protects clients, connections and connections_seen.
+    std::mutex mutex_;
+    std::unordered_map<in_addr_t, AdmissionUtils::Client> clients;
+    // client socket -> the ip and the requests in flight on it
+    std::unordered_map<int, AdmissionUtils::Connection> connections;
+    uint64_t connections_seen = 0;
+
+    AdmissionControl() = default;
+
+    // put the tokens earned since the last refill into the bucket, call with mutex_ locked.
+    void refill(AdmissionUtils::Client& client, std::chrono::steady_clock::time_point now) {
+        double seconds = std::chrono::duration<double>(now - client.refilled_at).count();
+        client.tokens = std::min(config.burst, client.tokens + seconds * config.rate);
+        client.refilled_at = now;
+    }
+
+    AdmissionUtils::Client& client_of(in_addr_t ip, std::chrono::steady_clock::time_point now) {
+        auto it = clients.find(ip);
+        if (it == clients.end()) {
+            it = clients.emplace(ip, AdmissionUtils::Client{0, 0, config.burst, now}).first;
+        }
+        return it->second;
+    }
+
+    // forget the ips with no connection and a full bucket, call with mutex_ locked.
+    void sweep(std::chrono::steady_clock::time_point now) {
+        for (auto it = clients.begin(); it != clients.end();) {
+            if (config.rate > 0) {
+                refill(it->second, now);
+            }
+            if (it->second.connections == 0 && it->second.inflight == 0 && it->second.tokens >= config.burst) {
+                it = clients.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void count_shed(AdmissionUtils::Reason reason, in_addr_t ip) {
+        std::atomic<uint64_t>* counter = reason == AdmissionUtils::CONNECTIONS ? &stats.shed_connections :
+                                         reason == AdmissionUtils::RATE ? &stats.shed_rate :
+                                         reason == AdmissionUtils::INFLIGHT ? &stats.shed_inflight : &stats.shed_memory;
+        (*counter)++;
+        LOG_WARN_LIMITED("[Admission]: %s shed (%s)", AdmissionUtils::IpString(ip).c_str(), AdmissionUtils::ReasonName(reason));
+        log_stats_if_shed(std::chrono::steady_clock::now());
+    }
+
+    // log the counters if something has been shed since they were logged, and the interval has passed.
+    // called on every admission too, so the end of a burst is logged when the sheds have stopped.
+    void log_stats_if_shed(std::chrono::steady_clock::time_point now) {
+        int64_t now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count();
+        int64_t logged_at = stats_logged_at.load(std::memory_order_relaxed);
+        if (now_ms - logged_at < ADMISSION_STATS_INTERVAL_SEC * 1000) {
+            return;
+        }
+        uint64_t shed = stats.shed_connections + stats.shed_rate + stats.shed_inflight + stats.shed_memory;
+        if (shed == stats_logged_shed.load() || !stats_logged_at.compare_exchange_strong(logged_at, now_ms)) {
+            return;
+        }
+        stats_logged_shed = shed;
+        LogStats();
+    }
+
+public:
+    AdmissionControl(const AdmissionControl&) = delete;
+    AdmissionControl& operator=(const AdmissionControl&) = delete;
+
+    static AdmissionControl& instance() {
+        // never destroyed, the client threads may still be running at exit.
+        static AdmissionControl* admission = new AdmissionControl();
+        return *admission;
+    }
+
+    // a new connection from ip, it is counted until ReleaseConnection().
+    AdmissionUtils::Reason AdmitConnection(int client_socket, in_addr_t ip) {
+        auto now = std::chrono::steady_clock::now();
+        log_stats_if_shed(now);
+        {
+            std::lock_guard<std::mutex> lock_guard_(mutex_);
+            if (++connections_seen % ADMISSION_SWEEP_INTERVAL == 0) {
+                sweep(now);
+            }
+            AdmissionUtils::Client& client = client_of(ip, now);
+            if (config.max_connections == 0 || client.connections < config.max_connections) {
+                client.connections++;
+                connections[client_socket] = {ip, 0};
+                stats.connections++;
+                return AdmissionUtils::ADMITTED;
+            }
+        }
+        count_shed(AdmissionUtils::CONNECTIONS, ip);
+        return AdmissionUtils::CONNECTIONS;
+    }
+
+    // the connection has been closed, its requests in flight are not waited for anymore.
+    // call it before closing the socket, the number may be given to the next connection right after.
+    void ReleaseConnection(int client_socket) {
+        std::lock_guard<std::mutex> lock_guard_(mutex_);
+        auto it = connections.find(client_socket);
+        if (it == connections.end()) {
+            return;
+        }
+        auto client = clients.find(it->second.ip);
+        if (client != clients.end()) {
+            client->second.connections--;
+            client->second.inflight -= std::min(client->second.inflight, it->second.inflight);
+            // without a token bucket there is nothing to remember.
+            if (client->second.connections == 0 && config.rate <= 0) {
+                clients.erase(client);
+            }
+        }
+        connections.erase(it);
+    }
+
+    // a new request on the connection, it is in flight until FinishRequest().
+    AdmissionUtils::Reason AdmitRequest(int client_socket) {
+        auto now = std::chrono::steady_clock::now();
+        log_stats_if_shed(now);
+        AdmissionUtils::Reason reason = AdmissionUtils::ADMITTED;
+        in_addr_t ip = 0;
+        {
+            std::lock_guard<std::mutex> lock_guard_(mutex_);
+            auto it = connections.find(client_socket);
+            if (it == connections.end()) {
+                return AdmissionUtils::ADMITTED;
+            }
+            ip = it->second.ip;
+            AdmissionUtils::Client& client = client_of(ip, now);
+            if (config.memory_budget > 0 && queued_bytes.load() >= config.memory_budget) {
+                reason = AdmissionUtils::MEMORY;
+            } else if (config.max_inflight > 0 && client.inflight >= config.max_inflight) {
+                reason = AdmissionUtils::INFLIGHT;
+            } else if (config.rate > 0) {
+                refill(client, now);
+                if (client.tokens < 1) {
+                    reason = AdmissionUtils::RATE;
+                } else {
+                    client.tokens -= 1;
+                }
+            }
+            if (reason == AdmissionUtils::ADMITTED) {
+                client.inflight++;
+                it->second.inflight++;
+                stats.requests++;
+                return reason;
+            }
+        }
+        count_shed(reason, ip);
+        return reason;
+    }
+
+    // the last piece of the response has left the response queue.
+    void FinishRequest(int client_socket) {
+        std::lock_guard<std::mutex> lock_guard_(mutex_);
+        auto it = connections.find(client_socket);
+        if (it == connections.end() || it->second.inflight == 0) {
+            return;
+        }
+        it->second.inflight--;
+        auto client = clients.find(it->second.ip);
+        if (client != clients.end() && client->second.inflight > 0) {
+            client->second.inflight--;
+        }
+    }
+
+    // the seconds a shed client should wait before trying again.
+    int RetryAfter(AdmissionUtils::Reason reason) {
+        if (reason == AdmissionUtils::RATE) {
+            return std::max(1, (int)std::ceil(1.0 / config.rate));
+        }
+        return 1;
+    }
+
+    // the bytes pushed to and popped from the response queue.
+    void Queued(size_t bytes) {
+        queued_bytes += bytes;
+    }
+
+    void Dequeued(size_t bytes) {
+        queued_bytes -= bytes;
+    }
+
+    size_t QueuedBytes() {
+        return queued_bytes.load();
+    }
+
+    AdmissionUtils::Stats& GetStats() {
+        return stats;
+    }
+
+    void LogStats() {
+        LOG_INFO("[Admission]: connections=%llu requests=%llu shed_connections=%llu shed_rate=%llu shed_inflight=%llu "
+                 "shed_memory=%llu queued_bytes=%zu",
+                 (unsigned long long)stats.connections.load(), (unsigned long long)stats.requests.load(),
+                 (unsigned long long)stats.shed_connections.load(), (unsigned long long)stats.shed_rate.load(),
+                 (unsigned long long)stats.shed_inflight.load(), (unsigned long long)stats.shed_memory.load(),
+                 queued_bytes.load());
+    }
+};
+
+#endif // ADMISSION_CONTROL_H
@@ -0,0 +1,297 @@
+// The benchmark of the proxy.
+// It starts a fake origin and the proxy in this process, and drives the proxy with the load generator.
+//
+// g++ -std=c++17 -O2 benchmark/bench_main.cpp -o proxy_bench -pthread -lz
+// ./proxy_bench                      run the microbenchmarks and the load test
+// ./proxy_bench micro                only the microbenchmarks
+// ./proxy_bench load [options]       only the load test
+// ./proxy_bench check                the HPACK and HTTP/2 multiplexing checks, exits with 2 if one fails
+//
+// load test options:
+//   --connections N     concurrent client connections (default 8)
+//   --requests N        requests per connection (default 1000)
+//   --size BYTES        response body size (default 4096)
+//   --chunked           the origin uses chunked encoding instead of Content-Length
+//   --binary            the origin sends application/octet-stream instead of text/html
+//   --hits N            "Stockholm" in the html body (default 10)
+//   --origin-close      the origin closes the connection after every response
+//   --client-close      the clients close the connection after every response
+//   --h2c               the origin speaks HTTP/2 without TLS, the proxy uses its HTTP/2 client for it
+//   --urls N            distinct urls, requested round robin (default 1, 100 with --cluster)
+//   --cluster N         N proxies in a Cluster instead of one, see below
+//   --access-log        keep the access log on (it is off by default, to measure the proxy only)
+//   --proxy-port PORT   (default 27778)
+//   --origin-port PORT  (default 18080)
+//
+// --cluster N starts N proxy processes (the Cluster is configured once per process from the environment)
+// on proxy-port, proxy-port + 1, ..., with their peer ports from proxy-port + 1000, and spreads the
+// connections over them. The origin sends cacheable binary responses (max-age), so every url should be
+// fetched from the origin about once for the whole cluster: it fails if the origin served more than
+// 10% above one response per url (without the sharing, every node fetches every url itself, N x urls).
+// The cpu and rss of the load test report are of this process (the load generator and the origin),
+// the nodes are reported on their own line, from their rusage after they have exited.
+
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../server_proxy/Server_proxy.hpp"
+#include "fake_origin.hpp"
+#include "h2_check.hpp"
+#include "load_generator.hpp"
+#include "micro_bench.hpp"
+
+extern char** environ;
+
+constexpr int CLUSTER_PEER_PORT_OFFSET = 1000;
+constexpr int CLUSTER_START_TIMEOUT_MS = 5000;
+constexpr int CLUSTER_ORIGIN_MAX_AGE = 300;
+// the nodes may fetch a url at the same time before one of them has it, allow a few of them.
+constexpr int CLUSTER_ORIGIN_SLACK_PERCENT = 10;
+
+static bool WaitListening(int port, int timeout_ms) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (std::chrono::steady_clock::now() < deadline) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+        bool connected = fd >= 0 && connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0;
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (connected) {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    return false;
+}
+
+// start the nodes of --cluster as "proxy_bench node", with their own PROXY_CLUSTER_SELF.
+// the environments are built before fork(), the child only calls execve().
+static std::vector<pid_t> StartCluster(int nodes, int proxy_port) {
+    std::string peers;
+    for (int n = 0; n < nodes; n++) {
+        peers += (n > 0 ? "," : "") + std::string("127.0.0.1:") + std::to_string(proxy_port + CLUSTER_PEER_PORT_OFFSET + n);
+    }
+    std::vector<pid_t> pids;
+    for (int n = 0; n < nodes; n++) {
+        std::vector<std::string> env_strings = {
+            "PROXY_CLUSTER_SELF=127.0.0.1:" + std::to_string(proxy_port + CLUSTER_PEER_PORT_OFFSET + n),
+            "PROXY_CLUSTER_PEERS=" + peers};
+        std::vector<char*> env;
+        for (char** e = environ; *e != nullptr; e++) {
+            if (strncmp(*e, "PROXY_CLUSTER_", 14) != 0) {
+                env.push_back(*e);
+            }
+        }
+        for (auto& e : env_strings) {
+            env.push_back(&e[0]);
+        }
+        env.push_back(nullptr);
+        std::string port = std::to_string(proxy_port + n);
+        char* args[] = {(char*)"proxy_bench", (char*)"node", (char*)"--proxy-port", &port[0], nullptr};
+        pid_t pid = fork();
+        if (pid == 0) {
+            execve("/proc/self/exe", args, env.data());
+            _exit(127);
+        }
+        if (pid > 0) {
+            pids.push_back(pid);
+        }
+    }
+    return pids;
+}
+
+static void StopCluster(const std::vector<pid_t>& pids) {
+    for (pid_t pid : pids) {
+        kill(pid, SIGTERM);
+    }
+    for (pid_t pid : pids) {
+        waitpid(pid, nullptr, 0);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    std::string mode = "all";
+    FakeOrigin::Options origin_options;
+    LoadGenerator::Options load_options;
+    int origin_port = 18080;
+    bool access_log = false;
+    int cluster = 0;
+    bool urls_given = false;
+
+    int i = 1;
+    if (argc > 1 && argv[1][0] != '-') {
+        mode = argv[1];
+        i = 2;
+    }
+    for (; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--connections" && has_value) {
+            load_options.connections = std::atoi(argv[++i]);
+        } else if (arg == "--requests" && has_value) {
+            load_options.requests_per_connection = std::atoi(argv[++i]);
+        } else if (arg == "--size" && has_value) {
+            origin_options.body_size = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--chunked") {
+            origin_options.chunked = true;
+        } else if (arg == "--binary") {
+            origin_options.html = false;
+        } else if (arg == "--hits" && has_value) {
+            origin_options.rewrite_hits = std::atoi(argv[++i]);
+        } else if (arg == "--origin-close") {
+            origin_options.keep_alive = false;
+        } else if (arg == "--client-close") {
+            load_options.keep_alive = false;
+        } else if (arg == "--h2c") {
+            origin_options.h2c = true;
+        } else if (arg == "--urls" && has_value) {
+            load_options.urls = std::max(1, std::atoi(argv[++i]));
+            urls_given = true;
+        } else if (arg == "--cluster" && has_value) {
+            cluster = std::atoi(argv[++i]);
+        } else if (arg == "--access-log") {
+            access_log = true;
+        } else if (arg == "--proxy-port" && has_value) {
+            load_options.proxy_port = std::atoi(argv[++i]);
+        } else if (arg == "--origin-port" && has_value) {
+            origin_port = std::atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "unknown option: %s\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    // a node of --cluster, started by the load test.
+    if (mode == "node") {
+        Logger::instance().setAccessLog(access_log);
+        // the peers may ask this node before it gets its first request.
+        Cluster::instance();
+        ServerProxy server_proxy("127.0.0.1", load_options.proxy_port);
+        if (server_proxy.start() != ServerProxy::StatusCode::SUCCESS) {
+            fprintf(stderr, "failed to start the node on port %d\n", load_options.proxy_port);
+            return 1;
+        }
+        server_proxy.run();
+        return 0;
+    }
+    if (mode == "check") {
+        Logger::instance().setAccessLog(access_log);
+        bool passed = H2Check::Run(origin_port, load_options.proxy_port);
+        Logger::instance().flush();
+        fflush(stdout);
+        // the proxy threads are detached and blocked in accept/recv, dont wait for them.
+        std::_Exit(passed ? 0 : 2);
+    }
+    if (cluster > 0 && (origin_options.chunked || origin_options.h2c)) {
+        // only a Content-Length body from HTTP/1.1 is put into the cache.
+        fprintf(stderr, "--cluster cannot be used with --chunked or --h2c\n");
+        return 1;
+    }
+    if (cluster > 0) {
+        // a html body is rewritten for every client, it is never cached.
+        origin_options.html = false;
+        origin_options.max_age = CLUSTER_ORIGIN_MAX_AGE;
+        if (!urls_given) {
+            load_options.urls = 100;
+        }
+    }
+
+    if (mode == "micro" || mode == "all") {
+        MicroBench::Run();
+    }
+    if (mode != "load" && mode != "all") {
+        return 0;
+    }
+
+    Logger::instance().setAccessLog(access_log);
+    std::string origin_addr = "127.0.0.1:" + std::to_string(origin_port);
+    if (origin_options.h2c) {
+        // read by Http2Client when the proxy sends its first request.
+        setenv("PROXY_H2C_HOSTS", origin_addr.c_str(), 1);
+    }
+
+    FakeOrigin origin(origin_options, "127.0.0.1", origin_port);
+    if (!origin.start()) {
+        fprintf(stderr, "failed to start the fake origin on port %d: %s\n", origin_port, strerror(errno));
+        return 1;
+    }
+
+    std::vector<pid_t> nodes;
+    if (cluster > 0) {
+        load_options.proxies = cluster;
+        nodes = StartCluster(cluster, load_options.proxy_port);
+        for (int n = 0; n < cluster; n++) {
+            if ((int)nodes.size() != cluster ||
+                !WaitListening(load_options.proxy_port + n, CLUSTER_START_TIMEOUT_MS) ||
+                !WaitListening(load_options.proxy_port + CLUSTER_PEER_PORT_OFFSET + n, CLUSTER_START_TIMEOUT_MS)) {
+                fprintf(stderr, "failed to start the cluster node on port %d\n", load_options.proxy_port + n);
+                StopCluster(nodes);
+                return 1;
+            }
+        }
+    } else {
+        static ServerProxy server_proxy("127.0.0.1", load_options.proxy_port);
+        if (server_proxy.start() != ServerProxy::StatusCode::SUCCESS) {
+            fprintf(stderr, "failed to start the proxy on port %d\n", load_options.proxy_port);
+            return 1;
+        }
+        std::thread(&ServerProxy::run, &server_proxy).detach();
+    }
+
+    load_options.url = "http://" + origin_addr + "/index.html";
+    load_options.host_header = origin_addr;
+
+    printf("== load test ==\n");
+    printf("%d connections x %d requests, body %zu bytes, %s, %s, origin %s%s, client %s\n",
+           load_options.connections, load_options.requests_per_connection, origin_options.body_size,
+           origin_options.chunked ? "chunked" : "content-length",
+           origin_options.html ? "text/html" : "binary",
+           origin_options.keep_alive ? "keep-alive" : "close",
+           origin_options.h2c ? " h2c" : "",
+           load_options.keep_alive ? "keep-alive" : "close");
+    if (cluster > 0) {
+        printf("cluster of %d nodes, %d urls\n", cluster, load_options.urls);
+    }
+
+    LoadGenerator load_generator(load_options);
+    LoadGenerator::Report report = load_generator.run();
+    LoadGenerator::Print(report);
+    printf("origin served:   %zu responses\n", origin.Served());
+    bool failed = report.errors > 0 || report.server_errors > 0;
+    if (cluster > 0) {
+        size_t limit = load_options.urls + load_options.urls * CLUSTER_ORIGIN_SLACK_PERCENT / 100;
+        printf("cluster:         %zu origin responses for %d urls (at most %zu, %zu without sharing)\n",
+               origin.Served(), load_options.urls, limit, (size_t)load_options.urls * cluster);
+        if (origin.Served() > limit) {
+            printf("cluster:         FAILED, the nodes did not share the responses\n");
+            failed = true;
+        }
+        StopCluster(nodes);
+        // the nodes have been waited for, so their cpu and max rss are in RUSAGE_CHILDREN.
+        struct rusage usage;
+        getrusage(RUSAGE_CHILDREN, &usage);
+        double nodes_cpu_sec = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+                               (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+        printf("nodes:           %.1f us cpu per request (all %d nodes), max rss %ld KB (the largest node)\n",
+               report.requests > 0 ? nodes_cpu_sec * 1e6 / report.requests : 0, cluster, usage.ru_maxrss);
+    }
+
+    Logger::instance().flush();
+    fflush(stdout);
+    // the proxy threads are detached and blocked in accept/recv, dont wait for them.
+    std::_Exit(failed ? 2 : 0);
+}
@@ -0,0 +1,352 @@
+#ifndef FAKE_ORIGIN_H
+#define FAKE_ORIGIN_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "../http2/Http2_client.hpp"
+
+// FakeOrigin is a local stand-in for the origin server, only used by the benchmark.
+// It answers every request with the same configurable payload:
+// 1. body size
+// 2. Content-Length or chunked encoding
+// 3. text/html with some "Stockholm" in the text (so mix_response has something to rewrite),
+//    or application/octet-stream
+// 4. keep the connection alive, or close it after every response
+// 5. HTTP/1.1, or HTTP/2 without TLS (h2c, prior knowledge), for the upstream HTTP/2 client.
+//    with chunked, the HTTP/2 response has no content-length.
+// 6. "Cache-Control: max-age", so the proxy may cache it (cluster mode).
+// The HTTP/2 responses of a connection are sent a frame at a time in turn, each as far as its stream window
+// allows, so a stream without window does not hold back the others. A stream reset by the client is dropped.
+class FakeOrigin {
+public:
+    struct Options {
+        size_t body_size = 4096;
+        bool chunked = false;
+        bool html = true;
+        int rewrite_hits = 10; // how many "Stockholm" in the html body
+        bool keep_alive = true;
+        size_t chunk_size = 1024;
+        bool h2c = false;
+        int max_age = 0; // no Cache-Control if 0
+    };
+
+    FakeOrigin(Options options, std::string host = "127.0.0.1", int port = 18080)
+        : options{options}, host{host}, port{port} {
+        response = BuildResponse();
+    }
+
+    ~FakeOrigin() {
+        stop();
+    }
+
+    // return false if the origin cannot listen.
+    bool start() {
+        server_socket = socket(AF_INET, SOCK_STREAM, 0);
+        if (server_socket == -1) {
+            return false;
+        }
+        int opt = 1;
+        setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+        sockaddr_in server_addr;
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(port);
+        inet_pton(AF_INET, host.c_str(), &server_addr.sin_addr);
+        if (bind(server_socket, (sockaddr*)&server_addr, sizeof(server_addr)) == -1 ||
+            listen(server_socket, 128) == -1) {
+            close(server_socket);
+            server_socket = -1;
+            return false;
+        }
+        running = true;
+        std::thread(&FakeOrigin::run, this).detach();
+        return true;
+    }
+
+    void stop() {
+        running = false;
+        if (server_socket != -1) {
+            shutdown(server_socket, SHUT_RDWR);
+            close(server_socket);
+            server_socket = -1;
+        }
+    }
+
+    int GetPort() {
+        return port;
+    }
+
+    // how many responses have been sent.
+    size_t Served() {
+        return served.load();
+    }
+
+    // how many connections have been accepted.
+    size_t Connections() {
+        return connections.load();
+    }
+
+    // how many HTTP/2 DATA frames have been sent on a stream while the stream of the DATA frame before
+    // had not ended yet.
+    size_t Interleaved() {
+        return interleaved.load();
+    }
+
+    // how many HTTP/2 streams have been reset by the client.
+    size_t Reset() {
+        return reset.load();
+    }
+
+private:
+    Options options;
+    std::string host;
+    int port;
+    int server_socket = -1;
+    std::atomic<bool> running{false};
+    std::atomic<size_t> served{0};
+    std::atomic<size_t> connections{0};
+    std::atomic<size_t> interleaved{0};
+    std::atomic<size_t> reset{0};
+    // the whole response is built once, every request just sends it.
+    std::string response;
+    // the same for HTTP/2.
+    std::string body;
+
+    std::string BuildBody() {
+        std::string body;
+        if (!options.html) {
+            body.assign(options.body_size, 'x');
+            return body;
+        }
+        body = "<html><head><title>bench</title></head><body>\n";
+        std::string paragraph = "<p>Stockholm is the capital of Sweden, the weather is fine.</p>\n";
+        for (int i = 0; i < options.rewrite_hits; i++) {
+            body += paragraph;
+        }
+        std::string filler = "<p>Nothing to rewrite in this line, just some text.</p>\n";
+        while (body.size() + filler.size() + 15 < options.body_size) {
+            body += filler;
+        }
+        body += "</body></html>\n";
+        return body;
+    }
+
+    std::string BuildResponse() {
+        body = BuildBody();
+        std::string headers = "HTTP/1.1 200 OK\r\n";
+        headers += std::string("Content-Type: ") + (options.html ? "text/html; charset=utf-8" : "application/octet-stream") + "\r\n";
+        headers += std::string("Connection: ") + (options.keep_alive ? "keep-alive" : "close") + "\r\n";
+        if (options.max_age > 0) {
+            headers += "Cache-Control: max-age=" + std::to_string(options.max_age) + "\r\n";
+        }
+        if (!options.chunked) {
+            headers += "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n";
+            return headers + body;
+        }
+        headers += "Transfer-Encoding: chunked\r\n\r\n";
+        std::string chunked_body;
+        char size_line[32];
+        for (size_t pos = 0; pos < body.size(); pos += options.chunk_size) {
+            size_t len = std::min(options.chunk_size, body.size() - pos);
+            snprintf(size_line, sizeof(size_line), "%zx\r\n", len);
+            chunked_body += size_line;
+            chunked_body.append(body, pos, len);
+            chunked_body += "\r\n";
+        }
+        chunked_body += "0\r\n\r\n";
+        return headers + chunked_body;
+    }
+
+    void run() {
+        while (running) {
+            int client_socket = accept(server_socket, nullptr, nullptr);
+            if (client_socket == -1) {
+                return;
+            }
+            int opt = 1;
+            setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+            connections++;
+            if (options.h2c) {
+                std::thread(&FakeOrigin::handle_h2c_client, this, client_socket).detach();
+            } else {
+                std::thread(&FakeOrigin::handle_client, this, client_socket).detach();
+            }
+        }
+    }
+
+    // only the request headers matter, a request ends with "\r\n\r\n".
+    void handle_client(int client_socket) {
+        char buffer[4096];
+        std::string recv_msg;
+        std::string::size_type pos;
+        while (running) {
+            ssize_t bytes_received = recv(client_socket, buffer, sizeof(buffer), 0);
+            if (bytes_received <= 0) {
+                break;
+            }
+            recv_msg.append(buffer, bytes_received);
+            while ((pos = recv_msg.find("\r\n\r\n")) != std::string::npos) {
+                recv_msg.erase(0, pos + 4);
+                if (!SendAll(client_socket, response)) {
+                    close(client_socket);
+                    return;
+                }
+                served++;
+                if (!options.keep_alive) {
+                    close(client_socket);
+                    return;
+                }
+            }
+        }
+        close(client_socket);
+    }
+
+    // a response which is waiting for the flow control windows of the client.
+    struct H2Response {
+        uint32_t stream_id;
+        size_t sent;
+    };
+
+    // every stream ending with END_STREAM gets the response, the request headers are not decoded.
+    void handle_h2c_client(int client_socket) {
+        using namespace Http2Utils;
+        char preface[24];
+        if (!RecvAll(client_socket, preface, sizeof(preface)) || PREFACE.compare(0, 24, preface, 24) != 0) {
+            close(client_socket);
+            return;
+        }
+        HpackEncoder encoder;
+        std::deque<H2Response> responses;
+        std::unordered_map<uint32_t, int64_t> stream_windows;
+        int64_t connection_window = 65535;
+        int64_t initial_window = 65535;
+        SendAll(client_socket, Frame(SETTINGS, 0, 0));
+
+        // the stream of the last DATA frame, and whether it has ended.
+        uint32_t last_stream_id = 0;
+        bool last_ended = true;
+
+        // send as much of the responses as the windows allow, a frame of each in turn.
+        auto flush = [&]() {
+            std::string out;
+            bool progress = true;
+            while (progress) {
+                progress = false;
+                for (auto it = responses.begin(); it != responses.end();) {
+                    int64_t& stream_window = stream_windows[it->stream_id];
+                    size_t len = std::min<int64_t>({(int64_t)(body.size() - it->sent), connection_window, stream_window,
+                                                    (int64_t)H2_MAX_FRAME_SIZE});
+                    if (len == 0 && it->sent < body.size()) {
+                        ++it;
+                        continue;
+                    }
+                    bool last = it->sent + len == body.size();
+                    out += Frame(DATA, last ? END_STREAM : 0, it->stream_id, body.data() + it->sent, len);
+                    if (!last_ended && last_stream_id != it->stream_id) {
+                        interleaved++;
+                    }
+                    last_stream_id = it->stream_id;
+                    last_ended = last;
+                    it->sent += len;
+                    connection_window -= len;
+                    stream_window -= len;
+                    progress = true;
+                    if (last) {
+                        stream_windows.erase(it->stream_id);
+                        it = responses.erase(it);
+                        served++;
+                    } else {
+                        ++it;
+                    }
+                }
+            }
+            return out.empty() || SendAll(client_socket, out);
+        };
+
+        FrameHeader header;
+        std::string payload;
+        while (running && ReadFrame(client_socket, header, payload, H2_MAX_FRAME_SIZE)) {
+            if ((header.type == HEADERS || header.type == DATA) && (header.flags & END_STREAM)) {
+                std::vector<HpackUtils::Header> headers = {
+                    {":status", "200"},
+                    {"content-type", options.html ? "text/html; charset=utf-8" : "application/octet-stream"}};
+                if (!options.chunked) {
+                    headers.push_back({"content-length", std::to_string(body.size())});
+                }
+                if (options.max_age > 0) {
+                    headers.push_back({"cache-control", "max-age=" + std::to_string(options.max_age)});
+                }
+                std::string block;
+                encoder.Encode(headers, block);
+                if (!SendAll(client_socket, Frame(HEADERS, END_HEADERS, header.stream_id, block))) {
+                    break;
+                }
+                stream_windows[header.stream_id] = initial_window;
+                responses.push_back({header.stream_id, 0});
+            } else if (header.type == SETTINGS && (header.flags & ACK) == 0) {
+                for (size_t pos = 0; pos + 6 <= payload.size(); pos += 6) {
+                    uint16_t id = ((uint8_t)payload[pos] << 8) | (uint8_t)payload[pos + 1];
+                    if (id == INITIAL_WINDOW_SIZE) {
+                        int64_t value = GetUint32(payload.data() + pos + 2);
+                        for (auto& window : stream_windows) {
+                            window.second += value - initial_window;
+                        }
+                        initial_window = value;
+                    }
+                }
+                SendAll(client_socket, Frame(SETTINGS, ACK, 0));
+            } else if (header.type == WINDOW_UPDATE && payload.size() == 4) {
+                uint32_t increment = GetUint32(payload.data()) & 0x7fffffff;
+                if (header.stream_id == 0) {
+                    connection_window += increment;
+                } else if (stream_windows.count(header.stream_id) != 0) {
+                    stream_windows[header.stream_id] += increment;
+                }
+            } else if (header.type == RST_STREAM) {
+                auto it = std::find_if(responses.begin(), responses.end(),
+                                       [&](const H2Response& res) { return res.stream_id == header.stream_id; });
+                if (it != responses.end()) {
+                    responses.erase(it);
+                    stream_windows.erase(header.stream_id);
+                    reset++;
+                }
+            } else if (header.type == PING && (header.flags & ACK) == 0) {
+                SendAll(client_socket, Frame(PING, ACK, 0, payload));
+            } else if (header.type == GOAWAY) {
+                break;
+            }
+            if (!flush()) {
+                break;
+            }
+        }
+        close(client_socket);
+    }
+
+    static bool SendAll(int sockfd, const std::string& data) {
+        size_t sent = 0;
+        while (sent < data.size()) {
+            ssize_t n = send(sockfd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) {
+                return false;
+            }
+            sent += n;
+        }
+        return true;
+    }
+};
+
+#endif // FAKE_ORIGIN_H
@@ -0,0 +1,201 @@
+#ifndef H2_CHECK_H
+#define H2_CHECK_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "../http2/Hpack.hpp"
+#include "../server_proxy/Server_proxy.hpp"
+#include "fake_origin.hpp"
+#include "load_generator.hpp"
+
+// Checks of the HTTP/2 client, "./proxy_bench check".
+// 1. HPACK: the header blocks of RFC 7541 appendix C (Huffman, eviction from the dynamic table, size update),
+//    invalid Huffman padding, and our encoder against our decoder with a small table.
+// 2. multiplexing: concurrent clients fetch large bodies from a h2c fake origin through the proxy,
+//    they must share one upstream connection, and the DATA frames of their streams must interleave.
+namespace H2Check {
+    constexpr int H2_CHECK_CONNECTIONS = 8;
+    constexpr int H2_CHECK_REQUESTS = 4;
+    // larger than the window of a stream, so a response has to wait for WINDOW_UPDATE and the others go on.
+    constexpr size_t H2_CHECK_BODY_SIZE = 4 * H2_STREAM_WINDOW;
+    constexpr size_t H2_CHECK_TABLE_SIZE = 256;
+
+    inline bool Expect(bool ok, const std::string& what) {
+        printf("%-60s %s\n", what.c_str(), ok ? "ok" : "FAILED");
+        return ok;
+    }
+
+    inline std::string FromHex(const std::string& hex) {
+        std::string out;
+        for (size_t i = 0; i + 1 < hex.size(); i += 2) {
+            out += (char)std::strtoul(hex.substr(i, 2).c_str(), nullptr, 16);
+        }
+        return out;
+    }
+
+    inline bool SameHeaders(const std::vector<HpackUtils::Header>& a, const std::vector<HpackUtils::Header>& b) {
+        if (a.size() != b.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < a.size(); i++) {
+            if (a[i].name != b[i].name || a[i].value != b[i].value) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // decode the blocks with one decoder, in order, like the HEADERS of a connection.
+    inline bool DecodeAll(const std::vector<std::string>& blocks, const std::vector<std::vector<HpackUtils::Header>>& expected) {
+        HpackDecoder decoder;
+        for (size_t i = 0; i < blocks.size(); i++) {
+            std::vector<HpackUtils::Header> headers;
+            if (!decoder.Decode(FromHex(blocks[i]), headers) || !SameHeaders(headers, expected[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    inline bool Hpack() {
+        bool ok = true;
+
+        // RFC 7541 C.4, requests with Huffman, the dynamic table grows.
+        ok &= Expect(DecodeAll({"828684418cf1e3c2e5f23a6ba0ab90f4ff",
+                                "828684be5886a8eb10649cbf",
+                                "828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf"},
+                               {{{":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"}},
+                                {{":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"},
+                                 {"cache-control", "no-cache"}},
+                                {{":method", "GET"}, {":scheme", "https"}, {":path", "/index.html"},
+                                 {":authority", "www.example.com"}, {"custom-key", "custom-value"}}}),
+                     "hpack: RFC 7541 C.4 requests (Huffman)");
+
+        // RFC 7541 C.6, responses with Huffman in a table of 256 bytes, the old entries are evicted.
+        // the first block starts with a size update to 256 (3fe101), the RFC assumes the table has that size.
+        std::string date1 = "Mon, 21 Oct 2013 20:13:21 GMT";
+        std::string date2 = "Mon, 21 Oct 2013 20:13:22 GMT";
+        ok &= Expect(DecodeAll({"3fe101488264025885aec3771a4b6196d07abe941054d444a8200595040b8166e082a62d1bff6e919d29ad171863c78f0b97c8e9ae82ae43d3",
+                                "4883640effc1c0bf",
+                                "88c16196d07abe941054d444a8200595040b8166e084a62d1bffc05a839bd9ab77ad94e7821dd7f2e6c7b335dfdfcd5b3960d5af27087f3672c1ab270fb5291f9587316065c003ed4ee5b1063d5007"},
+                               {{{":status", "302"}, {"cache-control", "private"}, {"date", date1},
+                                 {"location", "https://www.example.com"}},
+                                {{":status", "307"}, {"cache-control", "private"}, {"date", date1},
+                                 {"location", "https://www.example.com"}},
+                                {{":status", "200"}, {"cache-control", "private"}, {"date", date2},
+                                 {"location", "https://www.example.com"}, {"content-encoding", "gzip"},
+                                 {"set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1"}}}),
+                     "hpack: RFC 7541 C.6 responses (Huffman, eviction)");
+
+        // a size update must come first in a block, and not above the size we allow.
+        std::vector<HpackUtils::Header> headers;
+        ok &= Expect(!HpackDecoder().Decode(FromHex("823fe101"), headers), "hpack: size update after a header is rejected");
+        headers.clear();
+        std::string too_large;
+        HpackUtils::EncodeInteger(HPACK_TABLE_SIZE + 1, 5, 0x20, too_large);
+        ok &= Expect(!HpackDecoder().Decode(too_large, headers), "hpack: size update above the table size is rejected");
+
+        // "a" is 00011, the padding must be the most significant bits of EOS (all 1), and at most 7 bits.
+        std::string out;
+        const uint8_t a_padded[] = {0x1f};
+        const uint8_t a_zero_padding[] = {0x18};
+        const uint8_t long_padding[] = {0xff, 0xff};
+        ok &= Expect(HpackUtils::HuffmanDecode(a_padded, 1, out) && out == "a", "hpack: Huffman padding");
+        ok &= Expect(!HpackUtils::HuffmanDecode(a_zero_padding, 1, out), "hpack: Huffman padding of zeros is rejected");
+        ok &= Expect(!HpackUtils::HuffmanDecode(long_padding, 2, out), "hpack: Huffman padding of 16 bits is rejected");
+
+        // our encoder against our decoder, the table is made small so the entries are evicted all the time.
+        // a wrong eviction on either side makes the indexes point to other headers.
+        HpackEncoder encoder;
+        HpackDecoder decoder;
+        encoder.SetPeerTableSize(H2_CHECK_TABLE_SIZE);
+        bool round_trip = true;
+        bool size_update_sent = false;
+        for (int i = 0; i < 500 && round_trip; i++) {
+            std::vector<HpackUtils::Header> request = {
+                {":method", i % 3 == 0 ? "POST" : "GET"},
+                {":scheme", "http"},
+                {":path", "/page/" + std::to_string(i % 7)},
+                {":authority", "host" + std::to_string(i % 5) + ".example.com"},
+                {"user-agent", "check/" + std::to_string(i % 11)},
+                {"x-check-" + std::to_string(i % 13), std::string(i % 40, 'v')},
+                {"authorization", "Basic " + std::to_string(i)}};
+            std::string block;
+            encoder.Encode(request, block);
+            if (i == 0) {
+                // 001xxxxx, the size update to the smaller table.
+                size_update_sent = !block.empty() && ((uint8_t)block[0] & 0xe0) == 0x20;
+            }
+            std::vector<HpackUtils::Header> decoded;
+            round_trip = decoder.Decode(block, decoded) && SameHeaders(decoded, request);
+        }
+        ok &= Expect(size_update_sent, "hpack: encoder sends the size update of the peer");
+        ok &= Expect(round_trip, "hpack: encoder -> decoder, 500 blocks with eviction");
+
+        // the table size can go down to 0, every header is sent as a literal then.
+        encoder.SetPeerTableSize(0);
+        std::string block;
+        encoder.Encode({{"x-empty-table", "1"}}, block);
+        std::vector<HpackUtils::Header> decoded;
+        ok &= Expect(!block.empty() && block[0] == 0x20 && decoder.Decode(block, decoded) &&
+                         SameHeaders(decoded, {{"x-empty-table", "1"}}),
+                     "hpack: size update to 0");
+        return ok;
+    }
+
+    // the proxy and the fake origin run in this process, the proxy must not have used Http2Client before.
+    inline bool Multiplex(int origin_port, int proxy_port) {
+        std::string origin_addr = "127.0.0.1:" + std::to_string(origin_port);
+        setenv("PROXY_H2C_HOSTS", origin_addr.c_str(), 1);
+
+        FakeOrigin::Options origin_options;
+        origin_options.h2c = true;
+        origin_options.html = false;
+        origin_options.body_size = H2_CHECK_BODY_SIZE;
+        FakeOrigin origin(origin_options, "127.0.0.1", origin_port);
+        if (!origin.start()) {
+            fprintf(stderr, "failed to start the fake origin on port %d: %s\n", origin_port, strerror(errno));
+            return false;
+        }
+        static ServerProxy server_proxy("127.0.0.1", proxy_port);
+        if (server_proxy.start() != ServerProxy::StatusCode::SUCCESS) {
+            fprintf(stderr, "failed to start the proxy on port %d\n", proxy_port);
+            return false;
+        }
+        std::thread(&ServerProxy::run, &server_proxy).detach();
+
+        LoadGenerator::Options load_options;
+        load_options.proxy_port = proxy_port;
+        load_options.url = "http://" + origin_addr + "/index.html";
+        load_options.host_header = origin_addr;
+        load_options.connections = H2_CHECK_CONNECTIONS;
+        load_options.requests_per_connection = H2_CHECK_REQUESTS;
+        LoadGenerator::Report report = LoadGenerator(load_options).run();
+
+        size_t requests = (size_t)H2_CHECK_CONNECTIONS * H2_CHECK_REQUESTS;
+        bool ok = true;
+        ok &= Expect(report.requests == requests && report.errors == 0 && report.server_errors == 0,
+                     "h2: " + std::to_string(requests) + " responses through the proxy, " +
+                         std::to_string(report.requests) + " without errors");
+        ok &= Expect(origin.Served() == requests, "h2: origin served " + std::to_string(origin.Served()));
+        ok &= Expect(origin.Connections() == 1,
+                     "h2: " + std::to_string(H2_CHECK_CONNECTIONS) + " clients, " +
+                         std::to_string(origin.Connections()) + " upstream connection(s)");
+        ok &= Expect(origin.Interleaved() > 0,
+                     "h2: DATA frames of the streams interleaved " + std::to_string(origin.Interleaved()) + " times");
+        return ok;
+    }
+
+    inline bool Run(int origin_port, int proxy_port) {
+        printf("== h2 checks ==\n");
+        bool ok = Hpack();
+        ok &= Multiplex(origin_port, proxy_port);
+        printf("%s\n", ok ? "all checks passed" : "some checks FAILED");
+        return ok;
+    }
+}
+
+#endif // H2_CHECK_H
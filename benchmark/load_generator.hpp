@@ -0,0 +1,319 @@
+#ifndef LOAD_GENERATOR_H
+#define LOAD_GENERATOR_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// LoadGenerator drives the proxy like a lot of browsers.
+// Every connection is a thread, it sends a request through the proxy, waits for the whole response,
+// and records the latency, then sends the next one.
+// The response is read by Content-Length, chunked encoding, or until the connection is closed.
+// A response with a status of 500 or above (such as a 502 or a 503 from the proxy) is counted as a server error.
+// The requests can go to several urls ("?u=0", "?u=1", ...) and the connections to several proxies
+// (proxy_port, proxy_port + 1, ...), both round robin.
+class LoadGenerator {
+public:
+    struct Options {
+        std::string proxy_host = "127.0.0.1";
+        int proxy_port = 27778;
+        int proxies = 1;
+        std::string url = "http://127.0.0.1:18080/index.html";
+        int urls = 1;
+        std::string host_header = "127.0.0.1:18080";
+        int connections = 8;
+        int requests_per_connection = 1000;
+        bool keep_alive = true;
+        int timeout_sec = 5;
+    };
+
+    struct Report {
+        size_t requests = 0;
+        size_t errors = 0;        // the connection failed, or the response is broken
+        size_t server_errors = 0; // the response has arrived, but its status is 5xx
+        size_t bytes = 0;
+        double seconds = 0;
+        double p50_us = 0;
+        double p99_us = 0;
+        double p999_us = 0;
+        double max_us = 0;
+        // cpu time of the whole process, and of the load generator threads only.
+        // the difference is what the proxy (and the fake origin, if it is in the same process) used.
+        double process_cpu_sec = 0;
+        double generator_cpu_sec = 0;
+        long rss_before_kb = 0;
+        long rss_after_kb = 0;
+        long max_rss_kb = 0;
+    };
+
+    explicit LoadGenerator(Options options) : options{options} {}
+
+    Report run() {
+        Report report;
+        latencies.clear();
+        long rss_before = CurrentRssKb();
+        double cpu_before = ProcessCpuSec();
+        auto start = std::chrono::steady_clock::now();
+
+        std::vector<std::thread> threads;
+        for (int i = 0; i < options.connections; i++) {
+            threads.emplace_back(&LoadGenerator::worker, this, i);
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        auto end = std::chrono::steady_clock::now();
+        report.seconds = std::chrono::duration<double>(end - start).count();
+        report.process_cpu_sec = ProcessCpuSec() - cpu_before;
+        report.generator_cpu_sec = generator_cpu_ns.load() / 1e9;
+        report.rss_before_kb = rss_before;
+        report.rss_after_kb = CurrentRssKb();
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        report.max_rss_kb = usage.ru_maxrss;
+
+        report.requests = latencies.size();
+        report.errors = errors.load();
+        report.server_errors = server_errors.load();
+        report.bytes = bytes.load();
+        if (!latencies.empty()) {
+            std::sort(latencies.begin(), latencies.end());
+            report.p50_us = Percentile(0.50);
+            report.p99_us = Percentile(0.99);
+            report.p999_us = Percentile(0.999);
+            report.max_us = latencies.back();
+        }
+        return report;
+    }
+
+    static void Print(const Report& report, FILE* out = stdout) {
+        double per_request = report.requests > 0 ? 1.0 / report.requests : 0;
+        fprintf(out, "requests:        %zu (errors: %zu, 5xx: %zu)\n", report.requests, report.errors, report.server_errors);
+        fprintf(out, "throughput:      %.1f req/s, %.2f MB/s\n",
+                report.requests / report.seconds, report.bytes / report.seconds / 1e6);
+        fprintf(out, "latency:         p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us\n",
+                report.p50_us, report.p99_us, report.p999_us, report.max_us);
+        fprintf(out, "cpu per request: %.1f us (process), %.1f us (without load generator)\n",
+                report.process_cpu_sec * 1e6 * per_request,
+                (report.process_cpu_sec - report.generator_cpu_sec) * 1e6 * per_request);
+        fprintf(out, "rss:             %ld KB -> %ld KB (%.3f KB per request), max %ld KB\n",
+                report.rss_before_kb, report.rss_after_kb,
+                (report.rss_after_kb - report.rss_before_kb) * per_request, report.max_rss_kb);
+    }
+
+    // read one whole response, the bytes after it stay in recv_msg.
+    // return the size of the response, or -1 if failed. its status code goes to status, if given.
+    static long ReadResponse(int sockfd, std::string& recv_msg, int* status = nullptr) {
+        char buffer[16384];
+        size_t head_end;
+        while ((head_end = recv_msg.find("\r\n\r\n")) == std::string::npos) {
+            ssize_t n = recv(sockfd, buffer, sizeof(buffer), 0);
+            if (n <= 0) {
+                return -1;
+            }
+            recv_msg.append(buffer, n);
+        }
+        head_end += 4;
+        std::string headers = recv_msg.substr(0, head_end);
+        if (status != nullptr) {
+            // "HTTP/1.1 200 OK"
+            size_t space_pos = headers.find(' ');
+            *status = space_pos == std::string::npos ? 0 : std::atoi(headers.c_str() + space_pos + 1);
+        }
+        for (auto& c : headers) {
+            c = tolower(c);
+        }
+
+        size_t total = 0;
+        size_t content_length_pos = headers.find("content-length:");
+        if (content_length_pos != std::string::npos) {
+            total = head_end + std::strtoul(headers.c_str() + content_length_pos + 15, nullptr, 10);
+            while (recv_msg.size() < total) {
+                ssize_t n = recv(sockfd, buffer, sizeof(buffer), 0);
+                if (n <= 0) {
+                    return -1;
+                }
+                recv_msg.append(buffer, n);
+            }
+        } else if (headers.find("transfer-encoding: chunked") != std::string::npos) {
+            // walk the chunks, the last one is "0\r\n\r\n".
+            size_t pos = head_end;
+            while (true) {
+                size_t line_end;
+                while ((line_end = recv_msg.find("\r\n", pos)) == std::string::npos) {
+                    ssize_t n = recv(sockfd, buffer, sizeof(buffer), 0);
+                    if (n <= 0) {
+                        return -1;
+                    }
+                    recv_msg.append(buffer, n);
+                }
+                size_t chunk_size = std::strtoul(recv_msg.c_str() + pos, nullptr, 16);
+                size_t next = line_end + 2 + chunk_size + 2;
+                while (recv_msg.size() < next) {
+                    ssize_t n = recv(sockfd, buffer, sizeof(buffer), 0);
+                    if (n <= 0) {
+                        return -1;
+                    }
+                    recv_msg.append(buffer, n);
+                }
+                pos = next;
+                if (chunk_size == 0) {
+                    break;
+                }
+            }
+            total = pos;
+        } else {
+            ssize_t n;
+            while ((n = recv(sockfd, buffer, sizeof(buffer), 0)) > 0) {
+                recv_msg.append(buffer, n);
+            }
+            total = recv_msg.size();
+        }
+        recv_msg.erase(0, total);
+        return (long)total;
+    }
+
+private:
+    Options options;
+    std::mutex latencies_mutex;
+    std::vector<double> latencies; // us
+    std::atomic<size_t> errors{0};
+    std::atomic<size_t> server_errors{0};
+    std::atomic<size_t> bytes{0};
+    std::atomic<int64_t> generator_cpu_ns{0};
+
+    double Percentile(double p) {
+        size_t index = (size_t)(p * (latencies.size() - 1));
+        return latencies[index];
+    }
+
+    static double ProcessCpuSec() {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+               (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    }
+
+    static int64_t ThreadCpuNs() {
+        struct timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+    static long CurrentRssKb() {
+        long pages = 0, resident = 0;
+        FILE* statm = fopen("/proc/self/statm", "r");
+        if (statm == nullptr) {
+            return 0;
+        }
+        if (fscanf(statm, "%ld %ld", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(statm);
+        return resident * (sysconf(_SC_PAGESIZE) / 1024);
+    }
+
+    int Connect(int port) {
+        int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+        if (sockfd < 0) {
+            return -1;
+        }
+        int opt = 1;
+        setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        struct timeval timeout;
+        timeout.tv_sec = options.timeout_sec;
+        timeout.tv_usec = 0;
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        sockaddr_in proxy_addr;
+        memset(&proxy_addr, 0, sizeof(proxy_addr));
+        proxy_addr.sin_family = AF_INET;
+        proxy_addr.sin_port = htons(port);
+        inet_pton(AF_INET, options.proxy_host.c_str(), &proxy_addr.sin_addr);
+        if (connect(sockfd, (sockaddr*)&proxy_addr, sizeof(proxy_addr)) < 0) {
+            close(sockfd);
+            return -1;
+        }
+        return sockfd;
+    }
+
+    void worker(int index) {
+        std::vector<std::string> requests;
+        for (int u = 0; u < options.urls; u++) {
+            std::string url = options.urls > 1 ? options.url + "?u=" + std::to_string(u) : options.url;
+            requests.push_back("GET " + url + " HTTP/1.1\r\n"
+                               "Host: " + options.host_header + "\r\n"
+                               "User-Agent: proxy_bench\r\n"
+                               "Accept: */*\r\n"
+                               "Connection: " + (options.keep_alive ? "keep-alive" : "close") + "\r\n\r\n");
+        }
+        int port = options.proxy_port + index % std::max(options.proxies, 1);
+        std::vector<double> local_latencies;
+        local_latencies.reserve(options.requests_per_connection);
+        int64_t cpu_start = ThreadCpuNs();
+
+        int sockfd = -1;
+        std::string recv_msg;
+        for (int i = 0; i < options.requests_per_connection; i++) {
+            if (sockfd == -1) {
+                sockfd = Connect(port);
+                recv_msg.clear();
+                if (sockfd == -1) {
+                    errors++;
+                    continue;
+                }
+            }
+            // the connections take turns, they dont ask for the same url at the same time.
+            const std::string& request = requests[((size_t)i * options.connections + index) % requests.size()];
+            auto start = std::chrono::steady_clock::now();
+            long response_size = -1;
+            int status = 0;
+            if (send(sockfd, request.data(), request.size(), MSG_NOSIGNAL) == (ssize_t)request.size()) {
+                response_size = ReadResponse(sockfd, recv_msg, &status);
+            }
+            auto end = std::chrono::steady_clock::now();
+            if (response_size < 0) {
+                errors++;
+                close(sockfd);
+                sockfd = -1;
+                continue;
+            }
+            if (status >= 500) {
+                server_errors++;
+            }
+            bytes += response_size;
+            local_latencies.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+            if (!options.keep_alive) {
+                close(sockfd);
+                sockfd = -1;
+            }
+        }
+        if (sockfd != -1) {
+            close(sockfd);
+        }
+
+        generator_cpu_ns += ThreadCpuNs() - cpu_start;
+        std::lock_guard<std::mutex> lock_guard_(latencies_mutex);
+        latencies.insert(latencies.end(), local_latencies.begin(), local_latencies.end());
+    }
+};
+
+#endif // LOAD_GENERATOR_H
@@ -0,0 +1,156 @@
+#ifndef MICRO_BENCH_H
+#define MICRO_BENCH_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <thread>
+
+#include "../http_handler/http_handler.hpp"
+#include "../blocking_queue/Blocking_queue.hpp"
+#include "../client_proxy/client_proxy.hpp"
+
+// Microbenchmarks of the hot functions, no socket is involved.
+namespace MicroBench {
+    // the result is used by the benchmarks, so the compiler cannot drop the work.
+    inline size_t sink = 0;
+
+    // run the function iterations times, print the time per iteration.
+    inline void Measure(const char* name, long iterations, const std::function<void()>& function) {
+        // warm up
+        for (long i = 0; i < iterations / 10 + 1; i++) {
+            function();
+        }
+        auto start = std::chrono::steady_clock::now();
+        for (long i = 0; i < iterations; i++) {
+            function();
+        }
+        auto end = std::chrono::steady_clock::now();
+        double ns = std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+        printf("%-40s %12.1f ns/op %12.0f op/s\n", name, ns, 1e9 / ns);
+    }
+
+    inline std::string SampleRequest() {
+        return "GET http://www.example.com/fakenews/index.html HTTP/1.1\r\n"
+               "Host: www.example.com\r\n"
+               "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:130.0) Gecko/20100101 Firefox/130.0\r\n"
+               "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+               "Accept-Language: en-US,en;q=0.5\r\n"
+               "Accept-Encoding: gzip, deflate\r\n"
+               "Connection: keep-alive\r\n"
+               "Upgrade-Insecure-Requests: 1\r\n\r\n";
+    }
+
+    inline std::string SampleResponseHeaders() {
+        return "HTTP/1.1 200 OK\r\n"
+               "Date: Mon, 19 Oct 2026 10:00:00 GMT\r\n"
+               "Server: Apache/2.4.62\r\n"
+               "Last-Modified: Mon, 12 Oct 2026 10:00:00 GMT\r\n"
+               "Accept-Ranges: bytes\r\n"
+               "Content-Length: 4096\r\n"
+               "Keep-Alive: timeout=5, max=100\r\n"
+               "Connection: Keep-Alive\r\n"
+               "Content-Type: text/html; charset=UTF-8\r\n\r\n";
+    }
+
+    inline std::string SampleHtml(size_t size, int hits) {
+        std::string html = "<html><head><title>bench</title></head><body>\n";
+        for (int i = 0; i < hits; i++) {
+            html += "<p>Stockholm is the capital of Sweden, <a href=\"/stockholm.html\">read more</a>.</p>\n";
+        }
+        while (html.size() < size) {
+            html += "<p>Nothing to rewrite in this line, just some text.</p>\n";
+        }
+        html += "</body></html>\n";
+        return html;
+    }
+
+    inline void Run() {
+        printf("== microbenchmarks ==\n");
+
+        std::string request = SampleRequest();
+        Measure("HttpHandler parse request", 200000, [&] {
+            HttpHandler handler;
+            handler.SetHttpHandler(request);
+            sink += handler.GetHost().size();
+        });
+
+        Measure("HttpHandler parse + GetRequest", 50000, [&] {
+            HttpHandler handler;
+            handler.SetHttpHandler(request);
+            sink += handler.GetRequest().size();
+        });
+
+        std::string response_headers = SampleResponseHeaders();
+        Measure("HttpHandler parse response headers", 200000, [&] {
+            HttpHandler handler;
+            handler.SetHttpHandler(response_headers);
+            sink += handler.GetContentType().size();
+        });
+
+        for (size_t size : {4096, 65536}) {
+            std::string html = SampleHtml(size, 10);
+            std::string name = "mix_response " + std::to_string(size / 1024) + " KB html";
+            Measure(name.c_str(), size > 4096 ? 200 : 2000, [&] {
+                std::string body = html;
+                ClientProxy::mix_response(body);
+                sink += body.size();
+            });
+        }
+
+        // the gzip html pipeline of recvResponse, the level trades cpu for bandwidth.
+        std::string html = SampleHtml(65536, 10);
+        std::string gzip_html;
+        {
+            ZlibEncoder encoder(false, 6);
+            encoder.Update(html.data(), html.size(), gzip_html);
+            encoder.Finish(gzip_html);
+        }
+        for (int level : {1, 6, 9}) {
+            CompressionUtils::GetConfig().level = level;
+            size_t output_size = 0;
+            std::string name = "gunzip+mix+gzip 64 KB level " + std::to_string(level);
+            Measure(name.c_str(), 200, [&] {
+                BodyPipeline pipeline("gzip", ClientProxy::mix_response, "gzip");
+                std::string out;
+                for (size_t pos = 0; pos < gzip_html.size(); pos += MAX_LEN) {
+                    pipeline.Update(gzip_html.data() + pos, std::min(gzip_html.size() - pos, (size_t)MAX_LEN), out);
+                }
+                pipeline.Finish(out);
+                output_size = out.size();
+                sink += out.size();
+            });
+            printf("%-40s %12zu bytes (from %zu)\n", "  output", output_size, html.size());
+        }
+
+        BlockingQueue<ClientProxyUtils::Node> queue;
+        ClientProxyUtils::Node node;
+        node.client_socket = 1;
+        node.connection_id = 1;
+        node.res = response_headers + SampleHtml(4096, 10);
+        Measure("BlockingQueue push + pop (1 thread)", 1000000, [&] {
+            queue.push(node);
+            sink += queue.pop().res.size();
+        });
+
+        // one producer, one consumer, like the recv threads and handle_response.
+        const long items = 200000;
+        auto start = std::chrono::steady_clock::now();
+        std::thread consumer([&] {
+            for (long i = 0; i < items; i++) {
+                sink += queue.pop().res.size();
+            }
+        });
+        for (long i = 0; i < items; i++) {
+            queue.push(node);
+        }
+        consumer.join();
+        auto end = std::chrono::steady_clock::now();
+        double ns = std::chrono::duration<double, std::nano>(end - start).count() / items;
+        printf("%-40s %12.1f ns/op %12.0f op/s\n", "BlockingQueue producer -> consumer", ns, 1e9 / ns);
+    }
+}
+
+#endif // MICRO_BENCH_H
@@ -4,11 +4,12 @@
 #include <mutex>
 #include <condition_variable>
 #include <queue>
+#include <utility>
 
 // BlockingQueue is a thread-safe queue.
 // Using mutex and condition_variable to implement the blocking queue.
 // So we don't need to use sleep to wait for the queue to be empty.
-// It provides two functions: push and pop.
+// It provides three functions: push, pop and try_pop.
 // If the queue is empty, the pop function will block the thread.
 template <typename T>
 class BlockingQueue {
@@ -26,9 +27,10 @@ public:
 
 	// push an element into the queue
 	// notify the waiting thread
+	// the element is moved, not copied, a response may be large.
 	void push(T element) {
 		std::unique_lock<std::mutex> lock_(mutex_);
-		que.push(element);
+		que.push(std::move(element));
 		// notify the waiting thread
 		cond_var.notify_one();
 	}
@@ -41,10 +43,21 @@ public:
 		// and wait for the condition_variable to be notified.
 		// when the queue is not empty, the thread will be woken up.
 		cond_var.wait(lock_, [this] { return !que.empty(); });
-		T tmp_element = que.front();
+		T tmp_element = std::move(que.front());
 		que.pop();
 		return tmp_element;
 	}
+
+	// pop an element if there is one, never blocks.
+	bool try_pop(T& element) {
+		std::unique_lock<std::mutex> lock_(mutex_);
+		if (que.empty()) {
+			return false;
+		}
+		element = std::move(que.front());
+		que.pop();
+		return true;
+	}
 };
 
 #endif // BLOCKING_QUEUE_H
\ No newline at end of file
@@ -0,0 +1,321 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <list>
+#include <mutex>
+#include <string>
+#include <strings.h>
+#include <unordered_map>
+
+#include "../http_handler/http_handler.hpp"
+
+// the memory of all the cached responses, the least recently used ones are evicted above it.
+constexpr size_t CACHE_MAX_BYTES = 64 * 1024 * 1024;
+// a single response larger than this is not cached.
+constexpr size_t CACHE_MAX_ENTRY_BYTES = 1024 * 1024;
+// a response is never kept longer than this, whatever its max-age says.
+constexpr int CACHE_MAX_TTL_SEC = 3600;
+
+namespace ResponseCacheUtils {
+    struct Stats {
+        std::atomic<uint64_t> hits{0};
+        std::atomic<uint64_t> misses{0};
+        std::atomic<uint64_t> stored{0};
+        std::atomic<uint64_t> evicted{0};
+        // the prefetched responses which a client asked for, and the ones which expired or were evicted unused.
+        std::atomic<uint64_t> prefetch_used{0};
+        std::atomic<uint64_t> prefetch_wasted{0};
+    };
+
+    // the Cache-Control directives the cache cares about, the unknown ones are ignored.
+    struct CacheControl {
+        bool no_store = false;
+        bool no_cache = false; // the response may only be used after revalidation, which the cache cannot do.
+        bool is_private = false;
+        bool is_public = false; // it may be shared even with a request which is personal (Cookie).
+        int max_age = -1; // -1 if not given
+        int s_maxage = -1;
+    };
+
+    // "no-cache, max-age=60, s-maxage=\"30\"": the directive names are exact and case insensitive.
+    inline CacheControl ParseCacheControl(const std::string& value) {
+        CacheControl cache_control;
+        size_t pos = 0;
+        while (pos < value.size()) {
+            size_t end = value.find(',', pos);
+            if (end == std::string::npos) {
+                end = value.size();
+            }
+            size_t begin = value.find_first_not_of(" \t", pos);
+            size_t last = value.find_last_not_of(" \t", end - 1);
+            pos = end + 1;
+            if (begin == std::string::npos || begin >= end || last < begin) {
+                continue;
+            }
+            std::string directive = value.substr(begin, last - begin + 1);
+            std::string argument;
+            size_t equal_pos = directive.find('=');
+            if (equal_pos != std::string::npos) {
+                argument = directive.substr(equal_pos + 1);
+                directive.erase(equal_pos);
+                if (argument.size() >= 2 && argument.front() == '"' && argument.back() == '"') {
+                    argument = argument.substr(1, argument.size() - 2);
+                }
+            }
+            bool is_number = !argument.empty() && argument.find_first_not_of("0123456789") == std::string::npos;
+            if (strcasecmp(directive.c_str(), "no-store") == 0) {
+                cache_control.no_store = true;
+            } else if (strcasecmp(directive.c_str(), "no-cache") == 0) {
+                cache_control.no_cache = true;
+            } else if (strcasecmp(directive.c_str(), "private") == 0) {
+                cache_control.is_private = true;
+            } else if (strcasecmp(directive.c_str(), "public") == 0) {
+                cache_control.is_public = true;
+            } else if (strcasecmp(directive.c_str(), "max-age") == 0) {
+                // a broken max-age means the response is stale.
+                cache_control.max_age = is_number ? (int)std::min(std::atol(argument.c_str()), (long)CACHE_MAX_TTL_SEC) : 0;
+            } else if (strcasecmp(directive.c_str(), "s-maxage") == 0) {
+                cache_control.s_maxage = is_number ? (int)std::min(std::atol(argument.c_str()), (long)CACHE_MAX_TTL_SEC) : 0;
+            }
+        }
+        return cache_control;
+    }
+
+    // the Cache-Control of the response, "Pragma: no-cache" counts as no-cache without it.
+    inline CacheControl ResponseCacheControl(const std::string& headers) {
+        std::string value = HttpHandler::GetField(headers, "Cache-Control");
+        if (value.empty()) {
+            value = HttpHandler::GetField(headers, "Pragma");
+        }
+        return ParseCacheControl(value);
+    }
+
+    // "Sun, 06 Nov 1994 08:49:37 GMT" -> unix time, -1 if it is not such a date.
+    inline time_t ParseHttpDate(const std::string& date) {
+        struct tm tm_date = {};
+        const char* end = strptime(date.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm_date);
+        if (end == nullptr || *end != '\0') {
+            return -1;
+        }
+        return timegm(&tm_date);
+    }
+}
+
+// ResponseCache keeps whole responses (headers with Content-Length, and the body), ready to send to a client.
+// The key is "host:port/path", see Key().
+class ResponseCache {
+private:
+    struct Entry {
+        std::string response;
+        std::chrono::steady_clock::time_point expires_at;
+        bool prefetched;
+        bool used;
+        bool is_public;
+        std::list<std::string>::iterator lru_it;
+    };
+
+    std::mutex mutex_;
+    std::unordered_map<std::string, Entry> entries;
+    std::list<std::string> lru; // the most recently used key is at the front.
+    size_t bytes = 0;
+    ResponseCacheUtils::Stats stats;
+
+    ResponseCache() = default;
+
+    // call with the mutex locked.
+    void Erase(std::unordered_map<std::string, Entry>::iterator it) {
+        if (it->second.prefetched && !it->second.used) {
+            stats.prefetch_wasted++;
+        }
+        bytes -= it->second.response.size();
+        lru.erase(it->second.lru_it);
+        entries.erase(it);
+    }
+
+public:
+    ResponseCache(const ResponseCache&) = delete;
+    ResponseCache& operator=(const ResponseCache&) = delete;
+
+    static ResponseCache& instance() {
+        static ResponseCache cache;
+        return cache;
+    }
+
+    // "http://host:port/path?query" -> "/path?query", a path is returned as it is.
+    static std::string OriginForm(const std::string& url) {
+        size_t scheme_pos = url.find("://");
+        if (scheme_pos == std::string::npos) {
+            return url;
+        }
+        size_t path_pos = url.find('/', scheme_pos + 3);
+        return path_pos == std::string::npos ? "/" : url.substr(path_pos);
+    }
+
+    // "http://Example.com:8080/a.png" on example.com:8080 -> "example.com:8080/a.png"
+    static std::string Key(const std::string& host, int port, const std::string& url) {
+        std::string path = OriginForm(url);
+        std::string key = host;
+        for (auto& c : key) {
+            c = tolower(c);
+        }
+        return key + ":" + std::to_string(port) + path;
+    }
+
+    // can a response with these headers be cached and sent to any client?
+    // public_only: it answers a request with Cookie, it is only shared if it says "public".
+    static bool IsCacheable(const std::string& headers, bool public_only = false) {
+        if (headers.compare(0, 12, "HTTP/1.1 200") != 0 && headers.compare(0, 12, "HTTP/1.0 200") != 0) {
+            return false;
+        }
+        // no-cache would need a revalidation with the server before every use, the cache never revalidates.
+        ResponseCacheUtils::CacheControl cache_control = ResponseCacheUtils::ResponseCacheControl(headers);
+        return !cache_control.no_store && !cache_control.no_cache && !cache_control.is_private &&
+               (!public_only || cache_control.is_public) &&
+               HttpHandler::GetField(headers, "Set-Cookie").empty() && VariesByEncodingOnly(headers);
+    }
+
+    // the key has no request header in it, a response which varies by one cannot be shared.
+    // Accept-Encoding is the only exception: only identity bodies are cached, every client accepts them.
+    static bool VariesByEncodingOnly(const std::string& headers) {
+        std::string vary = HttpHandler::GetField(headers, "Vary");
+        size_t pos = 0;
+        while (pos < vary.size()) {
+            size_t end = std::min(vary.find(',', pos), vary.size());
+            size_t begin = vary.find_first_not_of(" \t", pos);
+            size_t last = vary.find_last_not_of(" \t", end - 1);
+            pos = end + 1;
+            if (begin == std::string::npos || begin >= end || last < begin) {
+                continue;
+            }
+            if (last - begin + 1 != 15 || strncasecmp(vary.c_str() + begin, "accept-encoding", 15) != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // is the cached response (headers and body) marked "public"?
+    static bool IsPublic(const std::string& response) {
+        return ResponseCacheUtils::ResponseCacheControl(response.substr(0, response.find("\r\n\r\n") + 4)).is_public;
+    }
+
+    // a request with Cookie may get a personal response, it only shares the public ones.
+    static bool HasCookie(const std::string& request) {
+        return !HttpHandler::GetField(request, "Cookie").empty();
+    }
+
+    // can the response to this request be shared with the other clients (and come from the cache)?
+    // only a plain GET, not a personal (Authorization) or partial (Range) one.
+    // a request with Cookie is one too, but see HasCookie().
+    static bool IsCacheableRequest(const std::string& request) {
+        if (request.compare(0, 4, "GET ") != 0) {
+            return false;
+        }
+        std::string lower_request = request;
+        for (auto& c : lower_request) {
+            c = tolower(c);
+        }
+        return lower_request.find("\r\nauthorization:") == std::string::npos &&
+               lower_request.find("\r\nrange:") == std::string::npos;
+    }
+
+    // how long the response is fresh, from "Cache-Control: s-maxage" (for a shared cache), "max-age",
+    // or else "Expires" (against "Date"), at most CACHE_MAX_TTL_SEC.
+    // 0 if it must not be stored (no-cache, no-store, private), then it is not cached.
+    // if it says nothing, heuristic (a 200 may get a heuristic freshness, RFC 9111 4.2.2).
+    // a cached response is never used stale, so must-revalidate and proxy-revalidate are kept too.
+    static int MaxAge(const std::string& headers, int heuristic = 0) {
+        ResponseCacheUtils::CacheControl cache_control = ResponseCacheUtils::ResponseCacheControl(headers);
+        if (cache_control.no_store || cache_control.no_cache || cache_control.is_private) {
+            return 0;
+        }
+        long max_age = cache_control.s_maxage >= 0 ? cache_control.s_maxage : cache_control.max_age;
+        if (max_age < 0) {
+            std::string expires = HttpHandler::GetField(headers, "Expires");
+            if (expires.empty()) {
+                return std::min(heuristic, CACHE_MAX_TTL_SEC);
+            }
+            // an invalid date (such as "0") means already expired.
+            time_t expires_at = ResponseCacheUtils::ParseHttpDate(expires);
+            time_t date = ResponseCacheUtils::ParseHttpDate(HttpHandler::GetField(headers, "Date"));
+            if (date == -1) {
+                date = time(nullptr);
+            }
+            max_age = expires_at == -1 ? 0 : (long)(expires_at - date);
+        }
+        return (int)std::min(std::max(max_age, 0L), (long)CACHE_MAX_TTL_SEC);
+    }
+
+    // copy the cached response into response, return false if it is not cached.
+    // ttl_sec (if not nullptr) gets the seconds it has left.
+    // public_only: a response which is not marked "public" counts as not cached.
+    bool Get(const std::string& key, std::string& response, int* ttl_sec = nullptr, bool public_only = false) {
+        std::lock_guard<std::mutex> lock_guard_(mutex_);
+        auto it = entries.find(key);
+        if (it == entries.end() || (public_only && !it->second.is_public)) {
+            stats.misses++;
+            return false;
+        }
+        if (it->second.expires_at <= std::chrono::steady_clock::now()) {
+            Erase(it);
+            stats.misses++;
+            return false;
+        }
+        lru.splice(lru.begin(), lru, it->second.lru_it);
+        if (it->second.prefetched && !it->second.used) {
+            stats.prefetch_used++;
+        }
+        it->second.used = true;
+        stats.hits++;
+        response = it->second.response;
+        if (ttl_sec != nullptr) {
+            *ttl_sec = (int)std::chrono::duration_cast<std::chrono::seconds>(
+                it->second.expires_at - std::chrono::steady_clock::now()).count();
+        }
+        return true;
+    }
+
+    bool Contains(const std::string& key) {
+        std::lock_guard<std::mutex> lock_guard_(mutex_);
+        auto it = entries.find(key);
+        return it != entries.end() && it->second.expires_at > std::chrono::steady_clock::now();
+    }
+
+    // prefetched: it is put by the prefetcher, no client has asked for it yet.
+    void Put(const std::string& key, const std::string& response, int ttl_sec, bool prefetched) {
+        if (response.size() > CACHE_MAX_ENTRY_BYTES) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock_guard_(mutex_);
+        auto it = entries.find(key);
+        if (it != entries.end()) {
+            Erase(it);
+        }
+        while (bytes + response.size() > CACHE_MAX_BYTES && !lru.empty()) {
+            Erase(entries.find(lru.back()));
+            stats.evicted++;
+        }
+        lru.push_front(key);
+        entries[key] = Entry{response, std::chrono::steady_clock::now() + std::chrono::seconds(ttl_sec),
+                             prefetched, false, IsPublic(response), lru.begin()};
+        bytes += response.size();
+        stats.stored++;
+    }
+
+    ResponseCacheUtils::Stats& GetStats() {
+        return stats;
+    }
+
+    size_t Bytes() {
+        std::lock_guard<std::mutex> lock_guard_(mutex_);
+        return bytes;
+    }
+};
+
+#endif // RESPONSE_CACHE_H
@@ -1,59 +1,160 @@
+#ifndef CLIENT_PROXY_H
+#define CLIENT_PROXY_H
+
 #include <iostream>
 #include <string>
 #include <cstring>
+#include <strings.h>
 #include <cstdlib>
 #include <unordered_map>
+#include <vector>
+#include <memory>
 #include <mutex>
+#include <condition_variable>
+#include <future>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <arpa/inet.h>  
+#include <netinet/tcp.h>
 
 #include "../http_handler/http_handler.hpp"
+#include "../http_handler/body_framer.hpp"
 #include "../blocking_queue/Blocking_queue.hpp"
+#include "../logger/Logger.hpp"
+#include "../trace/Trace.hpp"
+#include "../compression/body_pipeline.hpp"
+#include "../dns/Dns_cache.hpp"
+#include "../prefetch/Prefetcher.hpp"
+#include "../cluster/Cluster.hpp"
+#include "../http2/Http2_client.hpp"
+#include "../admission/Admission_control.hpp"
+#include "connection_pool.hpp"
 
 #include <thread>
 #include <regex>
+#include <chrono>
 
 
 constexpr int MAX_LEN = 4096;
 constexpr int TIMEOUT = 3000;
+// a response body is sent to the client in pieces of about this size,
+// or smaller if the server has nothing more for now.
+constexpr size_t STREAM_PIECE_SIZE = 32768;
 
 namespace ClientProxyUtils {
+    // a request which has been sent to the server, but its response hasn't arrived yet.
+    // the responses come back in the same order, so the recv thread pops one for each response.
+    struct PendingRequest {
+        std::string method;
+        std::string path;
+        std::chrono::steady_clock::time_point sent_at;
+        uint64_t trace_id; // the request id in the trace, 0 if not captured.
+        std::string accept_encoding; // what the client accepts, the server only sees what we can decode.
+        bool cache_store = false; // the response may be put into the ResponseCache for the other clients.
+        bool client_http10 = false; // the client sent a HTTP/1.0 request, it does not know chunked.
+        bool cookie = false; // the request has a Cookie, only a public response to it may be cached.
+    };
+
     struct SocketInfo {
-        int sockfd;
+        int sockfd; // -1 for a HTTP/2 server, its connection is shared by all the clients.
         std::shared_ptr<std::mutex> own_socket_mutex;
+        std::shared_ptr<BlockingQueue<PendingRequest>> pending_requests;
+        // the HTTP/2 streams of this client to the server, in the order of the requests.
+        std::shared_ptr<Http2ResponseReader::StreamQueue> streams;
     };
 
+    // a response made by the proxy itself, such as "502 Bad Gateway".
+    inline std::string ErrorResponse(const std::string& status, const std::string& extra_headers = "") {
+        return "HTTP/1.1 " + status + "\r\n"
+               "Content-Type: text/plain\r\n"
+               "Content-Length: " + std::to_string(status.size()) + "\r\n" +
+               extra_headers +
+               "\r\n" + status;
+    }
+
+    // a connection of a client.
+    // the kernel gives the number of a closed socket to the next connection at once, so a response is
+    // addressed by the socket and the id of the connection, which is never used again.
+    struct ClientConnection {
+        uint64_t id;
+        // held by handle_response while it sends to the socket, and by releaseClient.
+        std::mutex send_mutex;
+        bool released = false; // the socket may be closed, or belong to another client already.
+    };
+
+    // a response, or a piece of it, to send to the client.
+    // the pieces of a response are pushed in order, the last one finishes the response.
      struct Node {
         int client_socket;
+        uint64_t connection_id; // dropped if the connection has been released.
         std::string res;
+        // for the access log.
+        std::string host;
+        std::string status_code;
+        PendingRequest request;
+        std::chrono::steady_clock::time_point recv_done;
+        bool last = true;
+        size_t sent_before = 0; // the size of the pieces before this one.
+        bool close_client = false; // the response is broken, close the client connection after it.
+        bool admitted = true; // false for a response which sheds the request, it has never been in flight.
+        // if set, tells whether the whole node has been sent to the client, once handle_response is done with it.
+        std::shared_ptr<std::promise<bool>> sent = nullptr;
     };
 }
 namespace SharedBlockingQueue {
     BlockingQueue<ClientProxyUtils::Node> blocking_que;
+
+    // every push goes through here, the bytes in the queue are limited by the AdmissionControl.
+    inline void push(ClientProxyUtils::Node&& node) {
+        AdmissionControl::instance().Queued(node.res.size());
+        blocking_que.push(std::move(node));
+    }
 }
 
 class ClientProxy {
 private:
-    // store the map of host and socket
-    // when the host is already exist, we can reuse the socket.
+    // store the map of (client socket, host, port) and socket
+    // when the host is already exist for this client, we can reuse the socket.
+    // the key includes the client socket, because the recv thread of a socket
+    // sends all the responses to the client who created it.
     // node also contains a mutex to protect the socket.(To avoid use the same socket at the same time, such as send and recv)
     // use a mutex to protect the map.
     inline static std::unordered_map<std::string, ClientProxyUtils::SocketInfo> host_map;
     inline static std::mutex host_map_mutex_;
+    // the connections of the clients by socket, until they are released. protected by host_map_mutex_ too.
+    inline static std::unordered_map<int, std::shared_ptr<ClientProxyUtils::ClientConnection>> client_connections;
+    inline static uint64_t next_connection_id = 0;
+    // the requests of every client connection which have been sent to a server, but whose response hasn't been
+    // pushed to the BQ completely. protected by host_map_mutex_ too.
+    inline static std::unordered_map<uint64_t, size_t> client_inflight;
+    // notified when a client may have become idle.
+    inline static std::condition_variable idle_cond;
 
     std::shared_ptr<std::mutex> own_socket_mutex;
+    std::shared_ptr<BlockingQueue<ClientProxyUtils::PendingRequest>> pending_requests;
+
+    // the server speaks HTTP/2 (h2c), the requests are sent as streams of a shared connection.
+    std::shared_ptr<Http2ResponseReader::StreamQueue> streams;
+    std::shared_ptr<Http2Utils::Connection> http2;
+    std::shared_ptr<Http2Utils::Stream> stream;
+    // the request body is sent in DATA frames, without the chunked framing.
+    BodyFramer http2_body;
+    bool http2_body_done = false;
 
     // store the socket which send these HTTP request.
     int client_socket;
+    uint64_t connection_id;
     int port;
+    std::string client_accept_encoding;
 
 public:
     int sockfd;
     struct sockaddr_in serverAddr;
     bool reuse_flag; // a flag to target this socket is reusable or not.
+    bool pooled = false; // the socket is taken from the ConnectionPool, it is connected already.
+    bool connected = false; // the socket to the server is ready to send.
 
     
     HttpHandler request_handler;
@@ -61,8 +162,12 @@ public:
 
     // result
     std::string result_response; 
+
+    // set by the caller before run() if the request is captured by the Tracer.
+    uint64_t trace_id = 0;
     
-    ClientProxy(std::string& http_request_test, int client_socket, int port = 80) : client_socket{client_socket}, port{port} {
+    ClientProxy(std::string& http_request_test, int client_socket, int port = 80)
+        : client_socket{client_socket}, connection_id{connectionId(client_socket)}, port{port} {
         reuse_flag = false;
 
         // use http_handler to parse the original message and get the host and port
@@ -73,10 +178,20 @@ public:
         // std::cout << "Path: " << request_handler.GetPath() << std::endl;
         // std::cout << "-------------------" << std::endl;
         mix_request();
+        // the server may only use the encodings the proxy can decode, or the html cannot be rewritten.
+        client_accept_encoding = request_handler.GetAcceptEncoding();
+        if (!client_accept_encoding.empty()) {
+            request_handler.GetAcceptEncoding() = CompressionUtils::FilterAcceptEncoding(client_accept_encoding);
+        }
         
         std::string& server_host = request_handler.GetHost();
         int serverPort = request_handler.GetPort();
 
+        if (Http2Client::instance().Enabled(server_host, serverPort)) {
+            setupHttp2();
+            return;
+        }
+
         // Debug
         // std::cout << "-------------------" << std::endl;
         // std::cout << "server_host: " << server_host << std::endl;
@@ -90,58 +205,66 @@ public:
             
             std::lock_guard<std::mutex> lock_guard_(host_map_mutex_);
 
-            auto it = host_map.find(server_host);
+            auto it = host_map.find(HostKey(connection_id, request_handler));
             
             if (it != host_map.end()) { 
                 
                 reuse_flag = true; 
                 sockfd = it->second.sockfd; 
                 own_socket_mutex = it->second.own_socket_mutex;
+                pending_requests = it->second.pending_requests;
             } 
             else {
-                // Create a new socket
-                sockfd = socket(AF_INET, SOCK_STREAM, 0);
-                if (sockfd < 0) {
-                    std::cerr << "Error creating socket!" << std::endl;
-                    return ;
+                // a warm connection (such as the one left by the prefetcher) skips the handshake.
+                sockfd = ConnectionPool::instance().Take(server_host, serverPort);
+                pooled = sockfd != -1;
+                if (!pooled) {
+                    // Create a new socket
+                    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+                    if (sockfd < 0) {
+                        LOG_ERROR_LIMITED("[ClientProxy]: Error creating socket! %s", strerror(errno));
+                        return ;
+                    }
+                    // the headers and the body are sent by separate send() calls,
+                    // dont let Nagle hold the body until the headers are acked.
+                    int opt = 1;
+                    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
                 }
                 ClientProxyUtils::SocketInfo socket_info;
                 socket_info.sockfd = sockfd;
                 socket_info.own_socket_mutex = std::make_shared<std::mutex>();
+                socket_info.pending_requests = std::make_shared<BlockingQueue<ClientProxyUtils::PendingRequest>>();
                 own_socket_mutex = socket_info.own_socket_mutex;
+                pending_requests = socket_info.pending_requests;
                 // Add new socket info to host_map
-                host_map[server_host] = socket_info;
+                host_map[HostKey(connection_id, request_handler)] = socket_info;
                 
             }
         }
         
+        // if this socket has already conneted, dont need to connect again.
+        if (reuse_flag || pooled) {
+            connected = true;
+            return;
+        }
+
         memset(&serverAddr, (int)0, sizeof(serverAddr));
         serverAddr.sin_family = AF_INET;
-        serverAddr.sin_port = htons(port);
-        
-        struct addrinfo hints, *res;
-        memset(&hints, 0, sizeof(hints));
-        hints.ai_family = AF_INET;
-        hints.ai_socktype = SOCK_STREAM;
-
-        if (getaddrinfo(server_host.c_str(), nullptr, &hints, &res) != 0) {
-            std::cerr << "Error resolving hostname!" << std::endl;
-            std::cerr << "Host: " << server_host << std::endl;
+        serverAddr.sin_port = htons(serverPort);
+
+        if (!DnsCache::instance().Resolve(server_host, serverAddr.sin_addr)) {
+            LOG_ERROR_LIMITED("[ClientProxy]: Error resolving hostname! Host: %s", server_host.c_str());
+            eraseSocketInfoInHostMap(connection_id, request_handler);
+            close(sockfd);
             return;
         }
 
-        serverAddr.sin_addr = ((struct sockaddr_in*)res->ai_addr)->sin_addr;
-        freeaddrinfo(res);
-
-        // if this socket has already conneted, dont need to connect again.
-        if (!reuse_flag && !connectToServer()) {
-            std::cerr << "[ClientProxy]: "
-                      << "Host: "
-                      << server_host
-                      << " Failed to connect to server."
-                      << std::endl;
+        if (!connectToServer()) {
+            LOG_ERROR_LIMITED("[ClientProxy]: Host: %s Failed to connect to server.", server_host.c_str());
+            close(sockfd);
             return;
         }
+        connected = true;
 
         // Debug
         // If you want to print some useful information, do like this.
@@ -151,14 +274,152 @@ public:
         //           << std::endl;
     }
 
+    // a HTTP/2 server: no socket of our own, the request becomes a stream of the connection to the server.
+    // the recv thread of this client reads the streams in order, as if they were pipelined HTTP/1.1 responses.
+    void setupHttp2() {
+        sockfd = -1;
+        // nullptr if the server cannot be reached, the request is answered with "502 Bad Gateway" in its turn.
+        http2 = Http2Client::instance().Get(request_handler.GetHost(), request_handler.GetPort());
+        http2_body = BodyFramer(request_handler.GetTransferEncoding(), request_handler.GetContentLength());
+        std::lock_guard<std::mutex> lock_guard_(host_map_mutex_);
+        auto it = host_map.find(HostKey(connection_id, request_handler));
+        if (it != host_map.end() && it->second.streams != nullptr) {
+            reuse_flag = true;
+            own_socket_mutex = it->second.own_socket_mutex;
+            pending_requests = it->second.pending_requests;
+            streams = it->second.streams;
+        } else {
+            own_socket_mutex = std::make_shared<std::mutex>();
+            pending_requests = std::make_shared<BlockingQueue<ClientProxyUtils::PendingRequest>>();
+            streams = std::make_shared<Http2ResponseReader::StreamQueue>();
+            host_map[HostKey(connection_id, request_handler)] = {-1, own_socket_mutex, pending_requests, streams};
+        }
+        connected = true;
+    }
+
     // destructor
     // dont need to close socket here, because it will be closed in recvResponse function.
     // if you close it here, it will cause the recvResponse function to fail.
     ~ClientProxy() = default;
 
-    void eraseSocketInfoInHostMap(HttpHandler request_handler) {
+    // by the connection, not the socket, a recv thread which is late cannot touch the next client of the socket.
+    static std::string HostKey(uint64_t connection_id, HttpHandler& request_handler) {
+        return std::to_string(connection_id) + "|" + request_handler.GetHost() + ":" + std::to_string(request_handler.GetPort());
+    }
+
+    static void eraseSocketInfoInHostMap(uint64_t connection_id, HttpHandler request_handler) {
+        std::lock_guard<std::mutex> lock_guard_(host_map_mutex_);
+        host_map.erase(HostKey(connection_id, request_handler));
+    }
+
+    // a new client connection on the socket, until releaseClient().
+    static uint64_t openClient(int client_socket) {
+        auto connection = std::make_shared<ClientProxyUtils::ClientConnection>();
+        std::lock_guard<std::mutex> lock_guard_(host_map_mutex_);
+        connection->id = ++next_connection_id;
+        client_connections[client_socket] = connection;
+        return connection->id;
+    }
+
+    // the connection on the socket now, 0 if there is none.
+    static uint64_t connectionId(int client_socket) {
+        std::lock_guard<std::mutex> lock_guard_(host_map_mutex_);
+        auto it = client_connections.find(client_socket);
+        return it == client_connections.end() ? 0 : it->second->id;
+    }
+
+    // the connection, if the socket still belongs to it, nullptr otherwise.
+    static std::shared_ptr<ClientProxyUtils::ClientConnection> clientConnection(int client_socket, uint64_t connection_id) {
+        std::lock_guard<std::mutex> lock_guard_(host_map_mutex_);
+        auto it = client_connections.find(client_socket);
+        if (it == client_connections.end() || it->second->id != connection_id) {
+            return nullptr;
+        }
+        return it->second;
+    }
+
+    static bool clientOpen(int client_socket, uint64_t connection_id) {
+        return clientConnection(client_socket, connection_id) != nullptr;
+    }
+
+    // the client has gone, shutdown all of its server sockets.
+    // their recv threads will see the connection closed, and close the sockets.
+    // nothing is sent to the client socket after this, call it before closing it (or handing it over).
+    static void releaseClient(int client_socket) {
+        std::shared_ptr<ClientProxyUtils::ClientConnection> connection;
+        std::vector<std::shared_ptr<Http2ResponseReader::StreamQueue>> streams;
+        {
+            std::lock_guard<std::mutex> lock_guard_(host_map_mutex_);
+            auto it = client_connections.find(client_socket);
+            if (it == client_connections.end()) {
+                return;
+            }
+            connection = it->second;
+            client_connections.erase(it);
+            streams = releaseServers(connection->id);
+        }
+        // the HTTP/2 streams are cancelled, the servers stop sending, and their recv threads wake up.
+        // not under host_map_mutex_, it sends RST_STREAM.
+        for (auto& queue : streams) {
+            queue->Cancel();
+        }
+        // wait for handle_response, if it is sending to the socket right now.
+        std::lock_guard<std::mutex> send_lock_(connection->send_mutex);
+        connection->released = true;
+    }
+
+    // call with host_map_mutex_ locked, return the streams of the HTTP/2 servers, to be cancelled.
+    static std::vector<std::shared_ptr<Http2ResponseReader::StreamQueue>> releaseServers(uint64_t connection_id) {
+        std::vector<std::shared_ptr<Http2ResponseReader::StreamQueue>> streams;
+        std::string prefix = std::to_string(connection_id) + "|";
+        for (auto it = host_map.begin(); it != host_map.end();) {
+            if (it->first.compare(0, prefix.size(), prefix) == 0) {
+                if (it->second.streams != nullptr) {
+                    // there is no socket to shutdown.
+                    streams.push_back(it->second.streams);
+                } else {
+                    shutdown(it->second.sockfd, SHUT_RDWR);
+                }
+                it = host_map.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        client_inflight.erase(connection_id);
+        idle_cond.notify_all();
+        return streams;
+    }
+
+    // call with host_map_mutex_ locked.
+    static bool idle(int client_socket) {
+        auto connection = client_connections.find(client_socket);
+        if (connection == client_connections.end()) {
+            return true;
+        }
+        auto it = client_inflight.find(connection->second->id);
+        return it == client_inflight.end() || it->second == 0;
+    }
+
+    // true if every response to this client has been pushed to the BQ,
+    // so a response made by the proxy itself (such as from the cache) cannot overtake one of them.
+    static bool clientIdle(int client_socket) {
         std::lock_guard<std::mutex> lock_guard_(host_map_mutex_);
-        host_map.erase(request_handler.GetHost());
+        return idle(client_socket);
+    }
+
+    static void finishRequest(uint64_t connection_id) {
+        std::lock_guard<std::mutex> lock_guard_(host_map_mutex_);
+        auto it = client_inflight.find(connection_id);
+        if (it != client_inflight.end() && it->second > 0) {
+            it->second--;
+            idle_cond.notify_all();
+        }
+    }
+
+    // wait until clientIdle(client_socket).
+    static void waitIdle(int client_socket) {
+        std::unique_lock<std::mutex> lock_(host_map_mutex_);
+        idle_cond.wait(lock_, [client_socket] { return idle(client_socket); });
     }
     
     // Connect to server
@@ -167,45 +428,157 @@ public:
     bool connectToServer() {
         std::lock_guard<std::mutex> lock_guard_(*own_socket_mutex);
         if (connect(sockfd, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
-            std::cerr << "[ClientProxy]: " << "Connection to server failed! Error: " << strerror(errno) << " (" << errno << ")" << std::endl;
-            eraseSocketInfoInHostMap(request_handler);
+            LOG_ERROR_LIMITED("[ClientProxy]: Connection to server failed! Error: %s (%d)", strerror(errno), errno);
+            eraseSocketInfoInHostMap(connection_id, request_handler);
             return false;
         }
         else{
-            std::cout << "[ClientProxy]: " << "Connected to server successfully!" << std::endl;
+            LOG_DEBUG("[ClientProxy]: Connected to server successfully! Host: %s", request_handler.GetHost().c_str());
             return true;
         }
     }
 
+    // send a piece of the request body, after run() has sent the headers.
+    // the body is not buffered here, every piece is sent as soon as it is received from the client,
+    // and send() blocks when the server is slower than the client.
+    bool sendBody(const char* data, size_t len) {
+        if (!connected) {
+            return false;
+        }
+        if (streams != nullptr) {
+            return sendHttp2Body(data, len);
+        }
+        std::lock_guard<std::mutex> lock_guard_(*own_socket_mutex);
+        while (len > 0) {
+            ssize_t bytes_sent = send(sockfd, data, len, MSG_NOSIGNAL);
+            if (bytes_sent <= 0) {
+                LOG_ERROR_LIMITED("[ClientProxy]: Host: %s Failed to send request body: %s",
+                                  request_handler.GetHost().c_str(), strerror(errno));
+                // the recv thread will see it and close the socket.
+                shutdown(sockfd, SHUT_RDWR);
+                eraseSocketInfoInHostMap(connection_id, request_handler);
+                connected = false;
+                return false;
+            }
+            data += bytes_sent;
+            len -= bytes_sent;
+        }
+        return true;
+    }
+
+    bool sendHttp2Body(const char* data, size_t len) {
+        if (http2_body_done) {
+            return true;
+        }
+        std::string decoded;
+        http2_body.Consume(data, len, &decoded);
+        http2_body_done = http2_body.Done();
+        if (decoded.empty() && !http2_body_done) {
+            return true;
+        }
+        if (http2 == nullptr || !http2->SendData(*stream, decoded.data(), decoded.size(), http2_body_done)) {
+            LOG_ERROR_LIMITED("[ClientProxy]: Host: %s Failed to send request body over HTTP/2.",
+                              request_handler.GetHost().c_str());
+            connected = false;
+            return false;
+        }
+        return true;
+    }
+
+    // send the request as a new stream, the body (if any) follows in sendBody().
+    void sendHttp2Request() {
+        std::lock_guard<std::mutex> lock_guard_(*own_socket_mutex);
+        std::string request = request_handler.GetRequest();
+        {
+            std::lock_guard<std::mutex> host_map_lock_(host_map_mutex_);
+            client_inflight[connection_id]++;
+        }
+        pending_requests->push((ClientProxyUtils::PendingRequest){request_handler.GetMethod(), request_handler.GetPath(),
+                                                                  std::chrono::steady_clock::now(), trace_id,
+                                                                  client_accept_encoding,
+                                                                  Cluster::instance().enabled() &&
+                                                                      ResponseCache::IsCacheableRequest(request),
+                                                                  request_handler.GetHttpVersion() == "HTTP/1.0",
+                                                                  ResponseCache::HasCookie(request)});
+        std::string authority = request_handler.GetHost();
+        if (request_handler.GetPort() != 80) {
+            authority += ":" + std::to_string(request_handler.GetPort());
+        }
+        http2_body_done = http2_body.Done();
+        // the streams are queued in the same order as the pending requests, own_socket_mutex keeps them together.
+        stream = http2 != nullptr ? http2->Open(Http2Utils::RequestHeaders(request, authority), request_handler.GetMethod(),
+                                                http2_body_done)
+                                  : Http2Utils::FailedStream(request_handler.GetMethod());
+        streams->push(stream);
+        if (!reuse_flag) {
+            std::thread(&ClientProxy::recvResponse, this, -1, client_socket, connection_id, request_handler, pending_requests,
+                        streams).detach();
+        }
+        LOG_DEBUG("[Http2 stream %u send:] %s %s", stream->id, request_handler.GetMethod().c_str(), request_handler.GetPath().c_str());
+    }
+
+    // the client is still waiting for a response, tell it the server cannot be reached.
+    // the 502 is the last piece of the request, handle_response finishes it in AdmissionControl.
+    void badGateway() {
+        ClientProxyUtils::PendingRequest request{request_handler.GetMethod(), request_handler.GetPath(),
+                                                 std::chrono::steady_clock::now(), trace_id, client_accept_encoding};
+        SharedBlockingQueue::push((ClientProxyUtils::Node){client_socket, connection_id,
+                                                           ClientProxyUtils::ErrorResponse("502 Bad Gateway"),
+                                                           request_handler.GetHost(), "502", request,
+                                                           std::chrono::steady_clock::now()});
+    }
+
     // send HTTP request
     void sendRequest() {
+        if (streams != nullptr) {
+            sendHttp2Request();
+            return;
+        }
         std::lock_guard<std::mutex> lock_guard_(*own_socket_mutex);
         std::string request = request_handler.GetRequest();
-        if (send(sockfd, request.c_str(), request.length(), 0) == -1) {
+        {
+            std::lock_guard<std::mutex> host_map_lock_(host_map_mutex_);
+            client_inflight[connection_id]++;
+        }
+        // push before send, the response may arrive before send() returns.
+        pending_requests->push((ClientProxyUtils::PendingRequest){request_handler.GetMethod(), request_handler.GetPath(),
+                                                                  std::chrono::steady_clock::now(), trace_id,
+                                                                  client_accept_encoding,
+                                                                  Cluster::instance().enabled() &&
+                                                                      ResponseCache::IsCacheableRequest(request),
+                                                                  request_handler.GetHttpVersion() == "HTTP/1.0",
+                                                                  ResponseCache::HasCookie(request)});
+        if (send(sockfd, request.c_str(), request.length(), MSG_NOSIGNAL) == -1) {
+            LOG_ERROR_LIMITED("[ClientProxy]: Host: %s Failed to send request: %s",
+                              request_handler.GetHost().c_str(), strerror(errno));
             close(sockfd);
-            eraseSocketInfoInHostMap(request_handler);
-            std::cout << "Failed to send request";
+            eraseSocketInfoInHostMap(connection_id, request_handler);
+            // no response will come for it, answer it here, before it is finished like a response.
+            badGateway();
+            finishRequest(connection_id);
+            connected = false;
             return;
         }
         if (!reuse_flag) {
             // if this socket is reusable
             // that means this is a thread to recv response
             // we dont need to new a thread to recv response
-            std::thread(&ClientProxy::recvResponse, this, sockfd, client_socket, request_handler).detach();
+            std::thread(&ClientProxy::recvResponse, this, sockfd, client_socket, connection_id, request_handler, pending_requests,
+                        nullptr).detach();
         }
         // DEBUG
-        std::cout << "[Socket " << sockfd << " send:] "
-                  << request
-                  << std::endl;
+        LOG_DEBUG("[Socket %d send:] %s %s", sockfd, request_handler.GetMethod().c_str(), request_handler.GetPath().c_str());
     }
 
     void mix_request(){
-        std::string& server_path = request_handler.GetPath();
-        std::string& server_host = request_handler.GetHost();
+        mix_url(request_handler.GetHost(), request_handler.GetPath());
+    }
 
+    // static, so the prefetched links and the cache keys are mixed the same way as the requests.
+    static void mix_url(std::string& server_host, std::string& server_path) {
         // judge whether the request include a image request or not
-        if (request_handler.GetPath().find(".jpg") != std::string::npos || request_handler.GetPath().find(".png") != std::string::npos) {
-            if (request_handler.GetPath().find("smiley.") != std::string::npos) {
+        if (server_path.find(".jpg") != std::string::npos || server_path.find(".png") != std::string::npos) {
+            if (server_path.find("smiley.") != std::string::npos) {
                 server_path = "http://zebroid.ida.liu.se/fakenews/trolly.jpg";
                 server_host = "zebroid.ida.liu.se";
             }
@@ -214,8 +587,10 @@ public:
 
 // Mix the response
 // call by reference, modify the original script by invoke this function in member function "receive()"
-    void mix_response(std::string& receivedData) {
-        std::regex html_tag_regex(R"(<[^>]*>)");
+    // it is called for every piece of a streaming body, dont build the regexes every time.
+    static void mix_response(std::string& receivedData) {
+        static const std::regex html_tag_regex(R"(<[^>]*>)");
+        static const std::regex stockholm_regex("stockholm", std::regex_constants::icase);
         std::string::const_iterator start = receivedData.cbegin();
         std::string::const_iterator end = receivedData.cend();
         std::string final_result;
@@ -224,7 +599,7 @@ public:
         while (start != end) {
             if (std::regex_search(start, end, tag_match, html_tag_regex)) {
                 std::string text_to_replace(start, tag_match[0].first);
-                text_to_replace = std::regex_replace(text_to_replace, std::regex("stockholm", std::regex_constants::icase), "Linköping");
+                text_to_replace = std::regex_replace(text_to_replace, stockholm_regex, "Linköping");
                 final_result.append(text_to_replace);
                 final_result.append(tag_match[0].first, tag_match[0].second);
                 start = tag_match[0].second;
@@ -237,122 +612,336 @@ public:
         receivedData = final_result;
     }
 
+    // queue the links found in the page since the last call.
+    static void prefetchLinks(LinkExtractor* link_extractor) {
+        if (link_extractor == nullptr) {
+            return;
+        }
+        for (auto& link : link_extractor->Take()) {
+            mix_url(link.host, link.path);
+            Prefetcher::instance().Submit(link, ResponseCache::Key(link.host, link.port, link.path));
+        }
+    }
+
+    // keep a response fetched from the origin for the other clients, and give it to its owner in the cluster.
+    static void storeResponse(const std::string& key, std::string headers, const std::string& body, int ttl_sec) {
+        headers = HttpHandler::RemoveField(headers, "Connection");
+        headers = HttpHandler::RemoveField(headers, "Keep-Alive");
+        std::string response = headers + body;
+        ResponseCache::instance().Put(key, response, ttl_sec, false);
+        Cluster::instance().Publish(key, response, ttl_sec);
+    }
+
+    // append a piece of the body to out, as it is if the body ends with the connection, or as a chunk.
+    static void appendBody(std::string& out, const std::string& data, bool close_delimited) {
+        if (close_delimited) {
+            out += data;
+        } else {
+            appendChunk(out, data);
+        }
+    }
+
+    // append a chunk of "Transfer-Encoding: chunked" to out.
+    static void appendChunk(std::string& out, const std::string& data) {
+        if (data.empty()) {
+            return; // an empty chunk would end the body.
+        }
+        char size_line[24];
+        snprintf(size_line, sizeof(size_line), "%zx\r\n", data.size());
+        out += size_line;
+        out += data;
+        out += "\r\n";
+    }
+
     // Receive HTTP response from server
-    void recvResponse(int sockfd, int client_socket, HttpHandler request_handler) {
+    // The body is not buffered as a whole, it is sent to the client piece by piece as it arrives.
+    // If the body has to be changed (the html is rewritten, or the text is compressed for the client),
+    // it goes through a BodyPipeline, and is sent with "Transfer-Encoding: chunked",
+    // because its new length is not known until the end.
+    // For a HTTP/2 server, sockfd is -1, and the responses are read from the streams.
+    // The pieces are not pushed anymore once the client has gone, its socket may belong to another client already.
+    void recvResponse(int sockfd, int client_socket, uint64_t connection_id, HttpHandler request_handler,
+                      std::shared_ptr<BlockingQueue<ClientProxyUtils::PendingRequest>> pending_requests,
+                      std::shared_ptr<Http2ResponseReader::StreamQueue> streams) {
         char buffer[MAX_LEN];
         std::string recv_msg;
-        int bytes_received;
+        CompressionUtils::Config& compression = CompressionUtils::GetConfig();
+        std::unique_ptr<Http2ResponseReader> http2_reader;
+        if (streams != nullptr) {
+            http2_reader = std::make_unique<Http2ResponseReader>(streams);
+        }
+        // like recv(), from the socket or from the streams.
+        auto receive = [&](bool wait) -> ssize_t {
+            if (http2_reader != nullptr) {
+                return http2_reader->Read(buffer, sizeof(buffer), wait);
+            }
+            return recv(sockfd, buffer, sizeof(buffer), wait ? 0 : MSG_DONTWAIT);
+        };
+        // the streams which have not been read (pipelined after a broken one) are cancelled, like the socket is closed.
+        auto close_socket = [&] {
+            if (sockfd != -1) {
+                close(sockfd);
+            }
+            if (streams != nullptr) {
+                streams->Cancel();
+            }
+        };
 
         while (true) {
-            // It's too difficult to implement a perfect recv function.
-            // So I just implement a simple one which cannot handle all the situation.
-            // like chunked encoding.
-            memset(buffer, 0, sizeof(buffer));
-            bytes_received = recv(sockfd, buffer, sizeof(buffer), 0);
-            if (bytes_received <= 0) {
-                if (bytes_received == 0) {
-                    std::cerr << "[ClientProxy]: "
-                              << " Host: "
-                              << request_handler.GetHost()
-                              << " Connection closed."
-                              << std::endl;
-                } else {
-                    std::cerr << "[ClientProxy]: "
-                              << " Host: "
-                              << request_handler.GetHost()
-                              << " Failed to receive data."
-                              << std::endl;
+            // wait for the headers of the next response.
+            size_t head_end;
+            while ((head_end = recv_msg.find("\r\n\r\n")) == std::string::npos) {
+                ssize_t bytes_received = receive(true);
+                if (bytes_received <= 0) {
+                    if (bytes_received == 0) {
+                        LOG_DEBUG("[ClientProxy]: Host: %s Connection closed.", request_handler.GetHost().c_str());
+                    } else {
+                        LOG_WARN_LIMITED("[ClientProxy]: Host: %s Failed to receive data.", request_handler.GetHost().c_str());
+                    }
+                    close_socket();
+                    eraseSocketInfoInHostMap(connection_id, request_handler);
+                    return;
                 }
-                close(sockfd);
-                eraseSocketInfoInHostMap(request_handler);
+                recv_msg.append(buffer, bytes_received);
+            }
+            head_end += 4;
+            std::string headers = recv_msg.substr(0, head_end);
+            recv_msg.erase(0, head_end);
+            HttpHandler response_handler;
+            response_handler.SetHttpHandler(headers);
+
+            // 1xx is not the final response, the request is still waiting for its final response.
+            // (such as "100 Continue" for a request with "Expect: 100-continue")
+            std::string& status_code = response_handler.GetStatusCode();
+            bool is_interim = !status_code.empty() && status_code[0] == '1';
+            ClientProxyUtils::PendingRequest request;
+            // the request is pushed before it is sent, a response with nothing pending was never asked for.
+            // the connection cannot be trusted anymore, waiting here would leak the thread and the socket.
+            if (!is_interim && !pending_requests->try_pop(request)) {
+                LOG_WARN_LIMITED("[ClientProxy]: Host: %s Unsolicited response, closing the connection.",
+                                 request_handler.GetHost().c_str());
+                close_socket();
+                eraseSocketInfoInHostMap(connection_id, request_handler);
                 return;
             }
-            recv_msg += std::string(buffer, bytes_received);
-            // use while rather than if
-            // because there may be multiple responses in one recv
-            // we need to check one by one
-            while (recv_msg.find("\r\n\r\n") != std::string::npos) {
-                size_t head_end = recv_msg.find("\r\n\r\n") + 4;
-                std::string headers = recv_msg.substr(0, head_end);
-                HttpHandler response_handler;
-                response_handler.SetHttpHandler(headers);
-                std::string body = recv_msg.substr(head_end);
-
-                // check content-length
-                size_t content_length_pos = headers.find("Content-Length: ");
-                int content_length = 0;
-                if (content_length_pos != std::string::npos) {
-                    size_t content_length_end = headers.find("\r\n", content_length_pos);
-                    // 16 is the length of "Content-Length: "
-                    std::string content_length_str = headers.substr(content_length_pos + 16, content_length_end - content_length_pos - 16);
-                    // stoi: string to int
-                    content_length = std::stoi(content_length_str);
- 
-                    // recv_msg isn't enough, need to keep recv util body.size() == content_length
-                    if (body.size() < content_length) {
-                        recv_msg.erase(head_end, body.size());
-                        while (body.size() < content_length) {
-                            memset(buffer, 0, sizeof(buffer));
-                            bytes_received = recv(sockfd, buffer, sizeof(buffer), 0);
-                            if (bytes_received < 0 || (bytes_received == 0 && response_handler.GetStatusCode() != "304")) {
-                                if (bytes_received == 0) {
-                                    std::cerr << "[ClientProxy]: "
-                                            << " Host: "
-                                            << request_handler.GetHost()
-                                            << " Connection closed."
-                                            << std::endl;
-                                } else {
-                                    std::cerr << "[ClientProxy]: "
-                                            << " Host: "
-                                            << request_handler.GetHost()
-                                            << " Failed to receive data."
-                                            << std::endl;
-                                }
-                                close(sockfd);
-                                eraseSocketInfoInHostMap(request_handler);
-                                return;
-                            }
-                            body += std::string(buffer, bytes_received);
+            // these responses never have a body, whatever the headers say.
+            bool no_body = is_interim || status_code == "204" || status_code == "304" || request.method == "HEAD";
+
+            // where the body ends.
+            // without Content-Length and Transfer-Encoding, it ends when the server closes the connection.
+            BodyFramer body_framer;
+            if (!no_body) {
+                body_framer = BodyFramer(response_handler.GetTransferEncoding(), response_handler.GetContentLength());
+            }
+            bool close_delimited = !no_body && body_framer.GetMode() == BodyFramer::NONE;
+
+            // what to do with the body.
+            std::string& content_type = response_handler.GetContentType();
+            std::string& content_encoding = response_handler.GetContentEncoding();
+            // a body in an unknown encoding cannot be rewritten, it is sent as it is.
+            bool rewrite = !no_body && content_type.find("text/html") != std::string::npos &&
+                           (content_encoding.empty() || CompressionUtils::IsSupported(content_encoding));
+            bool compress = !no_body && content_encoding.empty() && compression.compress_responses &&
+                            CompressionUtils::IsCompressible(content_type) &&
+                            CompressionUtils::Accepts(request.accept_encoding, "gzip") &&
+                            // a range is a piece of the identity body, it cannot be encoded alone.
+                            status_code != "206" && HttpHandler::GetField(headers, "Content-Range").empty() &&
+                            !(body_framer.GetMode() == BodyFramer::LENGTH &&
+                              body_framer.GetContentLength() < compression.min_compress_size);
+            // the close delimited body is sent as chunked too, so the client connection can be kept.
+            // a HTTP/1.0 client gets the transformed body delimited by closing its connection instead.
+            bool transform = rewrite || compress || (close_delimited && !request.client_http10);
+            bool close_client = request.client_http10 && (transform || close_delimited);
+
+            // what is waiting to be pushed to the client.
+            std::string out = headers;
+            std::unique_ptr<BodyPipeline> pipeline;
+            if (transform) {
+                // the html is decoded, rewritten, and encoded again in the same encoding.
+                std::string encoding = compress ? "gzip" : (rewrite ? content_encoding : "");
+                pipeline = std::make_unique<BodyPipeline>(rewrite ? content_encoding : "",
+                                                          rewrite ? mix_response : nullptr, encoding);
+                out = HttpHandler::RemoveField(out, "Content-Length");
+                out = HttpHandler::RemoveField(out, "Transfer-Encoding");
+                if (compress) {
+                    out = HttpHandler::AddField(out, "Content-Encoding", "gzip");
+                    out = HttpHandler::AddField(out, "Vary", "Accept-Encoding");
+                }
+                // the bytes are not the ones of the origin anymore, its strong ETag would claim they are.
+                std::string etag = HttpHandler::GetField(out, "ETag");
+                if ((rewrite || compress) && !etag.empty() && etag.compare(0, 2, "W/") != 0) {
+                    out = HttpHandler::AddField(HttpHandler::RemoveField(out, "ETag"), "ETag", "W/" + etag);
+                }
+                if (!close_client) {
+                    out = HttpHandler::AddField(out, "Transfer-Encoding", "chunked");
+                    // chunked is not allowed in a HTTP/1.0 response, the client has sent a HTTP/1.1 request.
+                    if (out.compare(0, 8, "HTTP/1.0") == 0) {
+                        out.replace(0, 8, "HTTP/1.1");
+                    }
+                }
+            }
+            if (close_client) {
+                out = HttpHandler::AddField(HttpHandler::RemoveField(out, "Connection"), "Connection", "close");
+            }
+            // the links of the page are prefetched while the page is still streaming to the client.
+            std::unique_ptr<LinkExtractor> link_extractor;
+            if (rewrite && Prefetcher::instance().enabled()) {
+                link_extractor = std::make_unique<LinkExtractor>(request_handler.GetHost(), request_handler.GetPort(),
+                                                                 ResponseCache::OriginForm(request.path), PREFETCH_MAX_PER_PAGE);
+                pipeline->SetLinkExtractor(link_extractor.get());
+            }
+
+            // a copy of the body for the ResponseCache, if it can be sent to any other client as it is.
+            // (not rewritten or compressed for this client, and in no encoding the other clients may not accept)
+            int cache_ttl = 0;
+            if (request.cache_store && !transform && content_encoding.empty() &&
+                body_framer.GetMode() == BodyFramer::LENGTH && body_framer.GetContentLength() <= CACHE_MAX_ENTRY_BYTES &&
+                ResponseCache::IsCacheable(headers, request.cookie)) {
+                cache_ttl = ResponseCache::MaxAge(headers);
+            }
+            std::string cache_body;
+
+            size_t sent_before = 0;
+            bool client_gone = false;
+            auto push = [&](bool last, bool close_client) {
+                if (!clientOpen(client_socket, connection_id)) {
+                    client_gone = true;
+                    out.clear();
+                    return;
+                }
+                size_t size = out.size();
+                SharedBlockingQueue::push((ClientProxyUtils::Node){client_socket, connection_id, std::move(out),
+                                                                               request_handler.GetHost(),
+                                                                               status_code,
+                                                                               request,
+                                                                               std::chrono::steady_clock::now(),
+                                                                               last, sent_before, close_client});
+                sent_before += size;
+                out.clear();
+            };
+
+            // the body from the server, for the trace.
+            bool keep_body = request.trace_id != 0 && Tracer::instance().captureBodies();
+            std::string body;
+            uint64_t body_size = 0;
+            std::string decoded;
+            bool server_closed = false;
+            bool broken = false;
+            while (!client_gone && (close_delimited ? !server_closed : !body_framer.Done())) {
+                if (recv_msg.empty()) {
+                    ssize_t bytes_received = receive(false);
+                    if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                        // nothing more for now, dont let the client wait for what has already arrived.
+                        if (!out.empty()) {
+                            push(false, false);
+                        }
+                        bytes_received = receive(true);
+                    }
+                    if (bytes_received <= 0) {
+                        server_closed = true;
+                        if (!close_delimited) {
+                            broken = true;
+                            LOG_WARN_LIMITED("[ClientProxy]: Host: %s Connection closed before the whole body arrived.",
+                                             request_handler.GetHost().c_str());
                         }
-                        recv_msg += body;
-                        // body is enough, just get the content_length data.
-                        body = body.substr(0, content_length);
+                        break;
+                    }
+                    recv_msg.append(buffer, bytes_received);
+                }
+
+                size_t consumed = recv_msg.size();
+                if (close_delimited) {
+                    if (transform) {
+                        decoded.append(recv_msg);
                     }
                 } else {
-                    // if there is no content-length, just recv until the connection is closed.
-                    while ((bytes_received = recv(sockfd, buffer, sizeof(buffer), 0)) > 0) {
-                        body += std::string(buffer, bytes_received);
+                    // without a pipeline, the chunked body is sent with its chunks as they are.
+                    consumed = body_framer.Consume(recv_msg.data(), recv_msg.size(), transform ? &decoded : nullptr);
+                    if (body_framer.HasError()) {
+                        broken = true;
+                        LOG_WARN_LIMITED("[ClientProxy]: Host: %s Broken chunked response body.", request_handler.GetHost().c_str());
+                        break;
                     }
                 }
-                recv_msg = recv_msg.substr(head_end + content_length);
-                // Debug
-                // if (body.find("Stock") != std::string::npos) {
-                //     std::cout << "---------------------\n";
-                //     std::cout << "Body: " << body << std::endl;
-                //     std::cout << "---------------------\n";
-                // }
-
-               if (response_handler.GetContentType().find("text/html") != std::string::npos) {
-                    mix_response(body);
+                if (keep_body && body.size() < TraceUtils::MAX_BODY_SIZE) {
+                    body.append(recv_msg, 0, std::min(consumed, TraceUtils::MAX_BODY_SIZE - body.size()));
+                }
+                body_size += consumed;
+                if (transform) {
+                    std::string piece;
+                    if (!pipeline->Update(decoded.data(), decoded.size(), piece)) {
+                        broken = true;
+                        LOG_WARN_LIMITED("[ClientProxy]: Host: %s Failed to decode the body (%s).",
+                                         request_handler.GetHost().c_str(), content_encoding.c_str());
+                        break;
+                    }
+                    decoded.clear();
+                    appendBody(out, piece, close_client);
+                    prefetchLinks(link_extractor.get());
+                } else {
+                    out.append(recv_msg, 0, consumed);
+                    if (cache_ttl > 0) {
+                        cache_body.append(recv_msg, 0, consumed);
+                    }
+                }
+                recv_msg.erase(0, consumed);
+                if (out.size() >= STREAM_PIECE_SIZE) {
+                    push(false, false);
+                }
+            }
+            if (transform && !broken) {
+                std::string piece;
+                if (pipeline->Finish(piece)) {
+                    appendBody(out, piece, close_client);
+                    prefetchLinks(link_extractor.get());
+                    if (!close_client) {
+                        out += "0\r\n\r\n";
+                    }
+                } else {
+                    broken = true;
+                    LOG_WARN_LIMITED("[ClientProxy]: Host: %s The encoded body is truncated, or failed to encode the body.",
+                                     request_handler.GetHost().c_str());
+                }
+            }
+
+            if (cache_ttl > 0 && !broken) {
+                storeResponse(ResponseCache::Key(request_handler.GetHost(), request_handler.GetPort(), request.path),
+                              headers, cache_body, cache_ttl);
+            }
+
+            if (!is_interim) {
+                // capture what the server sent, before rewriting.
+                if (request.trace_id != 0) {
+                    Tracer::instance().CaptureResponse(request.trace_id, std::atoi(status_code.c_str()), headers, body_size, body,
+                                                       std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                           std::chrono::steady_clock::now() - request.sent_at).count());
                 }
-                // finnaly, we get the response, just store the response in BQ.
-                SharedBlockingQueue::blocking_que.push((ClientProxyUtils::Node){client_socket, headers + body}); 
-
-                // Debug
-                // std::cout << "[Socket " << client_socket << " recv:] "
-                          //<< headers
-                        //   << "length: " << headers.size() << " " << body.size() << '\n'
-                        //   << "cal all length: " << head_end + content_length << '\n'
-                        //   << "all lenght: " << (headers + body).size() << '\n'
-                        //   << "\n---------------------\n"
-                        //   << body.substr(0, 1024)
-                        //   << "\n---------------------\n"
-                        //   << (headers + body).substr(0, 1024)
-                        //   << "\n---------------------"
-                        //   << std::endl;
             }
-            // Dont need to sleep, recv is a blocking function.
-            // std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+            // finnaly, we get the response, just store the last piece in BQ.
+            // the server will close this connection, dont let the next request use it.
+            // erase it before the client gets the response, because the client sends the next request after that.
+            // (a HTTP/2 connection is not closed for one response, the streams of this client go on)
+            std::string connection = response_handler.GetHttpConnection();
+            if (broken || server_closed || (streams == nullptr && strcasecmp(connection.c_str(), "close") == 0)) {
+                eraseSocketInfoInHostMap(connection_id, request_handler);
+            }
+            // a broken response cannot be finished, the client only knows it by the connection closed.
+            // a body without length ends there too.
+            push(true, broken || close_client);
+            if (client_gone) {
+                // releaseClient has forgotten this server connection, and the rest of the response with it.
+                LOG_DEBUG("[ClientProxy]: Host: %s The client has gone, the response is dropped.", request_handler.GetHost().c_str());
+                close_socket();
+                return;
+            }
+            if (!is_interim) {
+                finishRequest(connection_id);
+            }
+            if (broken || server_closed) {
+                close_socket();
+                return;
+            }
         }
 
         // !-TODO-!
@@ -365,6 +954,10 @@ public:
     }
 
     void run() {
+        if (!connected) {
+            badGateway();
+            return;
+        }
         sendRequest();
     }
     
@@ -373,3 +966,5 @@ public:
         return result_response;
     }
 };
+
+#endif // CLIENT_PROXY_H
@@ -0,0 +1,105 @@
+#ifndef CONNECTION_POOL_H
+#define CONNECTION_POOL_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// an idle connection older than this may have been closed by the server already (Apache closes after 5s).
+constexpr int POOL_IDLE_TIMEOUT_SEC = 4;
+constexpr size_t POOL_MAX_IDLE_PER_HOST = 4;
+
+// ConnectionPool keeps the idle connections to the servers which are not used by any client yet
+// (such as the ones left by the prefetcher), so the next request to the host skips the TCP handshake.
+class ConnectionPool {
+private:
+    struct IdleSocket {
+        int sockfd;
+        std::chrono::steady_clock::time_point idle_since;
+    };
+
+    std::mutex mutex_;
+    // "host:port" -> idle sockets, the newest one is at the back.
+    std::unordered_map<std::string, std::vector<IdleSocket>> idle_sockets;
+
+    ConnectionPool() = default;
+
+    static std::string Key(const std::string& host, int port) {
+        return host + ":" + std::to_string(port);
+    }
+
+    // the server may have closed it while it was idle, or sent something unexpected.
+    static bool IsAlive(int sockfd) {
+        char c;
+        ssize_t n = recv(sockfd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+
+public:
+    ConnectionPool(const ConnectionPool&) = delete;
+    ConnectionPool& operator=(const ConnectionPool&) = delete;
+
+    static ConnectionPool& instance() {
+        static ConnectionPool pool;
+        return pool;
+    }
+
+    // take a connected socket to host:port, or -1 if there is none.
+    int Take(const std::string& host, int port) {
+        auto now = std::chrono::steady_clock::now();
+        std::vector<int> stale;
+        int sockfd = -1;
+        {
+            std::lock_guard<std::mutex> lock_guard_(mutex_);
+            auto it = idle_sockets.find(Key(host, port));
+            if (it == idle_sockets.end()) {
+                return -1;
+            }
+            auto& sockets = it->second;
+            while (!sockets.empty()) {
+                IdleSocket idle = sockets.back();
+                sockets.pop_back();
+                if (now - idle.idle_since < std::chrono::seconds(POOL_IDLE_TIMEOUT_SEC) && IsAlive(idle.sockfd)) {
+                    sockfd = idle.sockfd;
+                    break;
+                }
+                stale.push_back(idle.sockfd);
+            }
+        }
+        for (int fd : stale) {
+            close(fd);
+        }
+        return sockfd;
+    }
+
+    // give back a connected socket with no request in flight.
+    void Put(const std::string& host, int port, int sockfd) {
+        int closing = -1;
+        {
+            std::lock_guard<std::mutex> lock_guard_(mutex_);
+            auto now = std::chrono::steady_clock::now();
+            auto& sockets = idle_sockets[Key(host, port)];
+            while (!sockets.empty() && now - sockets.front().idle_since >= std::chrono::seconds(POOL_IDLE_TIMEOUT_SEC)) {
+                close(sockets.front().sockfd);
+                sockets.erase(sockets.begin());
+            }
+            if (sockets.size() >= POOL_MAX_IDLE_PER_HOST) {
+                // drop the oldest one
+                closing = sockets.front().sockfd;
+                sockets.erase(sockets.begin());
+            }
+            sockets.push_back({sockfd, now});
+        }
+        if (closing != -1) {
+            close(closing);
+        }
+    }
+};
+
+#endif // CONNECTION_POOL_H
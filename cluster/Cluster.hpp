@@ -0,0 +1,448 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "Hash_ring.hpp"
+#include "../cache/Response_cache.hpp"
+#include "../client_proxy/connection_pool.hpp"
+#include "../dns/Dns_cache.hpp"
+#include "../logger/Logger.hpp"
+
+// a peer is asked before the origin, so it must answer much faster than the origin, or be skipped.
+constexpr int CLUSTER_PEER_TIMEOUT_MS = 200;
+// a peer which failed to answer is skipped (its keys go to the next node on the ring) for this long.
+constexpr int CLUSTER_PEER_RETRY_SEC = 5;
+// an idle connection from a peer is closed after this long.
+constexpr int CLUSTER_PEER_IDLE_SEC = 60;
+constexpr size_t CLUSTER_MAX_PUT_QUEUE = 256;
+constexpr size_t CLUSTER_MAX_LINE = 4096;
+// log the counters every this many lookups.
+constexpr uint64_t CLUSTER_STATS_INTERVAL = 1000;
+
+namespace ClusterUtils {
+    struct Peer {
+        std::string id; // "host:port", the same string on every node, it is hashed onto the ring.
+        std::string host;
+        int port;
+    };
+
+    struct Stats {
+        std::atomic<uint64_t> lookups{0};       // local misses sent to the owner
+        std::atomic<uint64_t> peer_hits{0};
+        std::atomic<uint64_t> peer_misses{0};
+        std::atomic<uint64_t> peer_errors{0};   // no answer in time, the peer is skipped for a while
+        std::atomic<uint64_t> puts_sent{0};
+        std::atomic<uint64_t> puts_dropped{0};  // the queue was full
+        std::atomic<uint64_t> served_hits{0};   // the lookups of the other nodes answered by this one
+        std::atomic<uint64_t> served_misses{0};
+        std::atomic<uint64_t> stored{0};        // the responses the other nodes have put here
+    };
+
+    struct PutTask {
+        std::string owner;
+        std::string key;
+        std::string response;
+        int ttl_sec;
+    };
+
+    // "host:port" -> peer, false if it is not in this form.
+    inline bool ParsePeer(const std::string& address, Peer& peer) {
+        size_t colon_pos = address.rfind(':');
+        if (colon_pos == std::string::npos || colon_pos == 0) {
+            return false;
+        }
+        peer.id = address;
+        peer.host = address.substr(0, colon_pos);
+        peer.port = std::atoi(address.c_str() + colon_pos + 1);
+        return peer.port > 0 && peer.port < 65536;
+    }
+}
+
+// Cluster shares the ResponseCache between several proxy instances.
+// Every key is owned by one node of a consistent hash ring. A node which misses a key in its own cache
+// asks the owner before going to the origin, and gives the owner what it has fetched from the origin,
+// so a popular object is fetched once for the whole cluster.
+//
+// It is off unless both are set:
+//   PROXY_CLUSTER_SELF=127.0.0.1:29001                  the address of this node for the other nodes
+//   PROXY_CLUSTER_PEERS=127.0.0.1:29002,127.0.0.1:29003 the other nodes (this node may be in the list too)
+// Every node must be given the same set of nodes, or they dont agree on the owners.
+//
+// The nodes talk over persistent TCP connections, one request and one reply at a time:
+//   "GET <key>\n"                      -> "HIT <ttl> <length>\n<response>" or "MISS\n"
+//   "PUT <key> <ttl> <length>\n<response>" -> "OK\n"
+// There is no authentication, the address must only be reachable by the other nodes.
+class Cluster {
+private:
+    bool enabled_ = false;
+    ClusterUtils::Peer self;
+    std::unordered_map<std::string, ClusterUtils::Peer> peers;
+    // built in the constructor, read only after it.
+    HashRing ring;
+    ClusterUtils::Stats stats;
+
+    std::mutex down_mutex_;
+    std::unordered_map<std::string, std::chrono::steady_clock::time_point> down_until;
+
+    std::mutex put_mutex_;
+    std::condition_variable put_cond;
+    std::deque<ClusterUtils::PutTask> put_tasks;
+
+    Cluster() {
+        const char* self_env = std::getenv("PROXY_CLUSTER_SELF");
+        const char* peers_env = std::getenv("PROXY_CLUSTER_PEERS");
+        if (self_env == nullptr || peers_env == nullptr) {
+            return;
+        }
+        if (!ClusterUtils::ParsePeer(self_env, self)) {
+            LOG_ERROR("[Cluster]: Invalid PROXY_CLUSTER_SELF: %s", self_env);
+            return;
+        }
+        std::istringstream iss(peers_env);
+        std::string address;
+        while (std::getline(iss, address, ',')) {
+            address.erase(std::remove_if(address.begin(), address.end(), ::isspace), address.end());
+            ClusterUtils::Peer peer;
+            if (address.empty() || address == self.id) {
+                continue;
+            }
+            if (!ClusterUtils::ParsePeer(address, peer)) {
+                LOG_ERROR("[Cluster]: Invalid peer in PROXY_CLUSTER_PEERS: %s", address.c_str());
+                continue;
+            }
+            peers[peer.id] = peer;
+        }
+        ring.Add(self.id);
+        for (auto& peer : peers) {
+            ring.Add(peer.first);
+        }
+        enabled_ = true;
+        LOG_INFO("[Cluster]: Node %s with %zu peers.", self.id.c_str(), peers.size());
+        std::thread(&Cluster::listen_peers, this).detach();
+        std::thread(&Cluster::send_puts, this).detach();
+    }
+
+    static void SetTimeout(int fd, int timeout_ms) {
+        struct timeval timeout;
+        timeout.tv_sec = timeout_ms / 1000;
+        timeout.tv_usec = (timeout_ms % 1000) * 1000;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+
+    static bool SendAll(int fd, const std::string& data) {
+        size_t sent = 0;
+        while (sent < data.size()) {
+            ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) {
+                return false;
+            }
+            sent += n;
+        }
+        return true;
+    }
+
+    // read a line (without "\n"), the bytes after it stay in buffer.
+    static bool ReadLine(int fd, std::string& buffer, std::string& line) {
+        char chunk[4096];
+        size_t line_end;
+        while ((line_end = buffer.find('\n')) == std::string::npos) {
+            if (buffer.size() > CLUSTER_MAX_LINE) {
+                return false;
+            }
+            ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+            if (n <= 0) {
+                return false;
+            }
+            buffer.append(chunk, n);
+        }
+        line = buffer.substr(0, line_end);
+        buffer.erase(0, line_end + 1);
+        return true;
+    }
+
+    // read exactly length bytes into out, starting with the ones in buffer.
+    static bool ReadBytes(int fd, std::string& buffer, size_t length, std::string& out) {
+        char chunk[16384];
+        while (buffer.size() < length) {
+            ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+            if (n <= 0) {
+                return false;
+            }
+            buffer.append(chunk, n);
+        }
+        out = buffer.substr(0, length);
+        buffer.erase(0, length);
+        return true;
+    }
+
+    // the key goes into a line of the protocol.
+    static bool ValidKey(const std::string& key) {
+        return !key.empty() && key.size() < CLUSTER_MAX_LINE / 2 && key.find_first_of(" \r\n") == std::string::npos;
+    }
+
+    bool IsUp(const std::string& id) {
+        if (id == self.id) {
+            return true;
+        }
+        std::lock_guard<std::mutex> lock_guard_(down_mutex_);
+        auto it = down_until.find(id);
+        return it == down_until.end() || it->second <= std::chrono::steady_clock::now();
+    }
+
+    void MarkDown(const std::string& id) {
+        LOG_WARN_LIMITED("[Cluster]: Peer %s does not answer, skip it for %d s.", id.c_str(), CLUSTER_PEER_RETRY_SEC);
+        std::lock_guard<std::mutex> lock_guard_(down_mutex_);
+        down_until[id] = std::chrono::steady_clock::now() + std::chrono::seconds(CLUSTER_PEER_RETRY_SEC);
+    }
+
+    static int connectTo(const ClusterUtils::Peer& peer) {
+        sockaddr_in peer_addr;
+        memset(&peer_addr, 0, sizeof(peer_addr));
+        peer_addr.sin_family = AF_INET;
+        peer_addr.sin_port = htons(peer.port);
+        if (!DnsCache::instance().Resolve(peer.host, peer_addr.sin_addr)) {
+            return -1;
+        }
+        int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+        if (sockfd < 0) {
+            return -1;
+        }
+        int opt = 1;
+        setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        // SO_SNDTIMEO also limits connect().
+        SetTimeout(sockfd, CLUSTER_PEER_TIMEOUT_MS);
+        if (connect(sockfd, (struct sockaddr*)&peer_addr, sizeof(peer_addr)) < 0) {
+            close(sockfd);
+            return -1;
+        }
+        return sockfd;
+    }
+
+    // send a message to a peer, and read its reply line and body (only "HIT" has a body).
+    // the connections are kept in the ConnectionPool between the calls.
+    bool call(const ClusterUtils::Peer& peer, const std::string& message, std::string& reply, std::string& body) {
+        // a pooled connection may have been closed by the peer in the meantime, then try a new one.
+        for (int attempt = 0; attempt < 2; attempt++) {
+            int sockfd = attempt == 0 ? ConnectionPool::instance().Take(peer.host, peer.port) : connectTo(peer);
+            if (sockfd == -1) {
+                continue;
+            }
+            SetTimeout(sockfd, CLUSTER_PEER_TIMEOUT_MS);
+            std::string buffer;
+            bool ok = SendAll(sockfd, message) && ReadLine(sockfd, buffer, reply);
+            if (ok && reply.compare(0, 4, "HIT ") == 0) {
+                std::istringstream iss(reply.substr(4));
+                int ttl_sec = 0;
+                size_t length = 0;
+                ok = (iss >> ttl_sec >> length) && length <= CACHE_MAX_ENTRY_BYTES &&
+                     ReadBytes(sockfd, buffer, length, body);
+            }
+            if (!ok || !buffer.empty()) {
+                close(sockfd);
+                continue;
+            }
+            ConnectionPool::instance().Put(peer.host, peer.port, sockfd);
+            return true;
+        }
+        stats.peer_errors++;
+        MarkDown(peer.id);
+        return false;
+    }
+
+    void listen_peers() {
+        int listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+        int opt = 1;
+        setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(self.port);
+        if (listen_socket < 0 || !DnsCache::instance().Resolve(self.host, addr.sin_addr) ||
+            bind(listen_socket, (sockaddr*)&addr, sizeof(addr)) == -1 || listen(listen_socket, 64) == -1) {
+            LOG_ERROR("[Cluster]: Failed to listen on %s: %s", self.id.c_str(), strerror(errno));
+            if (listen_socket >= 0) {
+                close(listen_socket);
+            }
+            return;
+        }
+        while (true) {
+            int peer_socket = accept(listen_socket, nullptr, nullptr);
+            if (peer_socket == -1) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                LOG_ERROR("[Cluster]: Failed to accept a peer: %s", strerror(errno));
+                return;
+            }
+            setsockopt(peer_socket, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+            std::thread(&Cluster::serve_peer, this, peer_socket).detach();
+        }
+    }
+
+    // answer the requests of a peer from the local ResponseCache, never from the origin,
+    // so a lookup can not bounce between the nodes.
+    void serve_peer(int peer_socket) {
+        SetTimeout(peer_socket, CLUSTER_PEER_IDLE_SEC * 1000);
+        std::string buffer;
+        std::string line;
+        while (ReadLine(peer_socket, buffer, line)) {
+            std::istringstream iss(line);
+            std::string command, key;
+            iss >> command >> key;
+            std::string reply;
+            if (command == "GET") {
+                std::string response;
+                int ttl_sec = 0;
+                if (ResponseCache::instance().Get(key, response, &ttl_sec)) {
+                    stats.served_hits++;
+                    reply = "HIT " + std::to_string(ttl_sec) + " " + std::to_string(response.size()) + "\n" + response;
+                } else {
+                    stats.served_misses++;
+                    reply = "MISS\n";
+                }
+            } else if (command == "PUT") {
+                int ttl_sec = 0;
+                size_t length = 0;
+                std::string response;
+                if (!(iss >> ttl_sec >> length) || length > CACHE_MAX_ENTRY_BYTES ||
+                    !ReadBytes(peer_socket, buffer, length, response)) {
+                    break;
+                }
+                if (ttl_sec > 0) {
+                    ResponseCache::instance().Put(key, response, ttl_sec, false);
+                    stats.stored++;
+                }
+                reply = "OK\n";
+            } else {
+                LOG_WARN_LIMITED("[Cluster]: Unknown peer command: %s", command.c_str());
+                break;
+            }
+            if (!SendAll(peer_socket, reply)) {
+                break;
+            }
+        }
+        close(peer_socket);
+    }
+
+    // the PUTs are sent by their own thread, the response to the client never waits for them.
+    void send_puts() {
+        while (true) {
+            ClusterUtils::PutTask task;
+            {
+                std::unique_lock<std::mutex> lock_(put_mutex_);
+                put_cond.wait(lock_, [this] { return !put_tasks.empty(); });
+                task = std::move(put_tasks.front());
+                put_tasks.pop_front();
+            }
+            std::string reply, body;
+            if (call(peers.at(task.owner), "PUT " + task.key + " " + std::to_string(task.ttl_sec) + " " +
+                                        std::to_string(task.response.size()) + "\n" + task.response, reply, body)) {
+                stats.puts_sent++;
+            }
+        }
+    }
+
+public:
+    Cluster(const Cluster&) = delete;
+    Cluster& operator=(const Cluster&) = delete;
+
+    static Cluster& instance() {
+        // never destroyed, the peer threads may still be running at exit.
+        static Cluster* cluster = new Cluster();
+        return *cluster;
+    }
+
+    bool enabled() {
+        return enabled_;
+    }
+
+    // the node which owns key, skipping the peers which are down.
+    std::string Owner(const std::string& key) {
+        return ring.Owner(key, [this](const std::string& id) { return IsUp(id); });
+    }
+
+    // ask the owner of key for the response, after a local miss.
+    // a hit is put into the local cache too, for the time it has left.
+    bool Fetch(const std::string& key, std::string& response) {
+        if (!enabled_ || !ValidKey(key)) {
+            return false;
+        }
+        std::string owner = Owner(key);
+        if (owner.empty() || owner == self.id) {
+            return false;
+        }
+        if (++stats.lookups % CLUSTER_STATS_INTERVAL == 0) {
+            LogStats();
+        }
+        std::string reply;
+        if (!call(peers.at(owner), "GET " + key + "\n", reply, response)) {
+            return false;
+        }
+        if (reply.compare(0, 4, "HIT ") != 0) {
+            stats.peer_misses++;
+            return false;
+        }
+        stats.peer_hits++;
+        int ttl_sec = std::atoi(reply.c_str() + 4);
+        if (ttl_sec > 0) {
+            ResponseCache::instance().Put(key, response, ttl_sec, false);
+        }
+        return true;
+    }
+
+    // a response fetched from the origin, give it to its owner (if it is not this node).
+    void Publish(const std::string& key, const std::string& response, int ttl_sec) {
+        if (!enabled_ || !ValidKey(key) || ttl_sec <= 0) {
+            return;
+        }
+        std::string owner = Owner(key);
+        if (owner.empty() || owner == self.id) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock_guard_(put_mutex_);
+            if (put_tasks.size() >= CLUSTER_MAX_PUT_QUEUE) {
+                stats.puts_dropped++;
+                return;
+            }
+            put_tasks.push_back({owner, key, response, ttl_sec});
+        }
+        put_cond.notify_one();
+    }
+
+    ClusterUtils::Stats& GetStats() {
+        return stats;
+    }
+
+    void LogStats() {
+        uint64_t lookups = stats.lookups.load();
+        uint64_t hits = stats.peer_hits.load();
+        LOG_INFO("[Cluster]: lookups=%llu peer_hits=%llu peer_misses=%llu peer_errors=%llu puts_sent=%llu "
+                 "puts_dropped=%llu served_hits=%llu served_misses=%llu stored=%llu hit_rate=%.1f%%",
+                 (unsigned long long)lookups, (unsigned long long)hits,
+                 (unsigned long long)stats.peer_misses.load(), (unsigned long long)stats.peer_errors.load(),
+                 (unsigned long long)stats.puts_sent.load(), (unsigned long long)stats.puts_dropped.load(),
+                 (unsigned long long)stats.served_hits.load(), (unsigned long long)stats.served_misses.load(),
+                 (unsigned long long)stats.stored.load(), lookups == 0 ? 0.0 : 100.0 * hits / lookups);
+    }
+};
+
+#endif // CLUSTER_H
@@ -0,0 +1,77 @@
+#ifndef HASH_RING_H
+#define HASH_RING_H
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+
+// every node is put on the ring this many times, so the keys are spread evenly,
+// and the keys of a removed node go to all the other nodes, not just the next one.
+constexpr int HASH_RING_VIRTUAL_NODES = 160;
+
+// HashRing maps a key to the node which owns it (consistent hashing).
+// Adding or removing a node only moves the keys between it and its neighbours on the ring,
+// about 1/N of all the keys.
+// The hash must be the same on every proxy instance, so std::hash (which is not specified) is not used.
+class HashRing {
+private:
+    // the position on the ring -> node
+    std::map<uint64_t, std::string> ring;
+
+public:
+    // FNV-1a, mixed by the splitmix64 finalizer, "node#1" and "node#2" land far apart.
+    static uint64_t Hash(const std::string& key) {
+        uint64_t hash = 14695981039346656037ULL;
+        for (unsigned char c : key) {
+            hash ^= c;
+            hash *= 1099511628211ULL;
+        }
+        hash ^= hash >> 30;
+        hash *= 0xbf58476d1ce4e5b9ULL;
+        hash ^= hash >> 27;
+        hash *= 0x94d049bb133111ebULL;
+        hash ^= hash >> 31;
+        return hash;
+    }
+
+    void Add(const std::string& node) {
+        for (int i = 0; i < HASH_RING_VIRTUAL_NODES; i++) {
+            ring[Hash(node + "#" + std::to_string(i))] = node;
+        }
+    }
+
+    void Remove(const std::string& node) {
+        for (auto it = ring.begin(); it != ring.end();) {
+            if (it->second == node) {
+                it = ring.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    bool Empty() {
+        return ring.empty();
+    }
+
+    // the first node clockwise from the key for which usable(node) is true, "" if there is none.
+    // skipping a node which is down moves only its own keys, to the nodes after it.
+    std::string Owner(const std::string& key, const std::function<bool(const std::string&)>& usable = nullptr) {
+        if (ring.empty()) {
+            return "";
+        }
+        auto it = ring.lower_bound(Hash(key));
+        for (size_t i = 0; i < ring.size(); i++, ++it) {
+            if (it == ring.end()) {
+                it = ring.begin();
+            }
+            if (usable == nullptr || usable(it->second)) {
+                return it->second;
+            }
+        }
+        return "";
+    }
+};
+
+#endif // HASH_RING_H
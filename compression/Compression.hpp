@@ -0,0 +1,421 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <zlib.h>
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <strings.h>
+
+#ifdef PROXY_WITH_BROTLI
+#include <brotli/decode.h>
+#include <brotli/encode.h>
+#endif
+
+// Streaming decoders and encoders of the Content-Encoding (gzip, deflate, and br if built with brotli).
+// Feed the body piece by piece, every call appends what it can produce to the output,
+// so a response never needs to be decompressed as a whole.
+//
+// Build with zlib: -lz
+// and with brotli: -DPROXY_WITH_BROTLI -lbrotlienc -lbrotlidec
+
+namespace CompressionUtils {
+    constexpr size_t OUT_BUFFER_SIZE = 16384;
+
+    // the settings, from the environment variables:
+    // PROXY_COMPRESSION_LEVEL: 1 (fastest) .. 9 (smallest) for gzip/deflate, default 6
+    // PROXY_BROTLI_QUALITY: 0 (fastest) .. 11 (smallest) for br, default 5
+    // PROXY_COMPRESS_RESPONSES=1: compress the uncompressed text responses for the clients who accept gzip
+    struct Config {
+        int level = 6;
+        int brotli_quality = 5;
+        bool compress_responses = false;
+        // dont compress the responses smaller than this, it costs more cpu than it saves.
+        size_t min_compress_size = 1024;
+
+        Config() {
+            const char* env = std::getenv("PROXY_COMPRESSION_LEVEL");
+            if (env != nullptr && std::atoi(env) >= 1 && std::atoi(env) <= 9) {
+                level = std::atoi(env);
+            }
+            env = std::getenv("PROXY_BROTLI_QUALITY");
+            if (env != nullptr && std::atoi(env) >= 0 && std::atoi(env) <= 11) {
+                brotli_quality = std::atoi(env);
+            }
+            env = std::getenv("PROXY_COMPRESS_RESPONSES");
+            compress_responses = env != nullptr && std::string(env) == "1";
+        }
+    };
+
+    inline Config& GetConfig() {
+        static Config config;
+        return config;
+    }
+
+    // the encodings we can decode, the Accept-Encoding sent to the servers.
+    inline const char* SupportedEncodings() {
+#ifdef PROXY_WITH_BROTLI
+        return "gzip, deflate, br";
+#else
+        return "gzip, deflate";
+#endif
+    }
+
+    inline bool IsSupported(const std::string& encoding) {
+        if (strcasecmp(encoding.c_str(), "gzip") == 0 || strcasecmp(encoding.c_str(), "x-gzip") == 0 ||
+            strcasecmp(encoding.c_str(), "deflate") == 0) {
+            return true;
+        }
+#ifdef PROXY_WITH_BROTLI
+        if (strcasecmp(encoding.c_str(), "br") == 0) {
+            return true;
+        }
+#endif
+        return false;
+    }
+
+    // keep only the encodings in the Accept-Encoding which we can decode,
+    // so the body from the server can always be rewritten.
+    // "gzip, deflate, br, zstd" -> "gzip, deflate" (without brotli)
+    inline std::string FilterAcceptEncoding(const std::string& accept_encoding) {
+        std::string result;
+        size_t pos = 0;
+        while (pos < accept_encoding.size()) {
+            size_t end = accept_encoding.find(',', pos);
+            if (end == std::string::npos) {
+                end = accept_encoding.size();
+            }
+            size_t begin = accept_encoding.find_first_not_of(' ', pos);
+            if (begin < end) {
+                std::string item = accept_encoding.substr(begin, end - begin);
+                std::string coding = item.substr(0, item.find(';'));
+                coding.erase(coding.find_last_not_of(' ') + 1);
+                if (IsSupported(coding) || strcasecmp(coding.c_str(), "identity") == 0) {
+                    result += (result.empty() ? "" : ", ") + item;
+                }
+            }
+            pos = end + 1;
+        }
+        return result.empty() ? "identity" : result;
+    }
+
+    // the types worth compressing, the images and videos are compressed already.
+    inline bool IsCompressible(const std::string& content_type) {
+        return content_type.compare(0, 5, "text/") == 0 ||
+               content_type.find("javascript") != std::string::npos ||
+               content_type.find("json") != std::string::npos ||
+               content_type.find("xml") != std::string::npos;
+    }
+
+    // does the Accept-Encoding of the client accept this encoding?
+    // "gzip;q=0" refuses it, and "*" stands for the encodings which are not listed (RFC 9110 12.5.3).
+    inline bool Accepts(const std::string& accept_encoding, const std::string& encoding) {
+        bool wildcard = false;
+        size_t pos = 0;
+        while (pos < accept_encoding.size()) {
+            size_t end = accept_encoding.find(',', pos);
+            if (end == std::string::npos) {
+                end = accept_encoding.size();
+            }
+            size_t begin = accept_encoding.find_first_not_of(" \t", pos);
+            if (begin < end) {
+                std::string item = accept_encoding.substr(begin, end - begin);
+                size_t semicolon = item.find(';');
+                std::string coding = item.substr(0, semicolon);
+                coding.erase(coding.find_last_not_of(" \t") + 1);
+                // "q=0", "q=0.0" and "Q = 0.000" all refuse it.
+                double q = 1;
+                while (semicolon != std::string::npos) {
+                    size_t next = item.find(';', semicolon + 1);
+                    std::string param = item.substr(semicolon + 1, next == std::string::npos ? std::string::npos : next - semicolon - 1);
+                    param.erase(std::remove_if(param.begin(), param.end(), ::isspace), param.end());
+                    if (param.size() > 2 && tolower(param[0]) == 'q' && param[1] == '=') {
+                        q = std::atof(param.c_str() + 2);
+                    }
+                    semicolon = next;
+                }
+                if (strcasecmp(coding.c_str(), encoding.c_str()) == 0) {
+                    return q > 0;
+                }
+                if (coding == "*") {
+                    wildcard = q > 0;
+                }
+            }
+            pos = end + 1;
+        }
+        return wildcard;
+    }
+}
+
+// Decoder decompresses one body.
+class Decoder {
+public:
+    virtual ~Decoder() = default;
+    // return false if the data is broken.
+    virtual bool Update(const char* data, size_t len, std::string& out) = 0;
+    // the body has ended, return false if the compressed stream has not ended with it (a truncated body).
+    // everything has been decoded by Update already.
+    virtual bool Finish() = 0;
+
+    // nullptr if the encoding is not supported.
+    static std::unique_ptr<Decoder> Create(const std::string& encoding);
+};
+
+// Encoder compresses one body.
+class Encoder {
+public:
+    virtual ~Encoder() = default;
+    virtual bool Update(const char* data, size_t len, std::string& out) = 0;
+    virtual bool Finish(std::string& out) = 0;
+
+    // nullptr if the encoding is not supported.
+    static std::unique_ptr<Encoder> Create(const std::string& encoding);
+};
+
+class ZlibDecoder : public Decoder {
+private:
+    z_stream stream;
+    bool initialized = false;
+    bool is_deflate;
+    bool finished = false;
+    bool received = false;
+
+    bool Init(int window_bits) {
+        memset(&stream, 0, sizeof(stream));
+        initialized = inflateInit2(&stream, window_bits) == Z_OK;
+        return initialized;
+    }
+
+public:
+    explicit ZlibDecoder(bool is_deflate) : is_deflate{is_deflate} {
+        if (!is_deflate) {
+            // 15 + 16: gzip only
+            Init(15 + 16);
+        }
+    }
+
+    ~ZlibDecoder() {
+        if (initialized) {
+            inflateEnd(&stream);
+        }
+    }
+
+    bool Update(const char* data, size_t len, std::string& out) override {
+        if (len == 0 || finished) {
+            return true;
+        }
+        received = true;
+        if (!initialized) {
+            // "deflate" should be zlib format, but some servers send the raw deflate data.
+            // the zlib header is 2 bytes, and (CMF * 256 + FLG) is a multiple of 31.
+            unsigned char cmf = data[0];
+            bool zlib_header = (cmf & 0x0f) == 8 && (len < 2 || ((cmf << 8) | (unsigned char)data[1]) % 31 == 0);
+            if (!Init(zlib_header ? 15 : -15)) {
+                return false;
+            }
+        }
+        char buffer[CompressionUtils::OUT_BUFFER_SIZE];
+        stream.next_in = (Bytef*)data;
+        stream.avail_in = (uInt)len;
+        while (stream.avail_in > 0 && !finished) {
+            stream.next_out = (Bytef*)buffer;
+            stream.avail_out = sizeof(buffer);
+            int ret = inflate(&stream, Z_NO_FLUSH);
+            out.append(buffer, sizeof(buffer) - stream.avail_out);
+            if (ret == Z_STREAM_END) {
+                finished = true;
+            } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                return false;
+            }
+            if (ret == Z_BUF_ERROR && stream.avail_out != 0) {
+                break;
+            }
+        }
+        // flush the output still held by zlib
+        while (!finished && stream.avail_out == 0) {
+            stream.next_out = (Bytef*)buffer;
+            stream.avail_out = sizeof(buffer);
+            int ret = inflate(&stream, Z_NO_FLUSH);
+            out.append(buffer, sizeof(buffer) - stream.avail_out);
+            if (ret == Z_STREAM_END) {
+                finished = true;
+            } else if (ret != Z_OK) {
+                break;
+            }
+        }
+        return true;
+    }
+
+    // an empty body is accepted, some servers send Content-Encoding on an empty response.
+    bool Finish() override {
+        return finished || !received;
+    }
+};
+
+class ZlibEncoder : public Encoder {
+private:
+    z_stream stream;
+    bool initialized = false;
+
+    bool Deflate(const char* data, size_t len, int flush, std::string& out) {
+        if (!initialized) {
+            return false;
+        }
+        char buffer[CompressionUtils::OUT_BUFFER_SIZE];
+        stream.next_in = (Bytef*)data;
+        stream.avail_in = (uInt)len;
+        do {
+            stream.next_out = (Bytef*)buffer;
+            stream.avail_out = sizeof(buffer);
+            int ret = deflate(&stream, flush);
+            if (ret == Z_STREAM_ERROR) {
+                return false;
+            }
+            out.append(buffer, sizeof(buffer) - stream.avail_out);
+        } while (stream.avail_out == 0);
+        return true;
+    }
+
+public:
+    // is_deflate: zlib format, otherwise gzip format.
+    ZlibEncoder(bool is_deflate, int level) {
+        memset(&stream, 0, sizeof(stream));
+        initialized = deflateInit2(&stream, level, Z_DEFLATED, is_deflate ? 15 : 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+    }
+
+    ~ZlibEncoder() {
+        if (initialized) {
+            deflateEnd(&stream);
+        }
+    }
+
+    bool Update(const char* data, size_t len, std::string& out) override {
+        if (len == 0) {
+            return true;
+        }
+        return Deflate(data, len, Z_NO_FLUSH, out);
+    }
+
+    bool Finish(std::string& out) override {
+        return Deflate(nullptr, 0, Z_FINISH, out);
+    }
+};
+
+#ifdef PROXY_WITH_BROTLI
+class BrotliStreamDecoder : public Decoder {
+private:
+    BrotliDecoderState* state;
+
+public:
+    BrotliStreamDecoder() {
+        state = BrotliDecoderCreateInstance(nullptr, nullptr, nullptr);
+    }
+
+    ~BrotliStreamDecoder() {
+        BrotliDecoderDestroyInstance(state);
+    }
+
+    bool Update(const char* data, size_t len, std::string& out) override {
+        const uint8_t* next_in = (const uint8_t*)data;
+        size_t avail_in = len;
+        uint8_t buffer[CompressionUtils::OUT_BUFFER_SIZE];
+        while (true) {
+            uint8_t* next_out = buffer;
+            size_t avail_out = sizeof(buffer);
+            BrotliDecoderResult result = BrotliDecoderDecompressStream(state, &avail_in, &next_in, &avail_out, &next_out, nullptr);
+            out.append((const char*)buffer, sizeof(buffer) - avail_out);
+            if (result == BROTLI_DECODER_RESULT_ERROR) {
+                return false;
+            }
+            if (result != BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT) {
+                return true;
+            }
+        }
+    }
+
+    bool Finish() override {
+        return BrotliDecoderIsFinished(state);
+    }
+};
+
+class BrotliStreamEncoder : public Encoder {
+private:
+    BrotliEncoderState* state;
+
+    bool Compress(const char* data, size_t len, BrotliEncoderOperation op, std::string& out) {
+        const uint8_t* next_in = (const uint8_t*)data;
+        size_t avail_in = len;
+        uint8_t buffer[CompressionUtils::OUT_BUFFER_SIZE];
+        while (true) {
+            uint8_t* next_out = buffer;
+            size_t avail_out = sizeof(buffer);
+            if (!BrotliEncoderCompressStream(state, op, &avail_in, &next_in, &avail_out, &next_out, nullptr)) {
+                return false;
+            }
+            out.append((const char*)buffer, sizeof(buffer) - avail_out);
+            if (avail_in == 0 && !BrotliEncoderHasMoreOutput(state) &&
+                (op != BROTLI_OPERATION_FINISH || BrotliEncoderIsFinished(state))) {
+                return true;
+            }
+        }
+    }
+
+public:
+    explicit BrotliStreamEncoder(int quality) {
+        state = BrotliEncoderCreateInstance(nullptr, nullptr, nullptr);
+        BrotliEncoderSetParameter(state, BROTLI_PARAM_QUALITY, quality);
+        BrotliEncoderSetParameter(state, BROTLI_PARAM_MODE, BROTLI_MODE_TEXT);
+    }
+
+    ~BrotliStreamEncoder() {
+        BrotliEncoderDestroyInstance(state);
+    }
+
+    bool Update(const char* data, size_t len, std::string& out) override {
+        if (len == 0) {
+            return true;
+        }
+        return Compress(data, len, BROTLI_OPERATION_PROCESS, out);
+    }
+
+    bool Finish(std::string& out) override {
+        return Compress(nullptr, 0, BROTLI_OPERATION_FINISH, out);
+    }
+};
+#endif
+
+inline std::unique_ptr<Decoder> Decoder::Create(const std::string& encoding) {
+    if (strcasecmp(encoding.c_str(), "gzip") == 0 || strcasecmp(encoding.c_str(), "x-gzip") == 0) {
+        return std::make_unique<ZlibDecoder>(false);
+    }
+    if (strcasecmp(encoding.c_str(), "deflate") == 0) {
+        return std::make_unique<ZlibDecoder>(true);
+    }
+#ifdef PROXY_WITH_BROTLI
+    if (strcasecmp(encoding.c_str(), "br") == 0) {
+        return std::make_unique<BrotliStreamDecoder>();
+    }
+#endif
+    return nullptr;
+}
+
+inline std::unique_ptr<Encoder> Encoder::Create(const std::string& encoding) {
+    CompressionUtils::Config& config = CompressionUtils::GetConfig();
+    if (strcasecmp(encoding.c_str(), "gzip") == 0 || strcasecmp(encoding.c_str(), "x-gzip") == 0) {
+        return std::make_unique<ZlibEncoder>(false, config.level);
+    }
+    if (strcasecmp(encoding.c_str(), "deflate") == 0) {
+        return std::make_unique<ZlibEncoder>(true, config.level);
+    }
+#ifdef PROXY_WITH_BROTLI
+    if (strcasecmp(encoding.c_str(), "br") == 0) {
+        return std::make_unique<BrotliStreamEncoder>(config.brotli_quality);
+    }
+#endif
+    return nullptr;
+}
+
+#endif // COMPRESSION_H
@@ -0,0 +1,122 @@
+#ifndef BODY_PIPELINE_H
+#define BODY_PIPELINE_H
+
+#include <memory>
+#include <string>
+
+#include "Compression.hpp"
+#include "../prefetch/link_extractor.hpp"
+
+// BodyPipeline transforms a response body while it is streaming through the proxy:
+// decode (Content-Encoding of the server) -> rewrite -> encode (Content-Encoding sent to the client).
+// Every stage is optional, an empty encoding skips the decoding/encoding and a nullptr rewriter skips the rewriting.
+//
+// The rewriter works on html, it must not see a tag cut in half,
+// so the text after the last '>' is held back until the rest of it arrives.
+class BodyPipeline {
+public:
+    using Rewriter = void (*)(std::string&);
+
+    // the held back text never grows above this, even if there is no '>' at all.
+    static constexpr size_t MAX_HOLD_SIZE = 65536;
+
+    BodyPipeline(const std::string& decoding, Rewriter rewriter, const std::string& encoding) : rewriter{rewriter} {
+        if (!decoding.empty()) {
+            decoder = Decoder::Create(decoding);
+            ok = ok && decoder != nullptr;
+        }
+        if (!encoding.empty()) {
+            encoder = Encoder::Create(encoding);
+            ok = ok && encoder != nullptr;
+        }
+    }
+
+    // scan the decoded html for the links to prefetch, before it is rewritten.
+    void SetLinkExtractor(LinkExtractor* extractor) {
+        link_extractor = extractor;
+    }
+
+    // false if the encodings are not supported, or the body is broken.
+    bool Ok() {
+        return ok;
+    }
+
+    // transform a piece of the body, the output is appended to out.
+    bool Update(const char* data, size_t len, std::string& out) {
+        if (!ok) {
+            return false;
+        }
+        if (decoder == nullptr) {
+            return Rewrite(data, len, false, out);
+        }
+        decoded.clear();
+        if (!decoder->Update(data, len, decoded)) {
+            ok = false;
+            return false;
+        }
+        return Rewrite(decoded.data(), decoded.size(), false, out);
+    }
+
+    // the body has ended, flush everything.
+    bool Finish(std::string& out) {
+        if (!ok) {
+            return false;
+        }
+        if (decoder != nullptr && !decoder->Finish()) {
+            ok = false;
+            return false;
+        }
+        if (!Rewrite("", 0, true, out)) {
+            return false;
+        }
+        if (encoder != nullptr && !encoder->Finish(out)) {
+            ok = false;
+        }
+        return ok;
+    }
+
+private:
+    bool ok = true;
+    std::unique_ptr<Decoder> decoder;
+    std::unique_ptr<Encoder> encoder;
+    Rewriter rewriter;
+    LinkExtractor* link_extractor = nullptr;
+    std::string decoded;
+    std::string held; // the text waiting for the end of its tag.
+
+    bool Rewrite(const char* data, size_t len, bool last, std::string& out) {
+        if (rewriter == nullptr) {
+            return Encode(data, len, out);
+        }
+        held.append(data, len);
+        size_t cut = last ? held.size() : held.rfind('>');
+        if (cut == std::string::npos) {
+            if (held.size() < MAX_HOLD_SIZE) {
+                return true;
+            }
+            cut = held.size();
+        } else if (!last) {
+            cut++; // keep the '>'
+        }
+        std::string text = held.substr(0, cut);
+        held.erase(0, cut);
+        if (link_extractor != nullptr) {
+            link_extractor->Scan(text);
+        }
+        rewriter(text);
+        return Encode(text.data(), text.size(), out);
+    }
+
+    bool Encode(const char* data, size_t len, std::string& out) {
+        if (encoder == nullptr) {
+            out.append(data, len);
+            return true;
+        }
+        if (!encoder->Update(data, len, out)) {
+            ok = false;
+        }
+        return ok;
+    }
+};
+
+#endif // BODY_PIPELINE_H
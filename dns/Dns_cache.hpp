@@ -0,0 +1,78 @@
+#ifndef DNS_CACHE_H
+#define DNS_CACHE_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "../logger/Logger.hpp"
+
+// how long a resolved address is kept, getaddrinfo doesn't tell the real TTL.
+constexpr int DNS_CACHE_TTL_SEC = 60;
+// how long a failed lookup is remembered, so a bad host doesn't hit the resolver on every request.
+constexpr int DNS_CACHE_NEGATIVE_TTL_SEC = 5;
+
+// DnsCache keeps the IPv4 addresses of the hosts, so a request doesn't wait for getaddrinfo
+// every time it opens a connection. The lookups run outside the lock.
+class DnsCache {
+private:
+    struct Entry {
+        bool found;
+        in_addr addr;
+        std::chrono::steady_clock::time_point expires_at;
+    };
+
+    std::mutex mutex_;
+    std::unordered_map<std::string, Entry> entries;
+
+    DnsCache() = default;
+
+public:
+    DnsCache(const DnsCache&) = delete;
+    DnsCache& operator=(const DnsCache&) = delete;
+
+    static DnsCache& instance() {
+        static DnsCache cache;
+        return cache;
+    }
+
+    // resolve host into addr, return false if it cannot be resolved.
+    bool Resolve(const std::string& host, in_addr& addr) {
+        auto now = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> lock_guard_(mutex_);
+            auto it = entries.find(host);
+            if (it != entries.end() && it->second.expires_at > now) {
+                addr = it->second.addr;
+                return it->second.found;
+            }
+        }
+
+        struct addrinfo hints, *res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        Entry entry;
+        memset(&entry.addr, 0, sizeof(entry.addr));
+        entry.found = getaddrinfo(host.c_str(), nullptr, &hints, &res) == 0;
+        if (entry.found) {
+            entry.addr = ((struct sockaddr_in*)res->ai_addr)->sin_addr;
+            freeaddrinfo(res);
+        }
+        entry.expires_at = now + std::chrono::seconds(entry.found ? DNS_CACHE_TTL_SEC : DNS_CACHE_NEGATIVE_TTL_SEC);
+        {
+            std::lock_guard<std::mutex> lock_guard_(mutex_);
+            entries[host] = entry;
+        }
+        addr = entry.addr;
+        return entry.found;
+    }
+};
+
+#endif // DNS_CACHE_H
@@ -0,0 +1,492 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+// HPACK (RFC 7541), the header compression of HTTP/2.
+// Both sides keep a dynamic table of the recent headers, and refer to them by index.
+// The encoder of a connection and the decoder of its peer must see every header block in the same order,
+// so a header block must be encoded and sent (or received and decoded) under the same lock.
+
+// the dynamic table size we allow the peer to use (SETTINGS_HEADER_TABLE_SIZE, the default of RFC 7540).
+constexpr size_t HPACK_TABLE_SIZE = 4096;
+// a header list larger than this (the sizes as HPACK counts them) is refused.
+constexpr size_t HPACK_MAX_HEADER_LIST_SIZE = 65536;
+
+namespace HpackUtils {
+    struct Header {
+        std::string name;
+        std::string value;
+    };
+
+    // RFC 7541 Appendix A
+    inline const std::vector<Header>& StaticTable() {
+        static const std::vector<Header> table = {
+        {":authority", ""},
+        {":method", "GET"},
+        {":method", "POST"},
+        {":path", "/"},
+        {":path", "/index.html"},
+        {":scheme", "http"},
+        {":scheme", "https"},
+        {":status", "200"},
+        {":status", "204"},
+        {":status", "206"},
+        {":status", "304"},
+        {":status", "400"},
+        {":status", "404"},
+        {":status", "500"},
+        {"accept-charset", ""},
+        {"accept-encoding", "gzip, deflate"},
+        {"accept-language", ""},
+        {"accept-ranges", ""},
+        {"accept", ""},
+        {"access-control-allow-origin", ""},
+        {"age", ""},
+        {"allow", ""},
+        {"authorization", ""},
+        {"cache-control", ""},
+        {"content-disposition", ""},
+        {"content-encoding", ""},
+        {"content-language", ""},
+        {"content-length", ""},
+        {"content-location", ""},
+        {"content-range", ""},
+        {"content-type", ""},
+        {"cookie", ""},
+        {"date", ""},
+        {"etag", ""},
+        {"expect", ""},
+        {"expires", ""},
+        {"from", ""},
+        {"host", ""},
+        {"if-match", ""},
+        {"if-modified-since", ""},
+        {"if-none-match", ""},
+        {"if-range", ""},
+        {"if-unmodified-since", ""},
+        {"last-modified", ""},
+        {"link", ""},
+        {"location", ""},
+        {"max-forwards", ""},
+        {"proxy-authenticate", ""},
+        {"proxy-authorization", ""},
+        {"range", ""},
+        {"referer", ""},
+        {"refresh", ""},
+        {"retry-after", ""},
+        {"server", ""},
+        {"set-cookie", ""},
+        {"strict-transport-security", ""},
+        {"transfer-encoding", ""},
+        {"user-agent", ""},
+        {"vary", ""},
+        {"via", ""},
+        {"www-authenticate", ""},
+        };
+        return table;
+    }
+
+    // RFC 7541 Appendix B, {code, bits} of the symbols 0-255 and EOS.
+    struct HuffmanCode {
+        uint32_t code;
+        uint8_t bits;
+    };
+    inline const HuffmanCode* HuffmanCodes() {
+        static const HuffmanCode codes[257] = {
+        {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+        {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+        {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+        {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+        {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+        {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+        {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+        {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+        {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+        {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+        {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+        {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+        {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+        {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+        {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+        {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+        {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+        {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+        {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+        {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+        {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+        {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+        {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+        {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+        {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+        {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+        {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+        {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+        {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+        {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+        {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+        {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+        {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+        {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+        {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+        {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+        {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+        {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+        {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+        {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+        {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+        {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+        {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+        {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+        {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+        {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+        {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+        {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+        {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+        {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+        {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+        {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+        {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+        {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+        {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+        {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+        {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+        {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+        {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+        {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+        {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+        {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+        {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+        {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+        {0x3fffffff, 30},
+        };
+        return codes;
+    }
+
+    // the Huffman codes as a binary tree, for decoding bit by bit.
+    struct HuffmanNode {
+        int child[2] = {-1, -1};
+        int symbol = -1;
+    };
+    inline const std::vector<HuffmanNode>& HuffmanTree() {
+        static const std::vector<HuffmanNode> tree = [] {
+            std::vector<HuffmanNode> nodes(1);
+            const HuffmanCode* codes = HuffmanCodes();
+            for (int symbol = 0; symbol < 257; symbol++) {
+                int node = 0;
+                for (int bit = codes[symbol].bits - 1; bit >= 0; bit--) {
+                    int branch = (codes[symbol].code >> bit) & 1;
+                    if (nodes[node].child[branch] == -1) {
+                        nodes[node].child[branch] = (int)nodes.size();
+                        nodes.emplace_back();
+                    }
+                    node = nodes[node].child[branch];
+                }
+                nodes[node].symbol = symbol;
+            }
+            return nodes;
+        }();
+        return tree;
+    }
+
+    // return false if the input is not valid Huffman code (EOS, or padding which is not the prefix of EOS).
+    inline bool HuffmanDecode(const uint8_t* data, size_t len, std::string& out) {
+        const std::vector<HuffmanNode>& tree = HuffmanTree();
+        int node = 0;
+        int pending_bits = 0; // the bits since the last symbol
+        bool all_ones = true;
+        for (size_t i = 0; i < len; i++) {
+            for (int bit = 7; bit >= 0; bit--) {
+                int branch = (data[i] >> bit) & 1;
+                node = tree[node].child[branch];
+                if (node == -1) {
+                    return false;
+                }
+                pending_bits++;
+                all_ones = all_ones && branch == 1;
+                if (tree[node].symbol != -1) {
+                    if (tree[node].symbol == 256) {
+                        return false;
+                    }
+                    out += (char)tree[node].symbol;
+                    node = 0;
+                    pending_bits = 0;
+                    all_ones = true;
+                }
+            }
+        }
+        return pending_bits <= 7 && all_ones;
+    }
+
+    // an entry takes its name, its value and 32 bytes of the table size.
+    inline size_t EntrySize(const Header& header) {
+        return header.name.size() + header.value.size() + 32;
+    }
+
+    class DynamicTable {
+    public:
+        size_t Size() {
+            return size;
+        }
+
+        size_t MaxSize() {
+            return max_size;
+        }
+
+        void SetMaxSize(size_t new_max_size) {
+            max_size = new_max_size;
+            Evict(0);
+        }
+
+        void Add(const Header& header) {
+            size_t entry_size = EntrySize(header);
+            Evict(entry_size);
+            // an entry larger than the table just empties it.
+            if (entry_size <= max_size) {
+                entries.push_front(header);
+                size += entry_size;
+            }
+        }
+
+        size_t Count() {
+            return entries.size();
+        }
+
+        // 0 is the newest entry.
+        const Header& Get(size_t index) {
+            return entries[index];
+        }
+
+    private:
+        std::deque<Header> entries;
+        size_t size = 0;
+        size_t max_size = HPACK_TABLE_SIZE;
+
+        void Evict(size_t room) {
+            while (!entries.empty() && size + room > max_size) {
+                size -= EntrySize(entries.back());
+                entries.pop_back();
+            }
+        }
+    };
+
+    // an integer with an N bit prefix, the first byte keeps its flags in the bits above the prefix.
+    inline void EncodeInteger(uint64_t value, int prefix_bits, uint8_t flags, std::string& out) {
+        uint64_t max_prefix = (1u << prefix_bits) - 1;
+        if (value < max_prefix) {
+            out += (char)(flags | value);
+            return;
+        }
+        out += (char)(flags | max_prefix);
+        value -= max_prefix;
+        while (value >= 128) {
+            out += (char)((value & 0x7f) | 0x80);
+            value >>= 7;
+        }
+        out += (char)value;
+    }
+
+    inline bool DecodeInteger(const uint8_t*& pos, const uint8_t* end, int prefix_bits, uint64_t& value) {
+        if (pos >= end) {
+            return false;
+        }
+        uint64_t max_prefix = (1u << prefix_bits) - 1;
+        value = *pos++ & max_prefix;
+        if (value < max_prefix) {
+            return true;
+        }
+        for (int shift = 0; shift <= 56; shift += 7) {
+            if (pos >= end) {
+                return false;
+            }
+            uint8_t byte = *pos++;
+            value += (uint64_t)(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // the strings are sent as they are, without Huffman, it saves CPU and the peer must accept both.
+    inline void EncodeString(const std::string& s, std::string& out) {
+        EncodeInteger(s.size(), 7, 0x00, out);
+        out += s;
+    }
+
+    inline bool DecodeString(const uint8_t*& pos, const uint8_t* end, std::string& out) {
+        if (pos >= end) {
+            return false;
+        }
+        bool huffman = (*pos & 0x80) != 0;
+        uint64_t len;
+        if (!DecodeInteger(pos, end, 7, len) || len > (uint64_t)(end - pos)) {
+            return false;
+        }
+        out.clear();
+        if (huffman) {
+            if (!HuffmanDecode(pos, len, out)) {
+                return false;
+            }
+        } else {
+            out.assign((const char*)pos, len);
+        }
+        pos += len;
+        return true;
+    }
+}
+
+class HpackEncoder {
+public:
+    // SETTINGS_HEADER_TABLE_SIZE of the peer, the table never grows above it (or above ours).
+    void SetPeerTableSize(size_t size) {
+        size_t new_size = size < HPACK_TABLE_SIZE ? size : HPACK_TABLE_SIZE;
+        if (new_size != table.MaxSize()) {
+            table.SetMaxSize(new_size);
+            size_update = true;
+        }
+    }
+
+    // encode a header block, the names must be lowercase already (HTTP/2 requires it).
+    void Encode(const std::vector<HpackUtils::Header>& headers, std::string& out) {
+        if (size_update) {
+            HpackUtils::EncodeInteger(table.MaxSize(), 5, 0x20, out);
+            size_update = false;
+        }
+        for (auto& header : headers) {
+            size_t name_index = 0;
+            size_t index = Find(header, name_index);
+            if (index != 0) {
+                HpackUtils::EncodeInteger(index, 7, 0x80, out);
+                continue;
+            }
+            // the credentials are never put into the tables of the intermediaries (RFC 7541 7.1.3).
+            bool sensitive = header.name == "authorization" || header.name == "proxy-authorization";
+            if (sensitive) {
+                HpackUtils::EncodeInteger(name_index, 4, 0x10, out);
+            } else {
+                HpackUtils::EncodeInteger(name_index, 6, 0x40, out);
+                table.Add(header);
+            }
+            if (name_index == 0) {
+                HpackUtils::EncodeString(header.name, out);
+            }
+            HpackUtils::EncodeString(header.value, out);
+        }
+    }
+
+private:
+    HpackUtils::DynamicTable table;
+    bool size_update = false;
+
+    // the index of the same header in the tables, 0 if not found.
+    // name_index gets the index of a header with the same name, 0 if not found.
+    size_t Find(const HpackUtils::Header& header, size_t& name_index) {
+        const std::vector<HpackUtils::Header>& static_table = HpackUtils::StaticTable();
+        for (size_t i = 0; i < static_table.size(); i++) {
+            if (static_table[i].name == header.name) {
+                if (static_table[i].value == header.value) {
+                    return i + 1;
+                }
+                if (name_index == 0) {
+                    name_index = i + 1;
+                }
+            }
+        }
+        for (size_t i = 0; i < table.Count(); i++) {
+            const HpackUtils::Header& entry = table.Get(i);
+            if (entry.name == header.name) {
+                if (entry.value == header.value) {
+                    return static_table.size() + i + 1;
+                }
+                if (name_index == 0) {
+                    name_index = static_table.size() + i + 1;
+                }
+            }
+        }
+        return 0;
+    }
+};
+
+class HpackDecoder {
+public:
+    // decode a whole header block (HEADERS and its CONTINUATION frames), append the headers.
+    // return false on a compression error, the connection cannot be used after it.
+    bool Decode(const std::string& block, std::vector<HpackUtils::Header>& headers) {
+        const uint8_t* pos = (const uint8_t*)block.data();
+        const uint8_t* end = pos + block.size();
+        size_t list_size = 0;
+        bool header_seen = false;
+        while (pos < end) {
+            uint8_t first = *pos;
+            HpackUtils::Header header;
+            if (first & 0x80) {
+                // indexed
+                uint64_t index;
+                if (!HpackUtils::DecodeInteger(pos, end, 7, index) || !Lookup(index, header)) {
+                    return false;
+                }
+            } else if ((first & 0xe0) == 0x20) {
+                // dynamic table size update, only at the start of a block.
+                uint64_t size;
+                if (header_seen || !HpackUtils::DecodeInteger(pos, end, 5, size) || size > HPACK_TABLE_SIZE) {
+                    return false;
+                }
+                table.SetMaxSize(size);
+                continue;
+            } else {
+                // a literal, with incremental indexing (01), without indexing (0000) or never indexed (0001).
+                bool indexing = (first & 0xc0) == 0x40;
+                uint64_t name_index;
+                if (!HpackUtils::DecodeInteger(pos, end, indexing ? 6 : 4, name_index)) {
+                    return false;
+                }
+                if (name_index == 0) {
+                    if (!HpackUtils::DecodeString(pos, end, header.name)) {
+                        return false;
+                    }
+                } else if (!Lookup(name_index, header)) {
+                    return false;
+                }
+                if (!HpackUtils::DecodeString(pos, end, header.value)) {
+                    return false;
+                }
+                if (indexing) {
+                    table.Add(header);
+                }
+            }
+            header_seen = true;
+            list_size += HpackUtils::EntrySize(header);
+            if (list_size > HPACK_MAX_HEADER_LIST_SIZE) {
+                return false;
+            }
+            headers.push_back(std::move(header));
+        }
+        return true;
+    }
+
+private:
+    HpackUtils::DynamicTable table;
+
+    bool Lookup(uint64_t index, HpackUtils::Header& header) {
+        const std::vector<HpackUtils::Header>& static_table = HpackUtils::StaticTable();
+        if (index == 0) {
+            return false;
+        }
+        if (index <= static_table.size()) {
+            header = static_table[index - 1];
+            return true;
+        }
+        index -= static_table.size() + 1;
+        if (index >= table.Count()) {
+            return false;
+        }
+        header = table.Get(index);
+        return true;
+    }
+};
+
+#endif // HPACK_H
@@ -0,0 +1,985 @@
+#ifndef HTTP2_CLIENT_H
+#define HTTP2_CLIENT_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "Hpack.hpp"
+#include "../blocking_queue/Blocking_queue.hpp"
+#include "../dns/Dns_cache.hpp"
+#include "../logger/Logger.hpp"
+
+// the largest frame we accept (SETTINGS_MAX_FRAME_SIZE, the default of RFC 7540).
+constexpr size_t H2_MAX_FRAME_SIZE = 16384;
+// how much a server may send on a stream before the proxy has passed it on to the client.
+// a slow client holds back its own stream only, not the whole connection.
+constexpr uint32_t H2_STREAM_WINDOW = 256 * 1024;
+// how much a server may send on the connection, on all the streams together.
+constexpr uint32_t H2_CONNECTION_WINDOW = 16 * 1024 * 1024;
+constexpr int H2_CONNECT_TIMEOUT_SEC = 5;
+// how long a request waits for a free stream, when the server has as many open as it allows.
+constexpr int H2_STREAM_WAIT_SEC = 10;
+
+namespace Http2Utils {
+    const std::string PREFACE = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+    enum FrameType {
+        DATA = 0x0,
+        HEADERS = 0x1,
+        PRIORITY = 0x2,
+        RST_STREAM = 0x3,
+        SETTINGS = 0x4,
+        PUSH_PROMISE = 0x5,
+        PING = 0x6,
+        GOAWAY = 0x7,
+        WINDOW_UPDATE = 0x8,
+        CONTINUATION = 0x9
+    };
+
+    enum FrameFlag {
+        END_STREAM = 0x1,
+        ACK = 0x1,
+        END_HEADERS = 0x4,
+        PADDED = 0x8,
+        PRIORITY_FLAG = 0x20
+    };
+
+    enum ErrorCode {
+        CANCEL = 0x8
+    };
+
+    enum Setting {
+        HEADER_TABLE_SIZE = 0x1,
+        ENABLE_PUSH = 0x2,
+        MAX_CONCURRENT_STREAMS = 0x3,
+        INITIAL_WINDOW_SIZE = 0x4,
+        MAX_FRAME_SIZE = 0x5
+    };
+
+    struct FrameHeader {
+        uint32_t length;
+        uint8_t type;
+        uint8_t flags;
+        uint32_t stream_id;
+    };
+
+    inline void PutUint32(std::string& out, uint32_t value) {
+        out += (char)(value >> 24);
+        out += (char)(value >> 16);
+        out += (char)(value >> 8);
+        out += (char)value;
+    }
+
+    inline uint32_t GetUint32(const char* data) {
+        const uint8_t* p = (const uint8_t*)data;
+        return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+    }
+
+    inline std::string Frame(uint8_t type, uint8_t flags, uint32_t stream_id, const char* payload, size_t len) {
+        std::string frame;
+        frame.reserve(9 + len);
+        frame += (char)(len >> 16);
+        frame += (char)(len >> 8);
+        frame += (char)len;
+        frame += (char)type;
+        frame += (char)flags;
+        PutUint32(frame, stream_id & 0x7fffffff);
+        frame.append(payload, len);
+        return frame;
+    }
+
+    inline std::string Frame(uint8_t type, uint8_t flags, uint32_t stream_id, const std::string& payload = "") {
+        return Frame(type, flags, stream_id, payload.data(), payload.size());
+    }
+
+    inline std::string WindowUpdate(uint32_t stream_id, uint32_t increment) {
+        std::string payload;
+        PutUint32(payload, increment);
+        return Frame(WINDOW_UPDATE, 0, stream_id, payload);
+    }
+
+    inline bool SendAll(int fd, const std::string& data) {
+        size_t sent = 0;
+        while (sent < data.size()) {
+            ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) {
+                return false;
+            }
+            sent += n;
+        }
+        return true;
+    }
+
+    inline bool RecvAll(int fd, char* data, size_t len) {
+        while (len > 0) {
+            ssize_t n = recv(fd, data, len, 0);
+            if (n <= 0) {
+                return false;
+            }
+            data += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    // read a whole frame, the payload is at most max_size.
+    inline bool ReadFrame(int fd, FrameHeader& header, std::string& payload, size_t max_size) {
+        char head[9];
+        if (!RecvAll(fd, head, sizeof(head))) {
+            return false;
+        }
+        const uint8_t* p = (const uint8_t*)head;
+        header.length = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+        header.type = p[3];
+        header.flags = p[4];
+        header.stream_id = GetUint32(head + 5) & 0x7fffffff;
+        if (header.length > max_size) {
+            return false;
+        }
+        payload.resize(header.length);
+        return RecvAll(fd, &payload[0], header.length);
+    }
+
+    // the payload of DATA or HEADERS without its padding (and priority), false if the padding is broken.
+    inline bool StripPadding(const FrameHeader& header, std::string& payload) {
+        size_t begin = 0;
+        size_t pad_len = 0;
+        if (header.flags & PADDED) {
+            if (payload.empty()) {
+                return false;
+            }
+            pad_len = (uint8_t)payload[0];
+            begin = 1;
+        }
+        if (header.type == HEADERS && (header.flags & PRIORITY_FLAG)) {
+            begin += 5;
+        }
+        if (begin + pad_len > payload.size()) {
+            return false;
+        }
+        payload = payload.substr(begin, payload.size() - begin - pad_len);
+        return true;
+    }
+
+    // what the reader thread of a connection passes to the consumer of a stream.
+    struct Event {
+        enum Type {
+            HEADERS,
+            DATA,
+            RESET // the stream (or the whole connection) is gone
+        };
+        Type type;
+        std::vector<HpackUtils::Header> headers;
+        std::string data;
+        bool end_stream;
+    };
+
+    class Connection;
+
+    struct Stream {
+        uint32_t id = 0;
+        std::string method;
+        BlockingQueue<Event> events;
+        // the weak pointer, a stream may be read after its connection has gone.
+        std::weak_ptr<Connection> connection;
+        // protected by the mutex of the connection.
+        int64_t send_window = 0;
+        bool reset = false;
+        // only touched by the consumer.
+        uint32_t unacked = 0; // the bytes read, but not given back to the server by WINDOW_UPDATE yet.
+    };
+
+    // a stream which has failed before it was sent, its response is "502 Bad Gateway".
+    inline std::shared_ptr<Stream> FailedStream(const std::string& method) {
+        auto stream = std::make_shared<Stream>();
+        stream->method = method;
+        stream->reset = true;
+        stream->events.push({Event::RESET, {}, "", true});
+        return stream;
+    }
+
+    // "content-type" -> "Content-Type", HttpHandler and some clients only know the usual spelling.
+    inline std::string CanonicalName(const std::string& name) {
+        std::string result = name;
+        bool upper = true;
+        for (auto& c : result) {
+            c = upper ? toupper(c) : c;
+            upper = c == '-';
+        }
+        return result;
+    }
+
+    // HTTP/2 has no reason phrase, the status line gets the usual one back.
+    inline const char* ReasonPhrase(const std::string& status) {
+        static const std::unordered_map<std::string, const char*> reasons = {
+            {"100", "Continue"}, {"200", "OK"}, {"201", "Created"}, {"204", "No Content"},
+            {"206", "Partial Content"}, {"301", "Moved Permanently"}, {"302", "Found"}, {"304", "Not Modified"},
+            {"307", "Temporary Redirect"}, {"308", "Permanent Redirect"}, {"400", "Bad Request"},
+            {"401", "Unauthorized"}, {"403", "Forbidden"}, {"404", "Not Found"}, {"429", "Too Many Requests"},
+            {"500", "Internal Server Error"}, {"502", "Bad Gateway"}, {"503", "Service Unavailable"},
+            {"504", "Gateway Timeout"}};
+        auto it = reasons.find(status);
+        return it == reasons.end() ? "" : it->second;
+    }
+
+    // the HTTP/1.1 request (as HttpHandler::GetRequest builds it) -> the HTTP/2 request headers.
+    // the fields about the HTTP/1.1 connection are not allowed in HTTP/2.
+    inline std::vector<HpackUtils::Header> RequestHeaders(const std::string& request, const std::string& authority) {
+        std::vector<HpackUtils::Header> headers;
+        size_t line_end = request.find("\r\n");
+        std::istringstream request_line(request.substr(0, line_end));
+        std::string method, target;
+        request_line >> method >> target;
+        // the absolute url -> the path
+        size_t scheme_pos = target.find("://");
+        if (scheme_pos != std::string::npos) {
+            size_t path_pos = target.find('/', scheme_pos + 3);
+            target = path_pos == std::string::npos ? "/" : target.substr(path_pos);
+        }
+        headers.push_back({":method", method});
+        headers.push_back({":scheme", "http"});
+        headers.push_back({":authority", authority});
+        headers.push_back({":path", target.empty() ? "/" : target});
+
+        static const std::unordered_set<std::string> connection_fields = {
+            "host", "connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade"};
+        size_t pos = line_end + 2;
+        while ((line_end = request.find("\r\n", pos)) != std::string::npos && line_end > pos) {
+            std::string line = request.substr(pos, line_end - pos);
+            pos = line_end + 2;
+            size_t colon_pos = line.find(':');
+            if (colon_pos == std::string::npos) {
+                continue;
+            }
+            std::string name = line.substr(0, colon_pos);
+            for (auto& c : name) {
+                c = tolower(c);
+            }
+            size_t value_begin = line.find_first_not_of(" \t", colon_pos + 1);
+            std::string value = value_begin == std::string::npos ? "" : line.substr(value_begin);
+            value.erase(value.find_last_not_of(" \t") + 1);
+            if (connection_fields.count(name) != 0 || (name == "te" && value != "trailers")) {
+                continue;
+            }
+            headers.push_back({name, value});
+        }
+        return headers;
+    }
+
+    // one HTTP/2 connection to a server, carrying all the concurrent requests to it.
+    // A reader thread reads all the frames, and passes the responses to their streams.
+    class Connection : public std::enable_shared_from_this<Connection> {
+    public:
+        Connection(const std::string& host, int port) : host{host}, port{port} {}
+
+        ~Connection() {
+            if (sockfd != -1) {
+                close(sockfd);
+            }
+        }
+
+        // connect, send the preface and our settings, start the reader thread.
+        bool Start() {
+            sockaddr_in server_addr;
+            memset(&server_addr, 0, sizeof(server_addr));
+            server_addr.sin_family = AF_INET;
+            server_addr.sin_port = htons(port);
+            if (!DnsCache::instance().Resolve(host, server_addr.sin_addr)) {
+                LOG_WARN_LIMITED("[Http2]: Error resolving hostname! Host: %s", host.c_str());
+                return false;
+            }
+            sockfd = socket(AF_INET, SOCK_STREAM, 0);
+            if (sockfd < 0) {
+                return false;
+            }
+            int opt = 1;
+            setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+            // SO_SNDTIMEO also limits connect().
+            struct timeval timeout;
+            timeout.tv_sec = H2_CONNECT_TIMEOUT_SEC;
+            timeout.tv_usec = 0;
+            setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            if (connect(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+                LOG_WARN_LIMITED("[Http2]: Host: %s:%d Failed to connect: %s", host.c_str(), port, strerror(errno));
+                return false;
+            }
+
+            std::string settings;
+            AppendSetting(settings, ENABLE_PUSH, 0);
+            AppendSetting(settings, INITIAL_WINDOW_SIZE, H2_STREAM_WINDOW);
+            AppendSetting(settings, HEADER_TABLE_SIZE, HPACK_TABLE_SIZE);
+            std::string handshake = PREFACE + Frame(SETTINGS, 0, 0, settings) +
+                                    WindowUpdate(0, H2_CONNECTION_WINDOW - 65535);
+            if (!SendAll(sockfd, handshake)) {
+                return false;
+            }
+            // the thread keeps the connection alive until the server closes it.
+            std::thread([this, self = shared_from_this()] { reader(); }).detach();
+            return true;
+        }
+
+        // can it take a new request?
+        bool Alive() {
+            std::lock_guard<std::mutex> lock_guard_(mutex_);
+            return !dead && !goaway;
+        }
+
+        // open a stream with the request headers, end_stream if the request has no body.
+        // the stream is always returned, if the request cannot be sent it is reset already.
+        std::shared_ptr<Stream> Open(const std::vector<HpackUtils::Header>& headers, const std::string& method, bool end_stream) {
+            {
+                // wait for a free stream, the server has a limit.
+                std::unique_lock<std::mutex> lock_(mutex_);
+                if (!cond.wait_for(lock_, std::chrono::seconds(H2_STREAM_WAIT_SEC),
+                                   [this] { return dead || goaway || active_streams < peer_max_streams; })) {
+                    LOG_WARN_LIMITED("[Http2]: Host: %s:%d No free stream in %d seconds.", host.c_str(), port, H2_STREAM_WAIT_SEC);
+                    return FailedStream(method);
+                }
+                if (dead || goaway) {
+                    return FailedStream(method);
+                }
+                active_streams++;
+            }
+            auto stream = std::make_shared<Stream>();
+            stream->method = method;
+            stream->connection = shared_from_this();
+            // the stream ids must be sent in order, and the header blocks must be encoded in the order they are sent.
+            std::lock_guard<std::mutex> write_lock_(write_mutex_);
+            std::string block;
+            encoder.Encode(headers, block);
+            {
+                std::lock_guard<std::mutex> lock_guard_(mutex_);
+                stream->id = next_stream_id;
+                next_stream_id += 2;
+                stream->send_window = peer_initial_window;
+                streams[stream->id] = stream;
+            }
+            std::string frames;
+            size_t max_frame = std::min<size_t>(peer_max_frame, H2_MAX_FRAME_SIZE);
+            for (size_t pos = 0; pos == 0 || pos < block.size(); pos += max_frame) {
+                size_t len = std::min(max_frame, block.size() - pos);
+                bool last = pos + len >= block.size();
+                uint8_t flags = (last ? END_HEADERS : 0) | (pos == 0 && end_stream ? END_STREAM : 0);
+                frames += Frame(pos == 0 ? HEADERS : CONTINUATION, flags, stream->id, block.data() + pos, len);
+            }
+            if (!SendAll(sockfd, frames)) {
+                Fail("failed to send the request headers");
+            }
+            return stream;
+        }
+
+        // send a piece of the request body, it blocks while the windows of the server are full.
+        bool SendData(Stream& stream, const char* data, size_t len, bool end_stream) {
+            do {
+                size_t n;
+                {
+                    std::unique_lock<std::mutex> lock_(mutex_);
+                    cond.wait(lock_, [&] {
+                        return dead || stream.reset || len == 0 || std::min(send_window, stream.send_window) > 0;
+                    });
+                    if (dead || stream.reset) {
+                        return false;
+                    }
+                    n = std::min<int64_t>({(int64_t)len, send_window, stream.send_window,
+                                           (int64_t)std::min<size_t>(peer_max_frame, H2_MAX_FRAME_SIZE)});
+                    send_window -= n;
+                    stream.send_window -= n;
+                }
+                bool last = n == len && end_stream;
+                std::lock_guard<std::mutex> write_lock_(write_mutex_);
+                if (!SendAll(sockfd, Frame(DATA, last ? END_STREAM : 0, stream.id, data, n))) {
+                    Fail("failed to send the request body");
+                    return false;
+                }
+                data += n;
+                len -= n;
+            } while (len > 0);
+            return true;
+        }
+
+        // the consumer has passed n bytes of the stream on, the server may send that much more.
+        // the windows are given back in batches, not for every frame.
+        void Consumed(Stream& stream, size_t n, bool end_stream) {
+            std::string updates;
+            stream.unacked += n;
+            if (!end_stream && stream.unacked >= H2_STREAM_WINDOW / 2) {
+                updates += WindowUpdate(stream.id, stream.unacked);
+                stream.unacked = 0;
+            }
+            {
+                std::lock_guard<std::mutex> lock_guard_(mutex_);
+                connection_unacked += n;
+                if (connection_unacked >= H2_CONNECTION_WINDOW / 2) {
+                    updates += WindowUpdate(0, connection_unacked);
+                    connection_unacked = 0;
+                }
+            }
+            if (!updates.empty()) {
+                std::lock_guard<std::mutex> write_lock_(write_mutex_);
+                SendAll(sockfd, updates);
+            }
+        }
+
+        // the rest of the stream will never be read (the client has gone): the server is told to stop sending it,
+        // and the slot of the stream and the window of what has arrived but not been read are given back.
+        // the consumer, if it is waiting for the stream, gets a RESET.
+        void Cancel(Stream& stream) {
+            bool open;
+            size_t unread = 0;
+            {
+                // the reader pushes the events under mutex_ too, nothing arrives after the drain.
+                std::lock_guard<std::mutex> lock_guard_(mutex_);
+                open = !dead && streams.count(stream.id) != 0;
+                if (open) {
+                    finish_stream(stream.id);
+                }
+                stream.reset = true;
+                Event event;
+                while (stream.events.try_pop(event)) {
+                    unread += event.data.size();
+                }
+                stream.events.push({Event::RESET, {}, "", true});
+                cond.notify_all();
+            }
+            std::string frames;
+            if (open) {
+                std::string payload;
+                PutUint32(payload, CANCEL);
+                frames += Frame(RST_STREAM, 0, stream.id, payload);
+            }
+            if (unread > 0) {
+                frames += WindowUpdate(0, unread);
+            }
+            if (!frames.empty()) {
+                send_frame(frames);
+            }
+        }
+
+    private:
+        std::string host;
+        int port;
+        int sockfd = -1;
+
+        // protects the streams, the windows and the settings of the server.
+        std::mutex mutex_;
+        std::condition_variable cond;
+        std::unordered_map<uint32_t, std::shared_ptr<Stream>> streams;
+        uint32_t next_stream_id = 1;
+        size_t active_streams = 0;
+        int64_t send_window = 65535;
+        uint32_t peer_initial_window = 65535;
+        uint32_t peer_max_frame = H2_MAX_FRAME_SIZE;
+        // unlimited until the server says otherwise, just not too many.
+        size_t peer_max_streams = 100;
+        uint32_t connection_unacked = 0;
+        bool dead = false;
+        bool goaway = false;
+
+        // every frame is written as a whole under it, and the header blocks are encoded under it.
+        std::mutex write_mutex_;
+        HpackEncoder encoder;
+        // only used by the reader thread.
+        HpackDecoder decoder;
+
+        static void AppendSetting(std::string& out, uint16_t id, uint32_t value) {
+            out += (char)(id >> 8);
+            out += (char)id;
+            PutUint32(out, value);
+        }
+
+        void send_frame(const std::string& frame) {
+            std::lock_guard<std::mutex> write_lock_(write_mutex_);
+            SendAll(sockfd, frame);
+        }
+
+        // the connection cannot be used anymore, the reader thread will see it and reset all the streams.
+        void Fail(const char* reason) {
+            LOG_WARN_LIMITED("[Http2]: Host: %s:%d %s.", host.c_str(), port, reason);
+            shutdown(sockfd, SHUT_RDWR);
+        }
+
+        // the stream has ended on the server side, call with mutex_ locked.
+        void finish_stream(uint32_t stream_id) {
+            if (streams.erase(stream_id) != 0) {
+                active_streams--;
+                cond.notify_all();
+            }
+        }
+
+        void handle_settings(const std::string& payload) {
+            int64_t table_size = -1;
+            {
+                std::lock_guard<std::mutex> lock_guard_(mutex_);
+                for (size_t pos = 0; pos + 6 <= payload.size(); pos += 6) {
+                    uint16_t id = ((uint8_t)payload[pos] << 8) | (uint8_t)payload[pos + 1];
+                    uint32_t value = GetUint32(payload.data() + pos + 2);
+                    if (id == HEADER_TABLE_SIZE) {
+                        table_size = value;
+                    } else if (id == MAX_CONCURRENT_STREAMS) {
+                        peer_max_streams = value;
+                    } else if (id == INITIAL_WINDOW_SIZE) {
+                        // the change applies to the open streams too.
+                        int64_t delta = (int64_t)value - peer_initial_window;
+                        for (auto& stream : streams) {
+                            stream.second->send_window += delta;
+                        }
+                        peer_initial_window = value;
+                    } else if (id == MAX_FRAME_SIZE) {
+                        peer_max_frame = value;
+                    }
+                }
+                cond.notify_all();
+            }
+            // write_mutex_ is never taken inside mutex_, Open() takes them the other way round.
+            std::lock_guard<std::mutex> write_lock_(write_mutex_);
+            if (table_size >= 0) {
+                encoder.SetPeerTableSize(table_size);
+            }
+            SendAll(sockfd, Frame(SETTINGS, ACK, 0));
+        }
+
+        // a header block is in a HEADERS frame, and the CONTINUATION frames right after it.
+        bool read_header_block(FrameHeader& header, std::string& payload, std::string& block) {
+            if (!StripPadding(header, payload)) {
+                return false;
+            }
+            block = payload;
+            uint8_t flags = header.flags;
+            while ((flags & END_HEADERS) == 0) {
+                FrameHeader continuation;
+                if (!ReadFrame(sockfd, continuation, payload, H2_MAX_FRAME_SIZE) || continuation.type != CONTINUATION ||
+                    continuation.stream_id != header.stream_id || block.size() > HPACK_MAX_HEADER_LIST_SIZE) {
+                    return false;
+                }
+                block += payload;
+                flags = continuation.flags;
+            }
+            return true;
+        }
+
+        // read the frames until the connection is closed.
+        void reader() {
+            FrameHeader header;
+            std::string payload;
+            const char* reason = "connection closed";
+            while (ReadFrame(sockfd, header, payload, H2_MAX_FRAME_SIZE)) {
+                if (header.type == DATA) {
+                    size_t frame_size = payload.size();
+                    if (!StripPadding(header, payload)) {
+                        reason = "broken padding";
+                        break;
+                    }
+                    bool end_stream = (header.flags & END_STREAM) != 0;
+                    size_t data_size = payload.size();
+                    std::shared_ptr<Stream> stream;
+                    {
+                        // under mutex_, a stream which is cancelled gets nothing after it.
+                        std::lock_guard<std::mutex> lock_guard_(mutex_);
+                        auto it = streams.find(header.stream_id);
+                        if (it != streams.end()) {
+                            stream = it->second;
+                            stream->events.push({Event::DATA, {}, std::move(payload), end_stream});
+                            if (end_stream) {
+                                finish_stream(header.stream_id);
+                            }
+                        }
+                    }
+                    // the padding (and the data of a stream which is gone) is given back at once,
+                    // the data itself when the consumer has passed it on.
+                    size_t give_back = stream == nullptr ? frame_size : frame_size - data_size;
+                    if (give_back > 0) {
+                        std::string updates = WindowUpdate(0, give_back);
+                        if (stream != nullptr && !end_stream) {
+                            updates += WindowUpdate(header.stream_id, give_back);
+                        }
+                        send_frame(updates);
+                    }
+                } else if (header.type == HEADERS) {
+                    std::string block;
+                    std::vector<HpackUtils::Header> headers;
+                    // the block is decoded even if the stream is gone, or the tables would not match anymore.
+                    if (!read_header_block(header, payload, block) || !decoder.Decode(block, headers)) {
+                        reason = "broken header block";
+                        break;
+                    }
+                    bool end_stream = (header.flags & END_STREAM) != 0;
+                    std::lock_guard<std::mutex> lock_guard_(mutex_);
+                    auto it = streams.find(header.stream_id);
+                    if (it != streams.end()) {
+                        it->second->events.push({Event::HEADERS, std::move(headers), "", end_stream});
+                        if (end_stream) {
+                            finish_stream(header.stream_id);
+                        }
+                    }
+                } else if (header.type == RST_STREAM) {
+                    std::lock_guard<std::mutex> lock_guard_(mutex_);
+                    auto it = streams.find(header.stream_id);
+                    if (it != streams.end()) {
+                        it->second->reset = true;
+                        it->second->events.push({Event::RESET, {}, "", true});
+                        finish_stream(header.stream_id);
+                    }
+                } else if (header.type == SETTINGS) {
+                    if ((header.flags & ACK) == 0) {
+                        handle_settings(payload);
+                    }
+                } else if (header.type == PING) {
+                    if ((header.flags & ACK) == 0) {
+                        send_frame(Frame(PING, ACK, 0, payload));
+                    }
+                } else if (header.type == GOAWAY) {
+                    // the streams above the last one will never be answered, the others go on.
+                    uint32_t last_stream_id = payload.size() >= 4 ? GetUint32(payload.data()) & 0x7fffffff : 0;
+                    std::lock_guard<std::mutex> lock_guard_(mutex_);
+                    goaway = true;
+                    for (auto it = streams.begin(); it != streams.end();) {
+                        if (it->first > last_stream_id) {
+                            it->second->reset = true;
+                            it->second->events.push({Event::RESET, {}, "", true});
+                            it = streams.erase(it);
+                            active_streams--;
+                        } else {
+                            ++it;
+                        }
+                    }
+                    cond.notify_all();
+                } else if (header.type == WINDOW_UPDATE) {
+                    uint32_t increment = payload.size() >= 4 ? GetUint32(payload.data()) & 0x7fffffff : 0;
+                    std::lock_guard<std::mutex> lock_guard_(mutex_);
+                    if (header.stream_id == 0) {
+                        send_window += increment;
+                    } else {
+                        auto it = streams.find(header.stream_id);
+                        if (it != streams.end()) {
+                            it->second->send_window += increment;
+                        }
+                    }
+                    cond.notify_all();
+                } else if (header.type == PUSH_PROMISE) {
+                    // we have disabled the push.
+                    reason = "unexpected push promise";
+                    break;
+                }
+                // PRIORITY and the unknown frames are ignored.
+                {
+                    std::lock_guard<std::mutex> lock_guard_(mutex_);
+                    if (goaway && streams.empty()) {
+                        reason = "goaway";
+                        break;
+                    }
+                }
+            }
+
+            LOG_DEBUG("[Http2]: Host: %s:%d Connection ended: %s", host.c_str(), port, reason);
+            shutdown(sockfd, SHUT_RDWR);
+            std::lock_guard<std::mutex> lock_guard_(mutex_);
+            dead = true;
+            for (auto& stream : streams) {
+                stream.second->reset = true;
+                stream.second->events.push({Event::RESET, {}, "", true});
+            }
+            streams.clear();
+            active_streams = 0;
+            cond.notify_all();
+        }
+    };
+
+    // the streams of one client to one server, in the order of its requests, for the consumer to read one after
+    // another. when the client has gone, Cancel() cancels the stream being read and the ones after it.
+    class StreamQueue {
+    public:
+        void push(std::shared_ptr<Stream> stream) {
+            {
+                std::lock_guard<std::mutex> lock_guard_(mutex_);
+                if (!cancelled) {
+                    queue.push_back(std::move(stream));
+                    cond.notify_all();
+                    return;
+                }
+            }
+            CancelStream(*stream);
+        }
+
+        // the next stream, nullptr once the queue is cancelled. false if !wait and there is none yet.
+        bool pop(std::shared_ptr<Stream>& stream, bool wait) {
+            std::unique_lock<std::mutex> lock_(mutex_);
+            if (wait) {
+                cond.wait(lock_, [this] { return cancelled || !queue.empty(); });
+            }
+            if (cancelled) {
+                stream = nullptr;
+                return true;
+            }
+            if (queue.empty()) {
+                return false;
+            }
+            stream = std::move(queue.front());
+            queue.pop_front();
+            reading = stream;
+            return true;
+        }
+
+        void Cancel() {
+            std::deque<std::shared_ptr<Stream>> cancelled_streams;
+            {
+                std::lock_guard<std::mutex> lock_guard_(mutex_);
+                if (cancelled) {
+                    return;
+                }
+                cancelled = true;
+                cancelled_streams.swap(queue);
+                if (reading != nullptr) {
+                    cancelled_streams.push_front(std::move(reading));
+                }
+                cond.notify_all();
+            }
+            for (auto& stream : cancelled_streams) {
+                CancelStream(*stream);
+            }
+        }
+
+    private:
+        std::mutex mutex_;
+        std::condition_variable cond;
+        std::deque<std::shared_ptr<Stream>> queue;
+        // the last stream popped, it may still be read.
+        std::shared_ptr<Stream> reading;
+        bool cancelled = false;
+
+        static void CancelStream(Stream& stream) {
+            // without a connection, the stream has been reset when the connection ended.
+            if (auto connection = stream.connection.lock()) {
+                connection->Cancel(stream);
+            }
+        }
+    };
+}
+
+// Http2ResponseReader reads the responses of the streams one after another, as a HTTP/1.1 byte stream,
+// so ClientProxy::recvResponse handles them just like the responses from a HTTP/1.1 server.
+// A response without Content-Length gets "Transfer-Encoding: chunked".
+class Http2ResponseReader {
+public:
+    using StreamQueue = Http2Utils::StreamQueue;
+
+    explicit Http2ResponseReader(std::shared_ptr<StreamQueue> streams) : streams{streams} {}
+
+    // like recv(): return the number of bytes, 0 if there are no more responses (or a response is broken),
+    // -1 with errno EAGAIN if !wait and nothing has arrived yet.
+    ssize_t Read(char* buffer, size_t size, bool wait) {
+        while (pending.empty()) {
+            if (broken) {
+                return 0;
+            }
+            if (current == nullptr) {
+                if (!streams->pop(current, wait)) {
+                    errno = EAGAIN;
+                    return -1;
+                }
+                // nullptr: the client has gone.
+                if (current == nullptr) {
+                    return 0;
+                }
+                final_headers = false;
+                chunked = false;
+            }
+            Http2Utils::Event event;
+            if (wait) {
+                event = current->events.pop();
+            } else if (!current->events.try_pop(event)) {
+                errno = EAGAIN;
+                return -1;
+            }
+            render(event);
+        }
+        size_t n = std::min(size, pending.size());
+        memcpy(buffer, pending.data(), n);
+        pending.erase(0, n);
+        return n;
+    }
+
+private:
+    std::shared_ptr<StreamQueue> streams;
+    std::shared_ptr<Http2Utils::Stream> current;
+    bool final_headers = false;
+    bool chunked = false;
+    bool broken = false;
+    std::string pending;
+
+    void render(Http2Utils::Event& event) {
+        if (event.type == Http2Utils::Event::RESET) {
+            if (!final_headers) {
+                // nothing has been sent for this request yet, it can still get a proper response.
+                pending = "HTTP/1.1 502 Bad Gateway\r\nContent-Type: text/plain\r\nContent-Length: 15\r\n\r\n502 Bad Gateway";
+            } else {
+                broken = true;
+            }
+            current = nullptr;
+            return;
+        }
+        if (event.type == Http2Utils::Event::HEADERS) {
+            if (!final_headers) {
+                renderHeaders(event);
+            } else if (event.end_stream && chunked) {
+                // the trailers are dropped.
+                pending += "0\r\n\r\n";
+            }
+        } else {
+            if (auto connection = current->connection.lock()) {
+                connection->Consumed(*current, event.data.size(), event.end_stream);
+            }
+            if (chunked && !event.data.empty()) {
+                char size_line[24];
+                snprintf(size_line, sizeof(size_line), "%zx\r\n", event.data.size());
+                pending += size_line;
+                pending += event.data;
+                pending += "\r\n";
+            } else if (!chunked) {
+                pending += event.data;
+            }
+            if (event.end_stream && chunked) {
+                pending += "0\r\n\r\n";
+            }
+        }
+        if (event.end_stream) {
+            current = nullptr;
+        }
+    }
+
+    void renderHeaders(Http2Utils::Event& event) {
+        std::string status;
+        std::string fields;
+        bool has_length = false;
+        for (auto& header : event.headers) {
+            if (header.name == ":status") {
+                status = header.value;
+            } else if (!header.name.empty() && header.name[0] != ':') {
+                has_length = has_length || header.name == "content-length";
+                fields += Http2Utils::CanonicalName(header.name) + ": " + header.value + "\r\n";
+            }
+        }
+        bool interim = !status.empty() && status[0] == '1';
+        if (!interim) {
+            final_headers = true;
+            bool no_body = status == "204" || status == "304" || current->method == "HEAD";
+            if (!has_length && !no_body) {
+                if (event.end_stream) {
+                    fields += "Content-Length: 0\r\n";
+                } else {
+                    fields += "Transfer-Encoding: chunked\r\n";
+                    chunked = true;
+                }
+            }
+        }
+        // the space after the status is needed even without a reason phrase.
+        pending += "HTTP/1.1 " + status + " " + Http2Utils::ReasonPhrase(status) + "\r\n" + fields + "\r\n";
+    }
+};
+
+// Http2Client keeps one HTTP/2 connection per server, for the servers which speak h2c (HTTP/2 without TLS).
+// There is no Upgrade from HTTP/1.1, the servers must be known (prior knowledge):
+//   PROXY_H2C_HOSTS=example.com:80,127.0.0.1:8080
+class Http2Client {
+private:
+    std::unordered_set<std::string> hosts;
+    std::mutex mutex_;
+    std::unordered_map<std::string, std::shared_ptr<Http2Utils::Connection>> connections;
+    // the servers which are being connected to, and the requests waiting for them.
+    std::unordered_set<std::string> connecting;
+    std::condition_variable connected;
+
+    Http2Client() {
+        const char* env = std::getenv("PROXY_H2C_HOSTS");
+        if (env == nullptr) {
+            return;
+        }
+        std::istringstream iss(env);
+        std::string host;
+        while (std::getline(iss, host, ',')) {
+            host.erase(std::remove_if(host.begin(), host.end(), ::isspace), host.end());
+            for (auto& c : host) {
+                c = tolower(c);
+            }
+            if (!host.empty()) {
+                hosts.insert(host.find(':') == std::string::npos ? host + ":80" : host);
+            }
+        }
+    }
+
+    static std::string Key(const std::string& host, int port) {
+        std::string key = host + ":" + std::to_string(port);
+        for (auto& c : key) {
+            c = tolower(c);
+        }
+        return key;
+    }
+
+public:
+    Http2Client(const Http2Client&) = delete;
+    Http2Client& operator=(const Http2Client&) = delete;
+
+    static Http2Client& instance() {
+        // never destroyed, the reader threads may still be running at exit.
+        static Http2Client* client = new Http2Client();
+        return *client;
+    }
+
+    bool Enabled(const std::string& host, int port) {
+        return !hosts.empty() && hosts.count(Key(host, port)) != 0;
+    }
+
+    // the connection to host:port, a new one if there is none (or it cannot take new requests).
+    // nullptr if the server cannot be reached.
+    std::shared_ptr<Http2Utils::Connection> Get(const std::string& host, int port) {
+        std::string key = Key(host, port);
+        {
+            // the requests which come while the connection is being made wait for it,
+            // so the concurrent first requests to a server share one connection too.
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (true) {
+                auto it = connections.find(key);
+                if (it != connections.end() && it->second->Alive()) {
+                    return it->second;
+                }
+                if (connecting.count(key) == 0) {
+                    break;
+                }
+                connected.wait(lock);
+            }
+            connecting.insert(key);
+        }
+        // connect outside the lock, the other servers dont wait for this one.
+        auto connection = std::make_shared<Http2Utils::Connection>(host, port);
+        bool started = connection->Start();
+        std::lock_guard<std::mutex> lock_guard_(mutex_);
+        connecting.erase(key);
+        connected.notify_all();
+        if (!started) {
+            return nullptr;
+        }
+        LOG_DEBUG("[Http2]: Connected to %s", key.c_str());
+        connections[key] = connection;
+        return connection;
+    }
+};
+
+#endif // HTTP2_CLIENT_H
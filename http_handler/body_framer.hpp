@@ -0,0 +1,240 @@
+#ifndef BODY_FRAMER_H
+#define BODY_FRAMER_H
+
+#include <cctype>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <strings.h>
+#include <vector>
+
+// BodyFramer finds where a message body ends, without keeping the body.
+// Feed it the bytes after the headers piece by piece, it tells how many of them belong to the body,
+// so the body can be forwarded as soon as it arrives, and the rest is the next message.
+//
+// 1. Content-Length: the body is exactly that many bytes.
+// 2. Transfer-Encoding with chunked as the final coding: the body ends with the last chunk "0\r\n" and the trailers.
+//    a request with any other Transfer-Encoding cannot be framed, HttpHandler marks it as a framing error.
+// 3. otherwise the message has no body (for requests), or ends when the connection is closed (for responses).
+//
+// The chunked bytes are passed through as they are, they can also be decoded into a string.
+class BodyFramer {
+public:
+    enum Mode {
+        NONE,
+        LENGTH,
+        CHUNKED
+    };
+
+    BodyFramer() = default;
+
+    // set up the framing from the header fields.
+    // Transfer-Encoding wins over Content-Length, just as RFC 9112 says.
+    BodyFramer(const std::string& transfer_encoding, const std::string& content_length) {
+        std::vector<std::string> codings = Codings(transfer_encoding);
+        if (!codings.empty()) {
+            // without chunked at the end, only closing the connection ends the body (NONE).
+            if (ChunkedFinal(codings)) {
+                mode = CHUNKED;
+                state = CHUNK_SIZE;
+            }
+        } else if (!content_length.empty()) {
+            mode = LENGTH;
+            remaining = std::strtoull(content_length.c_str(), nullptr, 10);
+        }
+    }
+
+    // the transfer codings of a Transfer-Encoding value ("gzip, chunked"), lowercase, without "identity".
+    // the values of several Transfer-Encoding lines must be joined with ", " first.
+    static std::vector<std::string> Codings(const std::string& transfer_encoding) {
+        std::vector<std::string> codings;
+        std::istringstream iss(transfer_encoding);
+        std::string coding;
+        while (std::getline(iss, coding, ',')) {
+            // "gzip;q=1" has no parameters which matter here.
+            coding = coding.substr(0, coding.find(';'));
+            size_t begin = coding.find_first_not_of(" \t");
+            size_t end = coding.find_last_not_of(" \t");
+            if (begin == std::string::npos) {
+                continue;
+            }
+            coding = coding.substr(begin, end - begin + 1);
+            for (auto& c : coding) {
+                c = tolower((unsigned char)c);
+            }
+            if (coding != "identity") {
+                codings.push_back(coding);
+            }
+        }
+        return codings;
+    }
+
+    // chunked is the final coding and is not applied twice, so it frames the body (RFC 9112 6.1).
+    static bool ChunkedFinal(const std::vector<std::string>& codings) {
+        if (codings.empty() || codings.back() != "chunked") {
+            return false;
+        }
+        for (size_t i = 0; i + 1 < codings.size(); i++) {
+            if (codings[i] == "chunked") {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    Mode GetMode() {
+        return mode;
+    }
+
+    bool Done() {
+        return mode == NONE || (mode == LENGTH && remaining == 0) || (mode == CHUNKED && state == FINISHED);
+    }
+
+    // Content-Length of the body, 0 if it is not known.
+    unsigned long long GetContentLength() {
+        return mode == LENGTH ? remaining + consumed : 0;
+    }
+
+    // how many bytes of the body have been consumed.
+    unsigned long long GetConsumed() {
+        return consumed;
+    }
+
+    // how many bytes of the decoded body (without chunk framing) have been consumed.
+    unsigned long long GetDecodedSize() {
+        return decoded_size;
+    }
+
+    // consume the bytes of the body from data, return how many bytes are consumed.
+    // the bytes after the returned size belong to the next message.
+    // if decoded is not nullptr, the decoded body (without chunk framing) is appended to it.
+    // if the chunked framing is broken, error is set and nothing more is consumed.
+    size_t Consume(const char* data, size_t len, std::string* decoded = nullptr) {
+        if (mode == LENGTH) {
+            size_t n = len < remaining ? len : (size_t)remaining;
+            remaining -= n;
+            consumed += n;
+            decoded_size += n;
+            if (decoded != nullptr) {
+                decoded->append(data, n);
+            }
+            return n;
+        }
+        if (mode != CHUNKED) {
+            return 0;
+        }
+
+        size_t pos = 0;
+        while (pos < len && state != FINISHED && !error) {
+            char c = data[pos];
+            switch (state) {
+                case CHUNK_SIZE:
+                    // hex digits, then maybe whitespace and ";ext", then "\r\n".
+                    // no whitespace before or inside the digits ("1 2"), and no empty size line,
+                    // another parser could read them as a different size.
+                    if (c == '\n') {
+                        if (size_digits == 0) {
+                            error = true;
+                        } else {
+                            state = chunk_size == 0 ? TRAILER : CHUNK_DATA;
+                        }
+                        in_extension = false;
+                        size_ended = false;
+                        size_digits = 0;
+                    } else if (in_extension) {
+                        // the extension is not used, it is passed through.
+                    } else if (isxdigit((unsigned char)c) && !size_ended) {
+                        chunk_size = chunk_size * 16 + HexValue(c);
+                        size_digits++;
+                        if (chunk_size > MAX_CHUNK_SIZE) {
+                            error = true;
+                        }
+                    } else if (size_digits == 0) {
+                        error = true;
+                    } else if (c == ';') {
+                        in_extension = true;
+                    } else if (c == ' ' || c == '\t' || c == '\r') {
+                        size_ended = true;
+                    } else {
+                        error = true;
+                    }
+                    pos++;
+                    break;
+                case CHUNK_DATA: {
+                    size_t n = len - pos < chunk_size ? len - pos : (size_t)chunk_size;
+                    if (decoded != nullptr) {
+                        decoded->append(data + pos, n);
+                    }
+                    chunk_size -= n;
+                    decoded_size += n;
+                    pos += n;
+                    if (chunk_size == 0) {
+                        state = CHUNK_DATA_END;
+                    }
+                    break;
+                }
+                case CHUNK_DATA_END:
+                    // "\r\n" after the chunk data
+                    if (c == '\n') {
+                        state = CHUNK_SIZE;
+                    } else if (c != '\r') {
+                        error = true;
+                    }
+                    pos++;
+                    break;
+                case TRAILER:
+                    // trailer lines, an empty line ends the body
+                    if (c == '\n') {
+                        if (trailer_line_len == 0) {
+                            state = FINISHED;
+                        }
+                        trailer_line_len = 0;
+                    } else if (c != '\r') {
+                        trailer_line_len++;
+                    }
+                    pos++;
+                    break;
+                default:
+                    break;
+            }
+        }
+        consumed += pos;
+        return pos;
+    }
+
+    bool HasError() {
+        return error;
+    }
+
+private:
+    enum ChunkState {
+        CHUNK_SIZE,
+        CHUNK_DATA,
+        CHUNK_DATA_END,
+        TRAILER,
+        FINISHED
+    };
+
+    static constexpr unsigned long long MAX_CHUNK_SIZE = 1ULL << 40;
+
+    Mode mode = NONE;
+    unsigned long long remaining = 0;
+    unsigned long long consumed = 0;
+    unsigned long long decoded_size = 0;
+
+    ChunkState state = CHUNK_SIZE;
+    unsigned long long chunk_size = 0;
+    bool in_extension = false;
+    size_t size_digits = 0; // the hex digits of the current size line
+    bool size_ended = false; // whitespace after the digits, no more digits may follow
+    size_t trailer_line_len = 0;
+    bool error = false;
+
+    static int HexValue(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        return c - 'A' + 10;
+    }
+};
+
+#endif // BODY_FRAMER_H
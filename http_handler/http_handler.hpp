@@ -1,6 +1,15 @@
+#ifndef HTTP_HANDLER_H
+#define HTTP_HANDLER_H
+
 #include <string>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
 #include <sstream>
 #include <regex>
+#include <vector>
+
+#include "body_framer.hpp"
 
 class HttpHandler {
 public:
@@ -15,13 +24,14 @@ public:
         std::string tmp;
         iss >> tmp;
 
-        // Maybe some bugs in furture, because there could be more http types method!!!!
-        if (tmp == "GET" || tmp == "POST") {
-            ParseRequest(msg);
-            handler_type = "request";
-        } else if (tmp.find("HTTP") != std::string::npos) {
+        // a response starts with the http version, a request starts with the method.
+        // the method can be any token (GET, POST, PUT, DELETE, PATCH, OPTIONS, ...).
+        if (tmp.find("HTTP") != std::string::npos) {
             ParseResponse(msg);
             handler_type = "response";
+        } else if (IsMethod(tmp)) {
+            ParseRequest(msg);
+            handler_type = "request";
         }
     }
 
@@ -57,6 +67,23 @@ public:
         return content_type;
     }
 
+    std::string& GetTransferEncoding() {
+        return transfer_encoding;
+    }
+
+    std::string& GetExpect() {
+        return expect;
+    }
+
+    std::string& GetAcceptEncoding() {
+        return accept_encoding;
+    }
+
+    // "" if the body is not encoded.
+    std::string& GetContentEncoding() {
+        return content_encoding;
+    }
+
     std::string& GetBody() {
         // std::cout << "-----------------\n";
         // std::cout << body;
@@ -76,6 +103,13 @@ public:
         return http_connection;
     }
 
+    // the request has both Transfer-Encoding and Content-Length, or several different Content-Length,
+    // or a Content-Length which is not a number, or a Transfer-Encoding without chunked as its only and
+    // final coding: where its body ends is ambiguous, it must be rejected.
+    bool HasFramingError() {
+        return framing_error;
+    }
+
     int& GetPort() {
         return port;
     }
@@ -84,7 +118,10 @@ public:
         if (handler_type == "request") {
             std::string tmp_str = method + " " + path + " " + http_version;
             msg = ReplaceFirstLine(msg, tmp_str);
-            msg = ReplaceField(msg, "Host", host);
+            msg = ReplaceField(msg, "Host", port == 80 ? host : host + ":" + std::to_string(port));
+            if (!accept_encoding.empty()) {
+                msg = AddField(RemoveField(msg, "Accept-Encoding"), "Accept-Encoding", accept_encoding);
+            }
             return msg;
         } else {
             return "";
@@ -107,6 +144,44 @@ public:
         msg = ori_msg;
     }
 
+    // remove a header field (case insensitive) from the headers ending with "\r\n\r\n".
+    static std::string RemoveField(const std::string& headers, const std::string& field_name) {
+        std::string result;
+        size_t pos = 0, line_end;
+        while ((line_end = headers.find("\r\n", pos)) != std::string::npos) {
+            if (!(line_end - pos > field_name.size() && headers[pos + field_name.size()] == ':' &&
+                  strncasecmp(headers.c_str() + pos, field_name.c_str(), field_name.size()) == 0)) {
+                result.append(headers, pos, line_end + 2 - pos);
+            }
+            pos = line_end + 2;
+        }
+        return result;
+    }
+
+    // the value of a header field (case insensitive) in the headers, "" if not found.
+    // the values of a repeated field are joined with ", ", as if they were sent in one line.
+    static std::string GetField(const std::string& headers, const std::string& field_name) {
+        std::string result;
+        size_t pos = headers.find("\r\n"), line_end;
+        while (pos != std::string::npos && (line_end = headers.find("\r\n", pos + 2)) != std::string::npos) {
+            pos += 2;
+            std::string line = headers.substr(pos, line_end - pos);
+            if (IsField(line, field_name.c_str())) {
+                std::string value = FieldValue(line);
+                result += result.empty() || value.empty() ? value : ", " + value;
+            }
+            pos = line_end;
+        }
+        return result;
+    }
+
+    // add a header field at the end of the headers ending with "\r\n\r\n".
+    static std::string AddField(const std::string& headers, const std::string& field_name, const std::string& value) {
+        std::string result = headers;
+        result.insert(result.size() - 2, field_name + ": " + value + "\r\n");
+        return result;
+    }
+
 private:
     // original msg
     std::string ori_msg;
@@ -120,17 +195,53 @@ private:
     std::string host;
     std::string path;
     std::string method;
+    std::string expect;
+    std::string accept_encoding;
 
     // Response
     std::string status_code;
     std::string status_phrase;
     std::string content_length;
     std::string content_type;
+    std::string transfer_encoding;
+    std::string content_encoding;
     std::string body;
-    bool is_encoding;
 
     std::string handler_type;
     int port;
+    bool framing_error = false;
+
+    static bool IsMethod(const std::string& token) {
+        if (token.empty()) {
+            return false;
+        }
+        for (char c : token) {
+            if (c < 'A' || c > 'Z') {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // the line is the header field "name: ...", the name is case insensitive.
+    static bool IsField(const std::string& line, const char* name) {
+        size_t len = strlen(name);
+        return line.size() > len && line[len] == ':' && strncasecmp(line.c_str(), name, len) == 0;
+    }
+
+    // the whole value of "Field: value\r", it may contain spaces, such as "gzip, deflate".
+    static std::string FieldValue(const std::string& line) {
+        size_t begin = line.find(':');
+        if (begin == std::string::npos) {
+            return "";
+        }
+        begin = line.find_first_not_of(" \t", begin + 1);
+        size_t end = line.find_last_not_of(" \t\r");
+        if (begin == std::string::npos || end == std::string::npos || end < begin) {
+            return "";
+        }
+        return line.substr(begin, end - begin + 1);
+    }
 
     std::string ReplaceFirstLine(const std::string& msg, const std::string& new_first_line) {
         size_t pos = msg.find("\r\n");
@@ -160,16 +271,49 @@ private:
 
         // Get the host
         while (std::getline(iss, line)) {
-            if (line.find("Host:") != std::string::npos) {
+            if (IsField(line, "Host")) {
                 std::istringstream iss_host(line);
                 std::string host_line;
                 iss_host >> host_line >> host;
-            } else if (line.find("Content-Type:") != std::string::npos) {
+                // Host: example.com:8080
+                size_t colon_pos = host.rfind(':');
+                size_t bracket_pos = host.find(']'); // [::1]:8080
+                if (colon_pos != std::string::npos && (bracket_pos == std::string::npos || colon_pos > bracket_pos)) {
+                    port = std::atoi(host.c_str() + colon_pos + 1);
+                    host.erase(colon_pos);
+                }
+            } else if (IsField(line, "Content-Type")) {
                 std::istringstream iss_line(line);
                 iss_line >> tmp >> content_type;
-                return; // If there has more fields need to be find ,remove return.
-            } 
-        } 
+            } else if (IsField(line, "Content-Length")) {
+                // the length and the encoding tell where the request body ends,
+                // the server must see the same end as the proxy (no request smuggling).
+                std::string value = FieldValue(line);
+                if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos ||
+                    (!content_length.empty() && value != content_length)) {
+                    framing_error = true;
+                }
+                content_length = value;
+            } else if (IsField(line, "Transfer-Encoding")) {
+                // several lines are one list, "Transfer-Encoding: gzip" and "Transfer-Encoding: chunked".
+                transfer_encoding += (transfer_encoding.empty() ? "" : ", ") + FieldValue(line);
+            } else if (IsField(line, "Expect")) {
+                std::istringstream iss_line(line);
+                iss_line >> tmp >> expect;
+            } else if (IsField(line, "Accept-Encoding")) {
+                accept_encoding = FieldValue(line);
+            } else if (line == "\r" || line.empty()) {
+                break; // end of the headers
+            }
+        }
+        if (!transfer_encoding.empty() && !content_length.empty()) {
+            framing_error = true;
+        }
+        // a request body is only framed by chunked, any other coding leaves its end unknown.
+        std::vector<std::string> codings = BodyFramer::Codings(transfer_encoding);
+        if (!codings.empty() && !BodyFramer::ChunkedFinal(codings)) {
+            framing_error = true;
+        }
     }
 
     void ParseResponse(std::string msg) {
@@ -184,15 +328,21 @@ private:
 
        // Get the body
        while (std::getline(iss, line)) {
-            if (line.find("Connection:") != std::string::npos) {
+            if (IsField(line, "Connection")) {
                 std::istringstream iss_line(line);
                 iss_line >> tmp >> http_connection;
-            } else if (line.find("Content-Endcoding") != std::string::npos) {
-                is_encoding = true;
-            } else if (line.find("Content-Length:") != std::string::npos) {
+            } else if (IsField(line, "Content-Encoding")) {
+                // the body has to be decoded before it can be rewritten.
+                content_encoding = FieldValue(line);
+                if (strcasecmp(content_encoding.c_str(), "identity") == 0) {
+                    content_encoding.clear();
+                }
+            } else if (IsField(line, "Transfer-Encoding")) {
+                transfer_encoding += (transfer_encoding.empty() ? "" : ", ") + FieldValue(line);
+            } else if (IsField(line, "Content-Length")) {
                 std::istringstream iss_line(line);
                 iss_line >> tmp >> content_length;
-            } else if (line.find("Content-Type:") != std::string::npos) {
+            } else if (IsField(line, "Content-Type")) {
                 std::istringstream iss_line(line);
                 iss_line >> tmp >> content_type;
             } else if (line.find("<html>") != std::string::npos) {
@@ -218,3 +368,4 @@ private:
     }
 };
 
+#endif // HTTP_HANDLER_H
@@ -0,0 +1,390 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <atomic>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Logger is an asynchronous logger for the request path.
+// Every thread writes its messages into its own ring buffer (single producer, single consumer),
+// so logging never takes a lock and never touches the terminal on the hot path.
+// A background flusher thread drains all the rings and writes them out in one batch.
+//
+// There are two levels:
+// 1. compile-time level: LOG_COMPILE_LEVEL, anything below it is compiled out.
+// 2. runtime level: Logger::instance().setLevel(), or the PROXY_LOG_LEVEL environment variable.
+//    (DEBUG, INFO, WARN, ERROR, OFF)
+//
+// Access log lines (one per response) go through the same pipeline.
+
+enum class LogLevel : uint8_t {
+    DEBUG = 0,
+    INFO = 1,
+    WARN = 2,
+    ERROR = 3,
+    OFF = 4,
+    ACCESS = 5 // only used internally to tag the access log lines.
+};
+
+// 0: DEBUG, 1: INFO, 2: WARN, 3: ERROR
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL 0
+#endif
+
+// a log message longer than this will be truncated.
+constexpr size_t LOG_SLOT_SIZE = 256;
+// must be a power of 2.
+constexpr size_t LOG_RING_SLOTS = 256;
+// how long the flusher sleeps when there is nothing to do.
+constexpr int LOG_FLUSH_INTERVAL_MS = 20;
+// repeated messages of one call site allowed per second by the *_LIMITED macros.
+constexpr uint32_t LOG_RATE_LIMIT_PER_SEC = 10;
+
+namespace LoggerUtils {
+    struct Slot {
+        int64_t timestamp_ns;
+        LogLevel level;
+        uint16_t len;
+        char text[LOG_SLOT_SIZE];
+    };
+
+    // Ring is a lock-free single producer single consumer ring buffer.
+    // The producer is the thread who owns it, the consumer is the flusher.
+    // If the ring is full, the message is dropped and counted, the producer never waits.
+    class Ring {
+    public:
+        std::array<Slot, LOG_RING_SLOTS> slots;
+        std::atomic<size_t> head{0}; // next slot to write, only moved by the producer.
+        std::atomic<size_t> tail{0}; // next slot to read, only moved by the consumer.
+        std::atomic<uint64_t> dropped{0};
+        std::atomic<bool> retired{false}; // the owner thread has exited.
+
+        // get a free slot, or nullptr if the ring is full.
+        Slot* reserve() {
+            size_t h = head.load(std::memory_order_relaxed);
+            if (h - tail.load(std::memory_order_acquire) >= LOG_RING_SLOTS) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return nullptr;
+            }
+            return &slots[h & (LOG_RING_SLOTS - 1)];
+        }
+
+        // publish the slot returned by reserve().
+        void commit() {
+            head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+        bool empty() {
+            return head.load(std::memory_order_acquire) == tail.load(std::memory_order_relaxed);
+        }
+    };
+
+    // RateLimiter is used by one call site to limit the repeated errors.
+    // It allows LOG_RATE_LIMIT_PER_SEC messages per second, and counts the suppressed ones.
+    // The counting is racy on purpose, an exact number is not worth a lock here.
+    struct RateLimiter {
+        std::atomic<int64_t> window_start{0};
+        std::atomic<uint32_t> count{0};
+        std::atomic<uint32_t> suppressed{0};
+
+        // return true if the message should be logged.
+        // suppressed_before is set to the number of messages suppressed in the last window.
+        bool allow(uint32_t& suppressed_before) {
+            int64_t now = std::chrono::duration_cast<std::chrono::seconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+            suppressed_before = 0;
+            int64_t start = window_start.load(std::memory_order_relaxed);
+            if (now != start && window_start.compare_exchange_strong(start, now)) {
+                count.store(0, std::memory_order_relaxed);
+                suppressed_before = suppressed.exchange(0, std::memory_order_relaxed);
+            }
+            if (count.fetch_add(1, std::memory_order_relaxed) < LOG_RATE_LIMIT_PER_SEC) {
+                return true;
+            }
+            suppressed.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+    };
+}
+
+class Logger {
+private:
+    std::atomic<LogLevel> level_{LogLevel::INFO};
+    std::atomic<bool> access_log_{true};
+    FILE* output_ = stderr;
+
+    // all the rings, the flusher walks them.
+    // the mutex only protects the vector, it is taken when a thread logs for the first time.
+    std::mutex rings_mutex_;
+    std::vector<std::shared_ptr<LoggerUtils::Ring>> rings_;
+    // drained rings of exited threads, reused by new threads.
+    std::vector<std::shared_ptr<LoggerUtils::Ring>> free_rings_;
+
+    // only one drain at a time, the flusher and flush() may race at exit.
+    std::mutex drain_mutex_;
+    std::mutex flush_mutex_;
+    std::condition_variable flush_cond_;
+    std::atomic<bool> flush_requested_{false};
+
+    // holds the ring of the current thread, mark it retired when the thread exits.
+    struct LocalRing {
+        std::shared_ptr<LoggerUtils::Ring> ring;
+        ~LocalRing() {
+            if (ring) {
+                ring->retired.store(true, std::memory_order_release);
+            }
+        }
+    };
+
+    Logger() {
+        const char* env_level = std::getenv("PROXY_LOG_LEVEL");
+        if (env_level != nullptr) {
+            level_ = ParseLevel(env_level);
+        }
+        std::thread(&Logger::flusher, this).detach();
+    }
+
+    LoggerUtils::Ring* localRing() {
+        thread_local LocalRing local_ring;
+        if (!local_ring.ring) {
+            std::lock_guard<std::mutex> lock_guard_(rings_mutex_);
+            if (!free_rings_.empty()) {
+                local_ring.ring = free_rings_.back();
+                free_rings_.pop_back();
+                local_ring.ring->retired = false;
+            } else {
+                local_ring.ring = std::make_shared<LoggerUtils::Ring>();
+            }
+            rings_.push_back(local_ring.ring);
+        }
+        return local_ring.ring.get();
+    }
+
+    static int64_t nowNs() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    static const char* LevelName(LogLevel level) {
+        switch (level) {
+            case LogLevel::DEBUG: return "DEBUG";
+            case LogLevel::INFO: return "INFO";
+            case LogLevel::WARN: return "WARN";
+            case LogLevel::ERROR: return "ERROR";
+            case LogLevel::ACCESS: return "ACCESS";
+            default: return "";
+        }
+    }
+
+    static LogLevel ParseLevel(const std::string& name) {
+        if (name == "DEBUG") return LogLevel::DEBUG;
+        if (name == "WARN") return LogLevel::WARN;
+        if (name == "ERROR") return LogLevel::ERROR;
+        if (name == "OFF") return LogLevel::OFF;
+        return LogLevel::INFO;
+    }
+
+    // format the text into a slot of the current thread's ring.
+    void write(LogLevel level, const char* fmt, va_list args) {
+        LoggerUtils::Ring* ring = localRing();
+        LoggerUtils::Slot* slot = ring->reserve();
+        if (slot == nullptr) {
+            return;
+        }
+        slot->timestamp_ns = nowNs();
+        slot->level = level;
+        int len = vsnprintf(slot->text, sizeof(slot->text), fmt, args);
+        if (len < 0) {
+            len = 0;
+        } else if (len >= (int)sizeof(slot->text)) {
+            // truncated, mark it.
+            len = sizeof(slot->text) - 1;
+            memcpy(slot->text + len - 3, "...", 3);
+        }
+        slot->len = (uint16_t)len;
+        ring->commit();
+        if (level >= LogLevel::ERROR && level != LogLevel::ACCESS) {
+            // dont let the errors wait for the next tick.
+            flush_requested_.store(true, std::memory_order_relaxed);
+            flush_cond_.notify_one();
+        }
+    }
+
+    // drain all the rings into one buffer, and write it out with one call.
+    void drain() {
+        std::lock_guard<std::mutex> drain_lock_(drain_mutex_);
+        std::vector<std::shared_ptr<LoggerUtils::Ring>> rings;
+        {
+            std::lock_guard<std::mutex> lock_guard_(rings_mutex_);
+            rings = rings_;
+        }
+
+        std::string batch;
+        char prefix[64];
+        for (auto& ring : rings) {
+            size_t head = ring->head.load(std::memory_order_acquire);
+            size_t tail = ring->tail.load(std::memory_order_relaxed);
+            for (; tail != head; ++tail) {
+                LoggerUtils::Slot& slot = ring->slots[tail & (LOG_RING_SLOTS - 1)];
+                time_t seconds = (time_t)(slot.timestamp_ns / 1000000000);
+                int millis = (int)((slot.timestamp_ns / 1000000) % 1000);
+                struct tm tm_time;
+                localtime_r(&seconds, &tm_time);
+                size_t n = strftime(prefix, sizeof(prefix), "%Y-%m-%d %H:%M:%S", &tm_time);
+                snprintf(prefix + n, sizeof(prefix) - n, ".%03d %-6s ", millis, LevelName(slot.level));
+                batch += prefix;
+                batch.append(slot.text, slot.len);
+                batch += '\n';
+            }
+            ring->tail.store(tail, std::memory_order_release);
+
+            uint64_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+            if (dropped > 0) {
+                batch += "[Logger]: dropped " + std::to_string(dropped) + " messages, the ring buffer was full.\n";
+            }
+        }
+
+        if (!batch.empty()) {
+            fwrite(batch.data(), 1, batch.size(), output_);
+            fflush(output_);
+        }
+
+        // recycle the rings of exited threads.
+        std::lock_guard<std::mutex> lock_guard_(rings_mutex_);
+        for (size_t i = 0; i < rings_.size();) {
+            if (rings_[i]->retired.load(std::memory_order_acquire) && rings_[i]->empty()) {
+                free_rings_.push_back(rings_[i]);
+                rings_[i] = rings_.back();
+                rings_.pop_back();
+            } else {
+                ++i;
+            }
+        }
+    }
+
+    void flusher() {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock_(flush_mutex_);
+                flush_cond_.wait_for(lock_, std::chrono::milliseconds(LOG_FLUSH_INTERVAL_MS),
+                                     [this] { return flush_requested_.load(std::memory_order_relaxed); });
+                flush_requested_ = false;
+            }
+            drain();
+        }
+    }
+
+public:
+    Logger(const Logger&) = delete;
+    Logger& operator= (const Logger&) = delete;
+
+    // The logger is never destroyed, because the detached threads may still log during exit.
+    // The messages left in the rings are written out by atexit.
+    static Logger& instance() {
+        static Logger* logger = [] {
+            Logger* tmp_logger = new Logger();
+            std::atexit([] { Logger::instance().flush(); });
+            return tmp_logger;
+        }();
+        return *logger;
+    }
+
+    void setLevel(LogLevel level) {
+        level_.store(level, std::memory_order_relaxed);
+    }
+
+    void setLevel(const std::string& name) {
+        setLevel(ParseLevel(name));
+    }
+
+    void setAccessLog(bool enabled) {
+        access_log_.store(enabled, std::memory_order_relaxed);
+    }
+
+    // set the output file before logging anything, default is stderr.
+    void setOutput(FILE* output) {
+        output_ = output;
+    }
+
+    bool enabled(LogLevel level) {
+        return level >= level_.load(std::memory_order_relaxed);
+    }
+
+    __attribute__((format(printf, 3, 4)))
+    void log(LogLevel level, const char* fmt, ...) {
+        va_list args;
+        va_start(args, fmt);
+        write(level, fmt, args);
+        va_end(args);
+    }
+
+    // write one access log line.
+    // upstream_ms: from sending the request to the whole response is received.
+    // total_ms: from sending the request to the response is sent to the client.
+    void access(int client_socket, const std::string& method, const std::string& host, const std::string& path,
+                const std::string& status, size_t bytes, double upstream_ms, double total_ms) {
+        if (!access_log_.load(std::memory_order_relaxed)) {
+            return;
+        }
+        log(LogLevel::ACCESS, "client=%d host=%s \"%s %s\" status=%s bytes=%zu upstream_ms=%.3f total_ms=%.3f",
+            client_socket, host.c_str(), method.c_str(), path.c_str(), status.c_str(), bytes, upstream_ms, total_ms);
+    }
+
+    // write out everything in the rings right now.
+    void flush() {
+        drain();
+    }
+};
+
+// a plain "level >= LOG_COMPILE_LEVEL" in the macros warns (-Wtype-limits) at every call site
+// when LOG_COMPILE_LEVEL is 0.
+constexpr bool LogCompiled(int level) {
+    return level >= LOG_COMPILE_LEVEL;
+}
+
+#define PROXY_LOG(level, ...)                                                   \
+    do {                                                                        \
+        if (LogCompiled(static_cast<int>(level)) &&                             \
+            Logger::instance().enabled(level)) {                                \
+            Logger::instance().log(level, __VA_ARGS__);                         \
+        }                                                                       \
+    } while (0)
+
+// same as PROXY_LOG, but every call site is limited to LOG_RATE_LIMIT_PER_SEC messages per second.
+#define PROXY_LOG_LIMITED(level, ...)                                           \
+    do {                                                                        \
+        if (LogCompiled(static_cast<int>(level)) &&                             \
+            Logger::instance().enabled(level)) {                                \
+            static LoggerUtils::RateLimiter rate_limiter_;                      \
+            uint32_t suppressed_ = 0;                                           \
+            bool allowed_ = rate_limiter_.allow(suppressed_);                   \
+            if (suppressed_ > 0) {                                              \
+                Logger::instance().log(level, "[Logger]: suppressed %u repeated messages from %s:%d", \
+                                       suppressed_, __FILE__, __LINE__);        \
+            }                                                                   \
+            if (allowed_) {                                                     \
+                Logger::instance().log(level, __VA_ARGS__);                     \
+            }                                                                   \
+        }                                                                       \
+    } while (0)
+
+#define LOG_DEBUG(...) PROXY_LOG(LogLevel::DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) PROXY_LOG(LogLevel::INFO, __VA_ARGS__)
+#define LOG_WARN(...) PROXY_LOG(LogLevel::WARN, __VA_ARGS__)
+#define LOG_ERROR(...) PROXY_LOG(LogLevel::ERROR, __VA_ARGS__)
+#define LOG_WARN_LIMITED(...) PROXY_LOG_LIMITED(LogLevel::WARN, __VA_ARGS__)
+#define LOG_ERROR_LIMITED(...) PROXY_LOG_LIMITED(LogLevel::ERROR, __VA_ARGS__)
+
+#endif // LOGGER_H
@@ -0,0 +1,333 @@
+#ifndef PREFETCHER_H
+#define PREFETCHER_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <strings.h>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "link_extractor.hpp"
+#include "../cache/Response_cache.hpp"
+#include "../client_proxy/connection_pool.hpp"
+#include "../dns/Dns_cache.hpp"
+#include "../http_handler/http_handler.hpp"
+#include "../http_handler/body_framer.hpp"
+#include "../logger/Logger.hpp"
+
+// the budget of the prefetcher, so it never takes the place of the real requests:
+// a few worker threads, a few connections per host, a bounded queue and a bounded number of links per page.
+constexpr size_t PREFETCH_WORKERS = 4;
+constexpr size_t PREFETCH_MAX_PER_HOST = 2;
+constexpr size_t PREFETCH_MAX_PER_PAGE = 32;
+constexpr size_t PREFETCH_MAX_QUEUE = 256;
+// how long a prefetched response is kept for the browser, it asks for it within a second or so.
+// never longer than the response is fresh, this is also its freshness if it gives none.
+constexpr int PREFETCH_TTL_SEC = 30;
+constexpr int PREFETCH_TIMEOUT_SEC = 5;
+// how long a request waits for the prefetch of its url which is in flight, instead of fetching it again.
+constexpr int PREFETCH_WAIT_MS = 1000;
+// log the counters every this many prefetches.
+constexpr uint64_t PREFETCH_STATS_INTERVAL = 100;
+
+namespace PrefetchUtils {
+    struct Stats {
+        std::atomic<uint64_t> queued{0};
+        std::atomic<uint64_t> dropped{0};   // the queue was full
+        std::atomic<uint64_t> fetched{0};
+        std::atomic<uint64_t> failed{0};
+        std::atomic<uint64_t> stored{0};    // put into the ResponseCache
+        std::atomic<uint64_t> waited{0};    // a request waited for a prefetch in flight
+    };
+
+    struct Task {
+        Link link;
+        std::string key;
+    };
+}
+
+// Prefetcher fetches the sub-resources of the html pages (found by LinkExtractor) into the ResponseCache,
+// before the browser asks for them. On the way it warms the DnsCache, and leaves its connections
+// in the ConnectionPool for the real requests.
+// It is off unless PROXY_PREFETCH=1.
+//
+// The hit rate is ResponseCache prefetch_used / stored, and the prefetches which were never used
+// are counted in ResponseCache prefetch_wasted.
+class Prefetcher {
+private:
+    bool enabled_ = false;
+    PrefetchUtils::Stats stats;
+
+    std::mutex mutex_;
+    std::condition_variable task_cond;
+    std::condition_variable done_cond;
+    std::deque<PrefetchUtils::Task> tasks;
+    // the keys which are queued or in flight.
+    std::unordered_set<std::string> pending_keys;
+    std::unordered_map<std::string, size_t> host_inflight;
+
+    Prefetcher() {
+        const char* env = std::getenv("PROXY_PREFETCH");
+        enabled_ = env != nullptr && std::string(env) == "1";
+        if (!enabled_) {
+            return;
+        }
+        for (size_t i = 0; i < PREFETCH_WORKERS; i++) {
+            std::thread(&Prefetcher::run, this).detach();
+        }
+    }
+
+    static std::string HostKey(const PrefetchUtils::Link& link) {
+        return link.host + ":" + std::to_string(link.port);
+    }
+
+    // the first task whose host has room for one more prefetch, or tasks.end().
+    std::deque<PrefetchUtils::Task>::iterator NextTask() {
+        for (auto it = tasks.begin(); it != tasks.end(); ++it) {
+            if (host_inflight[HostKey(it->link)] < PREFETCH_MAX_PER_HOST) {
+                return it;
+            }
+        }
+        return tasks.end();
+    }
+
+    void run() {
+        while (true) {
+            PrefetchUtils::Task task;
+            {
+                std::unique_lock<std::mutex> lock_(mutex_);
+                task_cond.wait(lock_, [this] { return NextTask() != tasks.end(); });
+                auto it = NextTask();
+                task = *it;
+                tasks.erase(it);
+                host_inflight[HostKey(task.link)]++;
+            }
+            bool ok = fetch(task);
+            {
+                std::lock_guard<std::mutex> lock_guard_(mutex_);
+                host_inflight[HostKey(task.link)]--;
+                pending_keys.erase(task.key);
+            }
+            // a host has room again, and someone may be waiting for this key.
+            task_cond.notify_all();
+            done_cond.notify_all();
+
+            if (!ok) {
+                stats.failed++;
+            } else if (++stats.fetched % PREFETCH_STATS_INTERVAL == 0) {
+                LogStats();
+            }
+        }
+    }
+
+    static int connectTo(const PrefetchUtils::Link& link) {
+        int sockfd = ConnectionPool::instance().Take(link.host, link.port);
+        if (sockfd != -1) {
+            return sockfd;
+        }
+        sockaddr_in server_addr;
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(link.port);
+        if (!DnsCache::instance().Resolve(link.host, server_addr.sin_addr)) {
+            return -1;
+        }
+        sockfd = socket(AF_INET, SOCK_STREAM, 0);
+        if (sockfd < 0) {
+            return -1;
+        }
+        int opt = 1;
+        setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        // SO_SNDTIMEO also limits connect().
+        struct timeval timeout;
+        timeout.tv_sec = PREFETCH_TIMEOUT_SEC;
+        timeout.tv_usec = 0;
+        setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        if (connect(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+            close(sockfd);
+            return -1;
+        }
+        return sockfd;
+    }
+
+    bool fetch(const PrefetchUtils::Task& task) {
+        const PrefetchUtils::Link& link = task.link;
+        int sockfd = connectTo(link);
+        if (sockfd == -1) {
+            LOG_DEBUG("[Prefetcher]: Failed to connect to %s:%d", link.host.c_str(), link.port);
+            return false;
+        }
+        struct timeval timeout;
+        timeout.tv_sec = PREFETCH_TIMEOUT_SEC;
+        timeout.tv_usec = 0;
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        // identity, the cached response can be sent to any client.
+        std::string request = "GET " + ResponseCache::OriginForm(link.path) + " HTTP/1.1\r\n"
+                              "Host: " + (link.port == 80 ? link.host : link.host + ":" + std::to_string(link.port)) + "\r\n"
+                              "Accept: */*\r\n"
+                              "Accept-Encoding: identity\r\n"
+                              "Connection: keep-alive\r\n\r\n";
+        if (send(sockfd, request.data(), request.size(), MSG_NOSIGNAL) != (ssize_t)request.size()) {
+            close(sockfd);
+            return false;
+        }
+
+        char buffer[16384];
+        std::string recv_msg;
+        size_t head_end;
+        while ((head_end = recv_msg.find("\r\n\r\n")) == std::string::npos) {
+            ssize_t bytes_received = recv(sockfd, buffer, sizeof(buffer), 0);
+            if (bytes_received <= 0 || recv_msg.size() > CACHE_MAX_ENTRY_BYTES) {
+                close(sockfd);
+                return false;
+            }
+            recv_msg.append(buffer, bytes_received);
+        }
+        head_end += 4;
+        std::string headers = recv_msg.substr(0, head_end);
+        recv_msg.erase(0, head_end);
+        HttpHandler response_handler;
+        response_handler.SetHttpHandler(headers);
+        BodyFramer body_framer(response_handler.GetTransferEncoding(), response_handler.GetContentLength());
+        bool close_delimited = body_framer.GetMode() == BodyFramer::NONE;
+
+        std::string body;
+        bool closed = false;
+        while (close_delimited ? !closed : !body_framer.Done()) {
+            if (recv_msg.empty()) {
+                ssize_t bytes_received = recv(sockfd, buffer, sizeof(buffer), 0);
+                if (bytes_received <= 0) {
+                    closed = true;
+                    if (!close_delimited) {
+                        close(sockfd);
+                        return false;
+                    }
+                    break;
+                }
+                recv_msg.append(buffer, bytes_received);
+            }
+            if (close_delimited) {
+                body += recv_msg;
+                recv_msg.clear();
+            } else {
+                recv_msg.erase(0, body_framer.Consume(recv_msg.data(), recv_msg.size(), &body));
+            }
+            if (body_framer.HasError() || body.size() > CACHE_MAX_ENTRY_BYTES) {
+                // too large to cache, dont read the rest of it.
+                close(sockfd);
+                return false;
+            }
+        }
+
+        // the connection is warm, give it to the next request to this host.
+        std::string& connection = response_handler.GetHttpConnection();
+        if (closed || !recv_msg.empty() || strcasecmp(connection.c_str(), "close") == 0 ||
+            response_handler.GetHttpVersion() != "HTTP/1.1") {
+            close(sockfd);
+        } else {
+            timeout.tv_sec = 0;
+            setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            ConnectionPool::instance().Put(link.host, link.port, sockfd);
+        }
+
+        // the html would have to be rewritten, leave it to the real request.
+        // a response which is stale already (max-age=0, an Expires in the past) would never be used.
+        int ttl_sec = std::min(PREFETCH_TTL_SEC, ResponseCache::MaxAge(headers, PREFETCH_TTL_SEC));
+        if (!ResponseCache::IsCacheable(headers) || ttl_sec <= 0 ||
+            response_handler.GetContentType().find("text/html") != std::string::npos) {
+            return true;
+        }
+        std::string response = headers;
+        response = HttpHandler::RemoveField(response, "Content-Length");
+        response = HttpHandler::RemoveField(response, "Transfer-Encoding");
+        response = HttpHandler::RemoveField(response, "Connection");
+        response = HttpHandler::RemoveField(response, "Keep-Alive");
+        response = HttpHandler::AddField(response, "Content-Length", std::to_string(body.size()));
+        ResponseCache::instance().Put(task.key, response + body, ttl_sec, true);
+        stats.stored++;
+        return true;
+    }
+
+public:
+    Prefetcher(const Prefetcher&) = delete;
+    Prefetcher& operator=(const Prefetcher&) = delete;
+
+    static Prefetcher& instance() {
+        // never destroyed, the workers may still be running at exit.
+        static Prefetcher* prefetcher = new Prefetcher();
+        return *prefetcher;
+    }
+
+    bool enabled() {
+        return enabled_;
+    }
+
+    // queue a link, key is its ResponseCache key.
+    // it is skipped if it is cached, or queued already, or the queue is full.
+    void Submit(const PrefetchUtils::Link& link, const std::string& key) {
+        if (!enabled_ || ResponseCache::instance().Contains(key)) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock_guard_(mutex_);
+            if (pending_keys.count(key) != 0) {
+                return;
+            }
+            if (tasks.size() >= PREFETCH_MAX_QUEUE) {
+                stats.dropped++;
+                return;
+            }
+            tasks.push_back({link, key});
+            pending_keys.insert(key);
+        }
+        stats.queued++;
+        task_cond.notify_one();
+    }
+
+    // if key is being prefetched, wait until it is done (at most timeout_ms).
+    // return false at once if it is not.
+    bool WaitFor(const std::string& key, int timeout_ms) {
+        std::unique_lock<std::mutex> lock_(mutex_);
+        if (pending_keys.count(key) == 0) {
+            return false;
+        }
+        stats.waited++;
+        return done_cond.wait_for(lock_, std::chrono::milliseconds(timeout_ms),
+                                  [&] { return pending_keys.count(key) == 0; });
+    }
+
+    PrefetchUtils::Stats& GetStats() {
+        return stats;
+    }
+
+    void LogStats() {
+        ResponseCacheUtils::Stats& cache_stats = ResponseCache::instance().GetStats();
+        uint64_t stored = stats.stored.load();
+        uint64_t used = cache_stats.prefetch_used.load();
+        LOG_INFO("[Prefetcher]: queued=%llu dropped=%llu fetched=%llu failed=%llu stored=%llu used=%llu wasted=%llu "
+                 "waited=%llu hit_rate=%.1f%%",
+                 (unsigned long long)stats.queued.load(), (unsigned long long)stats.dropped.load(),
+                 (unsigned long long)stats.fetched.load(), (unsigned long long)stats.failed.load(),
+                 (unsigned long long)stored, (unsigned long long)used,
+                 (unsigned long long)cache_stats.prefetch_wasted.load(), (unsigned long long)stats.waited.load(),
+                 stored == 0 ? 0.0 : 100.0 * used / stored);
+    }
+};
+
+#endif // PREFETCHER_H
@@ -0,0 +1,218 @@
+#ifndef LINK_EXTRACTOR_H
+#define LINK_EXTRACTOR_H
+
+#include <cctype>
+#include <cstdlib>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace PrefetchUtils {
+    // a sub-resource of a page, the path is in origin form ("/a/b.png?x=1").
+    struct Link {
+        std::string host;
+        int port;
+        std::string path;
+    };
+}
+
+// LinkExtractor finds the sub-resources of a html page which the browser will fetch right after it:
+// <img src>, <script src> and <link rel=stylesheet href>.
+// It is fed by the html pass of BodyPipeline, every piece ends at the end of a tag,
+// so a tag is never cut in half. Only the http links are returned, the relative ones are resolved
+// against the page url.
+class LinkExtractor {
+public:
+    LinkExtractor(const std::string& host, int port, const std::string& page_path, size_t max_links)
+        : host{host}, port{port}, max_links{max_links} {
+        // the directory of the page, for the relative links.
+        std::string path = page_path.substr(0, page_path.find_first_of("?#"));
+        size_t slash_pos = path.rfind('/');
+        base_dir = slash_pos == std::string::npos ? "/" : path.substr(0, slash_pos + 1);
+    }
+
+    void Scan(const std::string& html) {
+        size_t pos = 0;
+        while (found < max_links && (pos = html.find('<', pos)) != std::string::npos) {
+            size_t tag_end = html.find('>', pos);
+            if (tag_end == std::string::npos) {
+                return;
+            }
+            size_t name_end = pos + 1;
+            while (name_end < tag_end && isalpha((unsigned char)html[name_end])) {
+                name_end++;
+            }
+            std::string name = Lower(html.substr(pos + 1, name_end - pos - 1));
+            std::string url;
+            if (name == "img" || name == "script") {
+                url = Attribute(html, name_end, tag_end, "src");
+            } else if (name == "link") {
+                std::string rel = " " + Lower(Attribute(html, name_end, tag_end, "rel")) + " ";
+                if (rel.find(" stylesheet ") != std::string::npos) {
+                    url = Attribute(html, name_end, tag_end, "href");
+                }
+            }
+            if (!url.empty()) {
+                Add(url);
+            }
+            pos = tag_end + 1;
+        }
+    }
+
+    // the links found since the last call.
+    std::vector<PrefetchUtils::Link> Take() {
+        std::vector<PrefetchUtils::Link> result;
+        result.swap(links);
+        return result;
+    }
+
+private:
+    std::string host;
+    int port;
+    size_t max_links;
+    std::string base_dir;
+    size_t found = 0;
+    std::vector<PrefetchUtils::Link> links;
+    std::unordered_set<std::string> seen;
+
+    static std::string Lower(std::string s) {
+        for (auto& c : s) {
+            c = tolower(c);
+        }
+        return s;
+    }
+
+    // the value of an attribute in html[begin, end), "" if not found.
+    static std::string Attribute(const std::string& html, size_t begin, size_t end, const std::string& attribute) {
+        size_t pos = begin;
+        while (pos < end) {
+            while (pos < end && (isspace((unsigned char)html[pos]) || html[pos] == '/')) {
+                pos++;
+            }
+            size_t name_begin = pos;
+            while (pos < end && html[pos] != '=' && !isspace((unsigned char)html[pos]) && html[pos] != '/') {
+                pos++;
+            }
+            std::string name = Lower(html.substr(name_begin, pos - name_begin));
+            while (pos < end && isspace((unsigned char)html[pos])) {
+                pos++;
+            }
+            std::string value;
+            if (pos < end && html[pos] == '=') {
+                pos++;
+                while (pos < end && isspace((unsigned char)html[pos])) {
+                    pos++;
+                }
+                if (pos < end && (html[pos] == '"' || html[pos] == '\'')) {
+                    char quote = html[pos++];
+                    size_t value_end = html.find(quote, pos);
+                    if (value_end == std::string::npos || value_end > end) {
+                        value_end = end;
+                    }
+                    value = html.substr(pos, value_end - pos);
+                    pos = value_end + 1;
+                } else {
+                    size_t value_begin = pos;
+                    while (pos < end && !isspace((unsigned char)html[pos])) {
+                        pos++;
+                    }
+                    value = html.substr(value_begin, pos - value_begin);
+                }
+            }
+            if (name == attribute) {
+                return value;
+            }
+            if (name.empty()) {
+                pos++;
+            }
+        }
+        return "";
+    }
+
+    // "/a/./b/../c" -> "/a/c"
+    static std::string RemoveDotSegments(const std::string& path) {
+        std::vector<std::string> segments;
+        size_t pos = 1;
+        while (pos <= path.size()) {
+            size_t next = path.find('/', pos);
+            if (next == std::string::npos) {
+                next = path.size();
+            }
+            std::string segment = path.substr(pos, next - pos);
+            if (segment == "..") {
+                if (!segments.empty()) {
+                    segments.pop_back();
+                }
+                if (next == path.size()) {
+                    segments.push_back("");
+                }
+            } else if (segment == ".") {
+                if (next == path.size()) {
+                    segments.push_back("");
+                }
+            } else {
+                segments.push_back(segment);
+            }
+            pos = next + 1;
+        }
+        std::string result;
+        for (auto& segment : segments) {
+            result += "/" + segment;
+        }
+        return result.empty() ? "/" : result;
+    }
+
+    void Add(std::string url) {
+        // "&amp;" is the only entity which is common in urls.
+        size_t amp_pos;
+        while ((amp_pos = url.find("&amp;")) != std::string::npos) {
+            url.replace(amp_pos, 5, "&");
+        }
+        url = url.substr(0, url.find('#'));
+        size_t first = url.find_first_not_of(" \t\r\n");
+        if (first == std::string::npos) {
+            return;
+        }
+        url = url.substr(first, url.find_last_not_of(" \t\r\n") - first + 1);
+
+        PrefetchUtils::Link link{host, port, ""};
+        if (url.compare(0, 2, "//") == 0) {
+            url = "http:" + url;
+        }
+        size_t colon_pos = url.find(':');
+        size_t slash_pos = url.find('/');
+        if (colon_pos != std::string::npos && (slash_pos == std::string::npos || colon_pos < slash_pos)) {
+            // a scheme, only http can be prefetched (https goes through a tunnel, data: has nothing to fetch).
+            if (Lower(url.substr(0, 7)) != "http://") {
+                return;
+            }
+            size_t path_pos = url.find('/', 7);
+            std::string authority = url.substr(7, path_pos == std::string::npos ? std::string::npos : path_pos - 7);
+            link.path = path_pos == std::string::npos ? "/" : url.substr(path_pos);
+            link.port = 80;
+            size_t port_pos = authority.rfind(':');
+            if (port_pos != std::string::npos) {
+                link.port = std::atoi(authority.c_str() + port_pos + 1);
+                authority.erase(port_pos);
+            }
+            link.host = Lower(authority);
+        } else if (url[0] == '/') {
+            link.path = url;
+        } else {
+            link.path = base_dir + url;
+        }
+        if (link.host.empty() || link.port <= 0) {
+            return;
+        }
+        size_t query_pos = link.path.find('?');
+        link.path = RemoveDotSegments(link.path.substr(0, query_pos)) +
+                    (query_pos == std::string::npos ? "" : link.path.substr(query_pos));
+
+        if (seen.insert(link.host + ":" + std::to_string(link.port) + link.path).second) {
+            links.push_back(link);
+            found++;
+        }
+    }
+};
+
+#endif // LINK_EXTRACTOR_H
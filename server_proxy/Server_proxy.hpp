@@ -1,15 +1,24 @@
+#ifndef SERVER_PROXY_H
+#define SERVER_PROXY_H
+
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <iostream>
 #include <string>
 #include <thread>
 #include <map>
+#include <atomic>
 
 #include "../blocking_queue/Blocking_queue.hpp"
 #include "../client_proxy/client_proxy.hpp"
+#include "../logger/Logger.hpp"
+#include "../trace/Trace.hpp"
+#include "../tunnel/Tunnel.hpp"
+#include "../admission/Admission_control.hpp"
 
 namespace ServerProxyUtils {
     std::atomic<bool> running(true);
@@ -24,8 +33,6 @@ private:
     int port;
     std::string host;
 
-    std::mutex socket_mutex;
-
     std::string ParseRequest(std::string msg) {
         // Parse the msg
         std::istringstream iss(msg);
@@ -58,7 +65,7 @@ public:
         SOCKET_OPTION_FAILED = 7
     };
 
-    ServerProxy(std::string host = "127.0.0.1", int port = 27777) : port{port}, host{host}, server_socket{-1} {};
+    ServerProxy(std::string host = "127.0.0.1", int port = 27777) : server_socket{-1}, port{port}, host{host} {};
     
     StatusCode start() {
         ServerProxyUtils::running = true;
@@ -70,7 +77,7 @@ public:
 
         int opt = 1;
         if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-            std::cerr << "Failed to set SO_REUSEADDR" << std::endl;
+            LOG_ERROR("[ServerProxy]: Failed to set SO_REUSEADDR");
             close(server_socket);
             return StatusCode::SOCKET_CREATION_FAILED;
         }
@@ -79,7 +86,7 @@ public:
         timeout.tv_sec = TIMEOUT*10;
         timeout.tv_usec = 0;
         if (setsockopt(server_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
-            std::cerr << "Error setting socket options: " << strerror(errno) << std::endl;
+            LOG_ERROR("[ServerProxy]: Error setting socket options: %s", strerror(errno));
             close(server_socket);
             return StatusCode::SOCKET_CREATION_FAILED;
         }
@@ -103,6 +110,9 @@ public:
             return StatusCode::LISTEN_FAILED;
         }
 
+        // the other nodes of the cluster may ask this one before any client does.
+        Cluster::instance();
+
         return StatusCode::SUCCESS;
     }
 
@@ -127,16 +137,30 @@ public:
             timeout.tv_sec = TIMEOUT * 10;
             timeout.tv_usec = 0;
             if (setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
-                std::cerr << "Failed to set receive timeout: " << strerror(errno) << std::endl;
+                LOG_ERROR("[ServerProxy]: Failed to set receive timeout: %s", strerror(errno));
                 close(client_socket);
                 return StatusCode::SOCKET_OPTION_FAILED;
             }
             if (setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0) {
-                std::cerr << "Failed to set send timeout: " << strerror(errno) << std::endl;
+                LOG_ERROR("[ServerProxy]: Failed to set send timeout: %s", strerror(errno));
                 close(client_socket);
                 return StatusCode::SOCKET_OPTION_FAILED;
             }
 
+            // a response may be sent in several pieces, dont let Nagle hold the last small one.
+            int opt = 1;
+            setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+            // too many connections from this ip, shed it before it costs a thread.
+            // nothing has been sent to this client yet, the 503 can go out right now.
+            AdmissionUtils::Reason reason = AdmissionControl::instance().AdmitConnection(client_socket, client_addr.sin_addr.s_addr);
+            if (reason != AdmissionUtils::ADMITTED) {
+                std::string response = shed_response(reason, "Connection: close\r\n");
+                send(client_socket, response.data(), response.size(), MSG_NOSIGNAL);
+                close(client_socket);
+                continue;
+            }
+
             // start a new thread to handle the client request.
             // it will parse the request, and send the request to the server.
             // and get the response from the server, and push the response to the BQ.
@@ -153,7 +177,30 @@ public:
     void handle_response() {
         while (ServerProxyUtils::running) {
             ClientProxyUtils::Node res_node = SharedBlockingQueue::blocking_que.pop();
-            ssize_t byte_sent = send(res_node.client_socket, res_node.res.c_str(), res_node.res.size(), 0);
+            AdmissionControl::instance().Dequeued(res_node.res.size());
+            // the client has gone, and the socket may belong to another client already.
+            // releaseClient waits for send_lock_, the socket cannot be closed while it is held.
+            auto connection = ClientProxy::clientConnection(res_node.client_socket, res_node.connection_id);
+            std::unique_lock<std::mutex> send_lock_;
+            if (connection != nullptr) {
+                send_lock_ = std::unique_lock<std::mutex>(connection->send_mutex);
+            }
+            if (connection == nullptr || connection->released) {
+                LOG_DEBUG("[ServerProxy]: Socket%d The client has gone, the response is dropped.", res_node.client_socket);
+                if (res_node.sent != nullptr) {
+                    res_node.sent->set_value(false);
+                }
+                continue;
+            }
+            // the request is not in flight anymore, even if the client cannot get it.
+            // before send(), the client may send its next request as soon as it has the response.
+            if (res_node.last && !res_node.request.method.empty() && res_node.admitted) {
+                AdmissionControl::instance().FinishRequest(res_node.client_socket);
+            }
+            ssize_t byte_sent = send(res_node.client_socket, res_node.res.c_str(), res_node.res.size(), MSG_NOSIGNAL);
+            if (res_node.sent != nullptr) {
+                res_node.sent->set_value(byte_sent == (ssize_t)res_node.res.size());
+            }
             // Debug
             // std::cout << "[Send_Response]: \n"
             //           << "Socket" << res_node.client_socket << '\n'
@@ -161,12 +208,32 @@ public:
             //           << res_node.res.substr(0, 512)
             //           << std::endl;
             if (byte_sent == -1) {
-                std::cerr << "[ServerProxy]: " << "Socket" << res_node.client_socket 
-                          << " Failed to send response" << std::endl;
-                // handle the error, close the socket. 
-                close(res_node.client_socket);
-                return;
+                LOG_ERROR_LIMITED("[ServerProxy]: Socket%d Failed to send response: %s",
+                                  res_node.client_socket, strerror(errno));
+                // the client has gone, handle_client will close the socket.
+                // dont return here, the other clients are still waiting for their responses.
+                continue;
+            }
+
+            // the response cannot be finished, closing the connection is the only way to tell the client.
+            // handle_client will see it and release the client.
+            if (res_node.close_client) {
+                shutdown(res_node.client_socket, SHUT_RDWR);
+            }
+            send_lock_ = std::unique_lock<std::mutex>();
+
+            // the interim responses (1xx) dont finish a request, and the first pieces of a response neither,
+            // nothing to log. a tunnel is logged by the TunnelEngine when it ends.
+            if (!res_node.last || res_node.request.method.empty() ||
+                (res_node.request.method == "CONNECT" && res_node.status_code == "200")) {
+                continue;
             }
+            auto now = std::chrono::steady_clock::now();
+            auto sent_at = res_node.request.sent_at;
+            Logger::instance().access(res_node.client_socket, res_node.request.method, res_node.host,
+                                      res_node.request.path, res_node.status_code, res_node.sent_before + byte_sent,
+                                      std::chrono::duration<double, std::milli>(res_node.recv_done - sent_at).count(),
+                                      std::chrono::duration<double, std::milli>(now - sent_at).count());
         }
     }
 
@@ -177,20 +244,22 @@ public:
         int bytes_received;
         std::string recv_msg;
         std::string::size_type pos;
+        // the responses are addressed to this connection, not only to the socket, until releaseClient().
+        ClientProxy::openClient(client_socket);
+        // the id of this connection in the trace, 0 if the capture is disabled.
+        uint64_t trace_connection_id = Tracer::instance().NewConnection();
 
+        // no lock here, every thread only reads its own client socket.
         while (true) {
-            std::lock_guard<std::mutex> lock_guard_(socket_mutex);
             bytes_received = recv(client_socket, buffer, sizeof(buffer), 0);
             if (bytes_received <= 0) {
                 if (bytes_received == 0) {
-                    std::cerr << "[ServerProxy]: " << "Socket" << client_socket 
-                              << " Connection closed." << std::endl
-                              << strerror(errno) << std::endl;
+                    LOG_DEBUG("[ServerProxy]: Socket%d Connection closed.", client_socket);
                 } else {
-                    std::cerr << "[ServerProxy]: " << "Scoket" << client_socket
-                              << " Failed to receive data." << std::endl
-                              << strerror(errno) << std::endl;
+                    LOG_WARN_LIMITED("[ServerProxy]: Socket%d Failed to receive data. %s", client_socket, strerror(errno));
                 }
+                ClientProxy::releaseClient(client_socket);
+                AdmissionControl::instance().ReleaseConnection(client_socket);
                 close(client_socket);
                 return;
             }
@@ -207,12 +276,260 @@ public:
                 // std::cout << "[Receive socket"<< client_socket << "]: "
                 //           << complete_request.substr(0, 512)
                 //           << std::endl;
+                // shed before any work is done for the request.
+                AdmissionUtils::Reason reason = AdmissionControl::instance().AdmitRequest(client_socket);
+                if (reason != AdmissionUtils::ADMITTED) {
+                    if (shed_request(client_socket, complete_request, reason)) {
+                        continue;
+                    }
+                    // the body has not been read, handle_response closes the connection after the 503.
+                    drain_and_close(client_socket);
+                    return;
+                }
+                if (reject_ambiguous_body(client_socket, complete_request)) {
+                    drain_and_close(client_socket);
+                    return;
+                }
+                if (complete_request.compare(0, 8, "CONNECT ") == 0) {
+                    if (handle_connect(client_socket, complete_request, recv_msg)) {
+                        // the connection is a tunnel now, the TunnelEngine owns the client socket.
+                        return;
+                    }
+                    continue;
+                }
+                if (serve_from_cache(client_socket, complete_request)) {
+                    continue;
+                }
                 ClientProxy client_proxy(complete_request, client_socket);
+                HttpHandler& request_handler = client_proxy.request_handler;
+                // where the request body (if any) ends.
+                BodyFramer body_framer(request_handler.GetTransferEncoding(), request_handler.GetContentLength());
+                if (trace_connection_id != 0) {
+                    client_proxy.trace_id = Tracer::instance().CaptureRequest(trace_connection_id, request_handler.GetMethod(),
+                                                                              request_handler.GetHost(), request_handler.GetPort(),
+                                                                              request_handler.GetPath(), complete_request,
+                                                                              body_framer.GetContentLength());
+                }
+                // send the headers first, with "Expect: 100-continue" the client waits for
+                // the "100 Continue" from the server before sending the body.
                 client_proxy.run();
+
+                bool trace_body = client_proxy.trace_id != 0 && !body_framer.Done();
+                std::string body;
+                if (!forward_body(client_socket, client_proxy, body_framer, recv_msg,
+                                  trace_body && Tracer::instance().captureBodies() ? &body : nullptr)) {
+                    ClientProxy::releaseClient(client_socket);
+                    AdmissionControl::instance().ReleaseConnection(client_socket);
+                    close(client_socket);
+                    return;
+                }
+                if (trace_body) {
+                    Tracer::instance().CaptureRequestBody(client_proxy.trace_id, body_framer.GetDecodedSize(), body);
+                }
             }
         }
     }
 
+    // "CONNECT host:port", open a tunnel to host:port (HTTPS through the proxy).
+    // return true if the client socket is not ours anymore (handed over to the TunnelEngine, or closed).
+    // otherwise the client gets an error response, and may send the next request.
+    bool handle_connect(int client_socket, const std::string& complete_request, std::string& recv_msg) {
+        HttpHandler request_handler;
+        request_handler.SetHttpHandler(complete_request, 443);
+        // the target is "host:port", not a url.
+        std::string target = request_handler.GetPath();
+        std::string host = target;
+        int port = 443;
+        size_t colon_pos = target.rfind(':');
+        size_t bracket_pos = target.find(']'); // [::1]:443
+        if (colon_pos != std::string::npos && (bracket_pos == std::string::npos || colon_pos > bracket_pos)) {
+            host = target.substr(0, colon_pos);
+            port = std::atoi(target.c_str() + colon_pos + 1);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        ClientProxyUtils::PendingRequest request{"CONNECT", target, start, 0, ""};
+        if (port > 0 && !TunnelUtils::PortAllowed(port)) {
+            LOG_WARN_LIMITED("[ServerProxy]: Socket%d CONNECT to %s is not allowed, the port is not in PROXY_CONNECT_PORTS.",
+                             client_socket, target.c_str());
+            SharedBlockingQueue::push((ClientProxyUtils::Node){client_socket, ClientProxy::connectionId(client_socket),
+                                                               ClientProxyUtils::ErrorResponse("403 Forbidden"),
+                                                               host, "403", request, std::chrono::steady_clock::now()});
+            return false;
+        }
+        int server_socket = host.empty() || port <= 0 ? -1 : TunnelUtils::Connect(host, port);
+        double connect_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (server_socket == -1) {
+            // through the BQ, the responses of the previous requests may not have been sent yet.
+            SharedBlockingQueue::push((ClientProxyUtils::Node){client_socket, ClientProxy::connectionId(client_socket),
+                                                                           ClientProxyUtils::ErrorResponse("502 Bad Gateway"),
+                                                                           host, "502", request, std::chrono::steady_clock::now()});
+            return false;
+        }
+
+        // the requests pipelined before the CONNECT get their responses first: wait for them to be pushed,
+        // then the "200" goes through the BQ behind them, and the tunnel starts once it has been sent.
+        // the client sends nothing through the tunnel before the "200", but the bytes it has sent
+        // after the CONNECT request (if any) go to the server first.
+        ClientProxy::waitIdle(client_socket);
+        auto sent = std::make_shared<std::promise<bool>>();
+        std::future<bool> sent_future = sent->get_future();
+        SharedBlockingQueue::push((ClientProxyUtils::Node){client_socket, ClientProxy::connectionId(client_socket),
+                                                           "HTTP/1.1 200 Connection Established\r\n\r\n",
+                                                           host, "200", request, std::chrono::steady_clock::now(),
+                                                           true, 0, false, true, sent});
+        if (!sent_future.get() ||
+            (!recv_msg.empty() && send(server_socket, recv_msg.data(), recv_msg.size(), MSG_NOSIGNAL) != (ssize_t)recv_msg.size())) {
+            LOG_WARN_LIMITED("[ServerProxy]: Socket%d Failed to start the tunnel to %s: %s", client_socket, target.c_str(), strerror(errno));
+            close(server_socket);
+            ClientProxy::releaseClient(client_socket);
+            AdmissionControl::instance().ReleaseConnection(client_socket);
+            close(client_socket);
+            return true;
+        }
+        recv_msg.clear();
+
+        // the client will never send a http request on this connection again.
+        ClientProxy::releaseClient(client_socket);
+        // the TunnelEngine releases the connection in the AdmissionControl when the tunnel ends.
+        if (!TunnelEngine::instance().Add(client_socket, server_socket, host, port, connect_ms)) {
+            close(server_socket);
+            AdmissionControl::instance().ReleaseConnection(client_socket);
+            close(client_socket);
+        }
+        return true;
+    }
+
+    static std::string shed_response(AdmissionUtils::Reason reason, const std::string& extra_headers = "") {
+        return ClientProxyUtils::ErrorResponse("503 Service Unavailable",
+                                               "Retry-After: " + std::to_string(AdmissionControl::instance().RetryAfter(reason)) +
+                                                   "\r\n" + extra_headers);
+    }
+
+    // answer a request which has not been admitted with "503 Service Unavailable".
+    // it goes through the BQ after the responses of the previous requests, so they are not overtaken.
+    // return false if the request has a body, which is not read: the connection is closed after the 503.
+    bool shed_request(int client_socket, const std::string& complete_request, AdmissionUtils::Reason reason) {
+        HttpHandler request_handler;
+        request_handler.SetHttpHandler(complete_request, 80);
+        bool has_body = request_handler.HasFramingError() ||
+                        !BodyFramer(request_handler.GetTransferEncoding(), request_handler.GetContentLength()).Done();
+        ClientProxy::waitIdle(client_socket);
+        ClientProxyUtils::PendingRequest request{request_handler.GetMethod(), request_handler.GetPath(),
+                                                 std::chrono::steady_clock::now(), 0, ""};
+        SharedBlockingQueue::push((ClientProxyUtils::Node){client_socket, ClientProxy::connectionId(client_socket),
+                                                           shed_response(reason, has_body ? "Connection: close\r\n" : ""),
+                                                           request_handler.GetHost(), "503", request,
+                                                           std::chrono::steady_clock::now(), true, 0, has_body, false});
+        return !has_body;
+    }
+
+    // answer a request whose body cannot be framed without doubt (Transfer-Encoding with Content-Length,
+    // or different Content-Length) with "400 Bad Request", the server might see another end of the body.
+    // the bytes after the headers cannot be trusted, the connection is closed after the 400.
+    // return false if the request is fine.
+    bool reject_ambiguous_body(int client_socket, const std::string& complete_request) {
+        HttpHandler request_handler;
+        request_handler.SetHttpHandler(complete_request, 80);
+        if (!request_handler.HasFramingError()) {
+            return false;
+        }
+        LOG_WARN_LIMITED("[ServerProxy]: Socket%d Ambiguous request body framing, rejected.", client_socket);
+        ClientProxy::waitIdle(client_socket);
+        ClientProxyUtils::PendingRequest request{request_handler.GetMethod(), request_handler.GetPath(),
+                                                 std::chrono::steady_clock::now(), 0, ""};
+        SharedBlockingQueue::push((ClientProxyUtils::Node){client_socket, ClientProxy::connectionId(client_socket),
+                                                           ClientProxyUtils::ErrorResponse("400 Bad Request", "Connection: close\r\n"),
+                                                           request_handler.GetHost(), "400", request,
+                                                           std::chrono::steady_clock::now(), true, 0, true});
+        return true;
+    }
+
+    // the client has sent bytes which are not read (a request body), handle_response shuts the connection down
+    // after the error response, read until then and close it.
+    void drain_and_close(int client_socket) {
+        char buffer[MAX_LEN];
+        while (recv(client_socket, buffer, sizeof(buffer), 0) > 0) {
+        }
+        ClientProxy::releaseClient(client_socket);
+        AdmissionControl::instance().ReleaseConnection(client_socket);
+        close(client_socket);
+    }
+
+    // a GET which the Prefetcher has fetched (or is fetching right now), or which is cached by this node
+    // or by its owner in the cluster, is answered from the ResponseCache, it never goes to the server.
+    // return false if the request has to go to the server.
+    bool serve_from_cache(int client_socket, const std::string& complete_request) {
+        bool prefetch = Prefetcher::instance().enabled();
+        bool cluster = Cluster::instance().enabled();
+        if ((!prefetch && !cluster) || !ResponseCache::IsCacheableRequest(complete_request) ||
+            !ClientProxy::clientIdle(client_socket)) {
+            return false;
+        }
+        HttpHandler request_handler;
+        request_handler.SetHttpHandler(complete_request, 80);
+        if (!BodyFramer(request_handler.GetTransferEncoding(), request_handler.GetContentLength()).Done()) {
+            return false;
+        }
+        // the same url as the one the server would get, and the one the Prefetcher has fetched.
+        std::string host = request_handler.GetHost();
+        std::string path = request_handler.GetPath();
+        ClientProxy::mix_url(host, path);
+        std::string key = ResponseCache::Key(host, request_handler.GetPort(), path);
+
+        auto start = std::chrono::steady_clock::now();
+        if (prefetch) {
+            Prefetcher::instance().WaitFor(key, PREFETCH_WAIT_MS);
+        }
+        std::string response;
+        bool public_only = ResponseCache::HasCookie(complete_request);
+        if (!ResponseCache::instance().Get(key, response, nullptr, public_only) &&
+            !(cluster && Cluster::instance().Fetch(key, response) && (!public_only || ResponseCache::IsPublic(response)))) {
+            return false;
+        }
+        ClientProxyUtils::PendingRequest request{"GET", path, start, 0, ""};
+        SharedBlockingQueue::push((ClientProxyUtils::Node){client_socket, ClientProxy::connectionId(client_socket),
+                                                           std::move(response), host, "200",
+                                                                       request, std::chrono::steady_clock::now()});
+        return true;
+    }
+
+    // forward the request body from the client to the server piece by piece,
+    // so a large upload never stays in the memory as a whole.
+    // the bytes already received are in recv_msg, the bytes after the body are left in recv_msg.
+    // if trace_body is not nullptr, the first TraceUtils::MAX_BODY_SIZE bytes of the decoded body are kept in it.
+    // return false if the client connection is broken, or the body cannot be framed.
+    bool forward_body(int client_socket, ClientProxy& client_proxy, BodyFramer& body_framer, std::string& recv_msg,
+                      std::string* trace_body = nullptr) {
+        auto keep = [trace_body]() {
+            return trace_body != nullptr && trace_body->size() < TraceUtils::MAX_BODY_SIZE ? trace_body : nullptr;
+        };
+        size_t consumed = body_framer.Consume(recv_msg.data(), recv_msg.size(), keep());
+        // if the server is gone, keep reading the body anyway, the next request starts after it.
+        client_proxy.sendBody(recv_msg.data(), consumed);
+        recv_msg.erase(0, consumed);
+
+        char buffer[MAX_LEN];
+        while (!body_framer.Done()) {
+            if (body_framer.HasError()) {
+                LOG_WARN_LIMITED("[ServerProxy]: Socket%d Broken chunked request body.", client_socket);
+                return false;
+            }
+            int bytes_received = recv(client_socket, buffer, sizeof(buffer), 0);
+            if (bytes_received <= 0) {
+                LOG_WARN_LIMITED("[ServerProxy]: Socket%d Connection closed in the request body.", client_socket);
+                return false;
+            }
+            consumed = body_framer.Consume(buffer, bytes_received, keep());
+            client_proxy.sendBody(buffer, consumed);
+            recv_msg.append(buffer + consumed, bytes_received - consumed);
+        }
+        if (trace_body != nullptr && trace_body->size() > TraceUtils::MAX_BODY_SIZE) {
+            trace_body->resize(TraceUtils::MAX_BODY_SIZE);
+        }
+        return true;
+    }
+
     void stop() {
         ServerProxyUtils::running = false;
         if (server_socket != -1) {
@@ -225,3 +542,5 @@ public:
     }
        
 };
+
+#endif // SERVER_PROXY_H
@@ -0,0 +1,526 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <strings.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Traffic capture.
+// When PROXY_TRACE_FILE is set, the proxy records every request (in handle_client) and every response
+// (in recvResponse) into a binary trace file, which can be replayed by trace/replay_main.cpp.
+// A request with a body gets a REQUEST_BODY record once the body has been forwarded.
+// If PROXY_TRACE_BODIES=1, the bodies (the response ones before rewriting) are recorded too, up to MAX_BODY_SIZE each,
+// otherwise only their sizes are recorded.
+//
+// File format (little endian):
+//   TraceFileHeader
+//   record, record, ...
+// every record starts with TraceRecordHeader, followed by its payload:
+//   REQUEST:  u16 port, str method, str host, str url, str headers, u64 body_size
+//   RESPONSE: u32 status, u64 body_size, u64 upstream_ns, str headers, str body
+//   REQUEST_BODY: u64 body_size (decoded, without chunk framing), str body
+// str is a u32 length followed by the bytes.
+//
+// The credentials (Authorization, Proxy-Authorization, Cookie, Set-Cookie) are redacted before they are recorded,
+// and the file is only readable by its owner.
+//
+// The file is written through mmap. The header keeps the size of the valid data,
+// so the trace is still readable if the proxy is killed before it truncates the file.
+
+namespace TraceUtils {
+    constexpr char MAGIC[8] = {'P', 'X', 'T', 'R', 'A', 'C', 'E', '1'};
+    constexpr uint32_t VERSION = 1;
+    // the file grows by this size.
+    constexpr size_t GROW_SIZE = 16 * 1024 * 1024;
+
+    enum RecordType : uint8_t {
+        REQUEST = 1,
+        RESPONSE = 2,
+        REQUEST_BODY = 3
+    };
+
+    // a captured body is cut here, so a large download is never held in the memory as a whole.
+    constexpr size_t MAX_BODY_SIZE = 1024 * 1024;
+
+    // flags of the RESPONSE and REQUEST_BODY records
+    constexpr uint8_t FLAG_BODY_CAPTURED = 1;
+    constexpr uint8_t FLAG_BODY_TRUNCATED = 2; // only the first MAX_BODY_SIZE bytes of the body are in the record
+
+    struct TraceFileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t header_size;
+        uint64_t start_unix_ns;
+        uint64_t data_size; // bytes of records after the header
+        uint64_t record_count;
+    };
+
+    struct TraceRecordHeader {
+        uint8_t type;
+        uint8_t flags;
+        uint16_t reserved;
+        uint32_t size; // the whole record, including this header
+        uint64_t timestamp_ns; // since the capture started
+        uint64_t request_id;
+        uint64_t connection_id;
+    };
+
+    struct RequestRecord {
+        uint64_t timestamp_ns;
+        uint64_t request_id;
+        uint64_t connection_id;
+        uint16_t port;
+        std::string method;
+        std::string host;
+        std::string url;
+        std::string headers;
+        uint64_t body_size; // Content-Length, or the decoded size from the REQUEST_BODY record
+        bool body_captured = false;
+        bool body_truncated = false;
+        std::string body;
+    };
+
+    struct ResponseRecord {
+        uint64_t timestamp_ns;
+        uint64_t request_id;
+        uint64_t connection_id;
+        uint32_t status;
+        uint64_t body_size;
+        uint64_t upstream_ns;
+        std::string headers;
+        bool body_captured;
+        bool body_truncated;
+        std::string body;
+    };
+
+    // the header fields which are never written into a trace.
+    const std::vector<std::string> REDACTED_FIELDS = {"Authorization", "Proxy-Authorization", "Cookie", "Set-Cookie"};
+
+    // replace the values of the REDACTED_FIELDS with "[redacted]", the field names stay so the replay sees them.
+    inline std::string RedactHeaders(const std::string& headers) {
+        std::string result;
+        size_t pos = 0, line_end;
+        while ((line_end = headers.find("\r\n", pos)) != std::string::npos) {
+            size_t colon_pos = headers.find(':', pos);
+            bool redact = false;
+            if (colon_pos != std::string::npos && colon_pos < line_end) {
+                for (auto& field : REDACTED_FIELDS) {
+                    if (colon_pos - pos == field.size() && strncasecmp(headers.c_str() + pos, field.c_str(), field.size()) == 0) {
+                        redact = true;
+                        break;
+                    }
+                }
+            }
+            if (redact) {
+                result.append(headers, pos, colon_pos + 1 - pos);
+                result += " [redacted]\r\n";
+            } else {
+                result.append(headers, pos, line_end + 2 - pos);
+            }
+            pos = line_end + 2;
+        }
+        result.append(headers, pos, std::string::npos);
+        return result;
+    }
+
+    // serialize the payload of a record.
+    class RecordBuilder {
+    public:
+        std::string data;
+
+        RecordBuilder(uint8_t type, uint8_t flags, uint64_t timestamp_ns, uint64_t request_id, uint64_t connection_id) {
+            TraceRecordHeader header;
+            memset(&header, 0, sizeof(header));
+            header.type = type;
+            header.flags = flags;
+            header.timestamp_ns = timestamp_ns;
+            header.request_id = request_id;
+            header.connection_id = connection_id;
+            data.append((const char*)&header, sizeof(header));
+        }
+
+        template <typename T>
+        void Put(T value) {
+            data.append((const char*)&value, sizeof(value));
+        }
+
+        void PutString(const char* str, size_t len) {
+            Put<uint32_t>((uint32_t)len);
+            data.append(str, len);
+        }
+
+        void PutString(const std::string& str) {
+            PutString(str.data(), str.size());
+        }
+
+        // write the size into the header, return the whole record.
+        std::string& Finish() {
+            uint32_t size = (uint32_t)data.size();
+            memcpy(&data[offsetof(TraceRecordHeader, size)], &size, sizeof(size));
+            return data;
+        }
+    };
+
+    // read the payload of a record, every Get checks the bound.
+    class RecordCursor {
+    public:
+        const char* pos;
+        const char* end;
+        bool ok = true;
+
+        RecordCursor(const char* pos, const char* end) : pos{pos}, end{end} {}
+
+        template <typename T>
+        T Get() {
+            T value{};
+            if (end - pos < (ptrdiff_t)sizeof(T)) {
+                ok = false;
+                return value;
+            }
+            memcpy(&value, pos, sizeof(T));
+            pos += sizeof(T);
+            return value;
+        }
+
+        std::string GetString() {
+            uint32_t len = Get<uint32_t>();
+            if (!ok || end - pos < (ptrdiff_t)len) {
+                ok = false;
+                return "";
+            }
+            std::string str(pos, len);
+            pos += len;
+            return str;
+        }
+    };
+}
+
+// TraceWriter appends the records into a memory-mapped file.
+class TraceWriter {
+private:
+    int fd = -1;
+    char* mapped = nullptr;
+    size_t capacity = 0;
+    size_t offset = 0; // end of the valid data, including the file header
+    std::mutex mutex_;
+
+    TraceUtils::TraceFileHeader* Header() {
+        return (TraceUtils::TraceFileHeader*)mapped;
+    }
+
+    // grow the file and map it again, with the mutex held.
+    bool Grow(size_t need) {
+        size_t new_capacity = capacity;
+        while (new_capacity < need) {
+            new_capacity += TraceUtils::GROW_SIZE;
+        }
+        if (ftruncate(fd, new_capacity) != 0) {
+            return false;
+        }
+        char* new_mapped = (char*)mmap(nullptr, new_capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (new_mapped == MAP_FAILED) {
+            return false;
+        }
+        if (mapped != nullptr) {
+            munmap(mapped, capacity);
+        }
+        mapped = new_mapped;
+        capacity = new_capacity;
+        return true;
+    }
+
+public:
+    TraceWriter() = default;
+
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter& operator= (const TraceWriter&) = delete;
+
+    ~TraceWriter() {
+        Close();
+    }
+
+    bool Open(const std::string& path, uint64_t start_unix_ns) {
+        // the trace holds the urls and the headers of the clients, only the owner may read it.
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd >= 0) {
+            // an existing file keeps its mode with O_CREAT.
+            fchmod(fd, 0600);
+        }
+        if (fd < 0 || !Grow(sizeof(TraceUtils::TraceFileHeader))) {
+            return false;
+        }
+        TraceUtils::TraceFileHeader* header = Header();
+        memcpy(header->magic, TraceUtils::MAGIC, sizeof(header->magic));
+        header->version = TraceUtils::VERSION;
+        header->header_size = sizeof(TraceUtils::TraceFileHeader);
+        header->start_unix_ns = start_unix_ns;
+        header->data_size = 0;
+        header->record_count = 0;
+        offset = sizeof(TraceUtils::TraceFileHeader);
+        return true;
+    }
+
+    bool Append(const std::string& record) {
+        std::lock_guard<std::mutex> lock_guard_(mutex_);
+        if (mapped == nullptr) {
+            return false;
+        }
+        if (offset + record.size() > capacity && !Grow(offset + record.size())) {
+            return false;
+        }
+        memcpy(mapped + offset, record.data(), record.size());
+        offset += record.size();
+        // update the header last, so a reader never sees a half record.
+        Header()->data_size = offset - sizeof(TraceUtils::TraceFileHeader);
+        Header()->record_count++;
+        return true;
+    }
+
+    // cut the file to the real size.
+    void Close() {
+        std::lock_guard<std::mutex> lock_guard_(mutex_);
+        if (mapped != nullptr) {
+            msync(mapped, offset, MS_SYNC);
+            munmap(mapped, capacity);
+            mapped = nullptr;
+        }
+        if (fd >= 0) {
+            if (ftruncate(fd, offset) != 0) {
+                // the header still tells the real size, nothing else to do.
+            }
+            close(fd);
+            fd = -1;
+        }
+    }
+};
+
+// TraceReader maps a trace file read-only, and parses all the records.
+class TraceReader {
+public:
+    TraceUtils::TraceFileHeader header;
+    std::vector<TraceUtils::RequestRecord> requests;
+    std::vector<TraceUtils::ResponseRecord> responses;
+    std::string error;
+
+    bool Load(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            error = "cannot open " + path + ": " + strerror(errno);
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(header)) {
+            close(fd);
+            error = "not a trace file: " + path;
+            return false;
+        }
+        char* mapped = (char*)mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            error = std::string("mmap failed: ") + strerror(errno);
+            return false;
+        }
+
+        memcpy(&header, mapped, sizeof(header));
+        bool ok = memcmp(header.magic, TraceUtils::MAGIC, sizeof(header.magic)) == 0 &&
+                  header.version == TraceUtils::VERSION &&
+                  header.header_size + header.data_size <= (uint64_t)st.st_size;
+        if (!ok) {
+            munmap(mapped, st.st_size);
+            error = "not a trace file, or it is broken: " + path;
+            return false;
+        }
+
+        // request id -> index in requests, for the REQUEST_BODY records.
+        std::unordered_map<uint64_t, size_t> request_index;
+        const char* pos = mapped + header.header_size;
+        const char* end = pos + header.data_size;
+        while (end - pos >= (ptrdiff_t)sizeof(TraceUtils::TraceRecordHeader)) {
+            TraceUtils::TraceRecordHeader record_header;
+            memcpy(&record_header, pos, sizeof(record_header));
+            if (record_header.size < sizeof(record_header) || (ptrdiff_t)record_header.size > end - pos) {
+                break;
+            }
+            TraceUtils::RecordCursor cursor(pos + sizeof(record_header), pos + record_header.size);
+            if (record_header.type == TraceUtils::REQUEST) {
+                TraceUtils::RequestRecord request;
+                request.timestamp_ns = record_header.timestamp_ns;
+                request.request_id = record_header.request_id;
+                request.connection_id = record_header.connection_id;
+                request.port = cursor.Get<uint16_t>();
+                request.method = cursor.GetString();
+                request.host = cursor.GetString();
+                request.url = cursor.GetString();
+                request.headers = cursor.GetString();
+                request.body_size = cursor.Get<uint64_t>();
+                if (cursor.ok) {
+                    request_index[request.request_id] = requests.size();
+                    requests.push_back(std::move(request));
+                }
+            } else if (record_header.type == TraceUtils::RESPONSE) {
+                TraceUtils::ResponseRecord response;
+                response.timestamp_ns = record_header.timestamp_ns;
+                response.request_id = record_header.request_id;
+                response.connection_id = record_header.connection_id;
+                response.status = cursor.Get<uint32_t>();
+                response.body_size = cursor.Get<uint64_t>();
+                response.upstream_ns = cursor.Get<uint64_t>();
+                response.headers = cursor.GetString();
+                response.body_captured = record_header.flags & TraceUtils::FLAG_BODY_CAPTURED;
+                response.body_truncated = record_header.flags & TraceUtils::FLAG_BODY_TRUNCATED;
+                response.body = cursor.GetString();
+                if (cursor.ok) {
+                    responses.push_back(std::move(response));
+                }
+            } else if (record_header.type == TraceUtils::REQUEST_BODY) {
+                uint64_t body_size = cursor.Get<uint64_t>();
+                std::string body = cursor.GetString();
+                auto it = request_index.find(record_header.request_id);
+                if (cursor.ok && it != request_index.end()) {
+                    TraceUtils::RequestRecord& request = requests[it->second];
+                    request.body_size = body_size;
+                    request.body_captured = record_header.flags & TraceUtils::FLAG_BODY_CAPTURED;
+                    request.body_truncated = record_header.flags & TraceUtils::FLAG_BODY_TRUNCATED;
+                    request.body = std::move(body);
+                }
+            }
+            pos += record_header.size;
+        }
+        munmap(mapped, st.st_size);
+        return true;
+    }
+};
+
+// Tracer is the capture point used by the proxy.
+// It is disabled unless PROXY_TRACE_FILE is set, and then every call is just one branch.
+class Tracer {
+private:
+    bool enabled_ = false;
+    bool capture_bodies_ = false;
+    TraceWriter writer;
+    std::chrono::steady_clock::time_point start;
+    std::atomic<uint64_t> next_request_id{1};
+    std::atomic<uint64_t> next_connection_id{1};
+
+    Tracer() {
+        const char* path = std::getenv("PROXY_TRACE_FILE");
+        if (path == nullptr || path[0] == '\0') {
+            return;
+        }
+        const char* bodies = std::getenv("PROXY_TRACE_BODIES");
+        capture_bodies_ = bodies != nullptr && std::string(bodies) == "1";
+        start = std::chrono::steady_clock::now();
+        uint64_t start_unix_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        enabled_ = writer.Open(path, start_unix_ns);
+    }
+
+    uint64_t Now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    uint8_t BodyFlags(const std::string& body, uint64_t body_size) {
+        if (!capture_bodies_) {
+            return 0;
+        }
+        return TraceUtils::FLAG_BODY_CAPTURED | (body.size() < body_size ? TraceUtils::FLAG_BODY_TRUNCATED : 0);
+    }
+
+public:
+    Tracer(const Tracer&) = delete;
+    Tracer& operator= (const Tracer&) = delete;
+
+    // never destroyed, like the Logger, the file is truncated to its real size at exit.
+    static Tracer& instance() {
+        static Tracer* tracer = [] {
+            Tracer* tmp_tracer = new Tracer();
+            if (tmp_tracer->enabled_) {
+                std::atexit([] { Tracer::instance().writer.Close(); });
+            }
+            return tmp_tracer;
+        }();
+        return *tracer;
+    }
+
+    bool enabled() {
+        return enabled_;
+    }
+
+    bool captureBodies() {
+        return enabled_ && capture_bodies_;
+    }
+
+    // a new client connection, return its id (0 if disabled).
+    uint64_t NewConnection() {
+        return enabled_ ? next_connection_id++ : 0;
+    }
+
+    // record a request, return its id (0 if disabled).
+    // the id goes with the request to recvResponse, so the response can be matched.
+    uint64_t CaptureRequest(uint64_t connection_id, const std::string& method, const std::string& host, int port,
+                            const std::string& url, const std::string& headers, uint64_t body_size) {
+        if (!enabled_) {
+            return 0;
+        }
+        uint64_t request_id = next_request_id++;
+        TraceUtils::RecordBuilder builder(TraceUtils::REQUEST, 0, Now(), request_id, connection_id);
+        builder.Put<uint16_t>((uint16_t)port);
+        builder.PutString(method);
+        builder.PutString(host);
+        builder.PutString(url);
+        builder.PutString(TraceUtils::RedactHeaders(headers));
+        builder.Put<uint64_t>(body_size);
+        writer.Append(builder.Finish());
+        return request_id;
+    }
+
+    // the request body has been forwarded, body_size is its decoded size.
+    // the body is kept only if captureBodies(), a body shorter than body_size is marked truncated.
+    void CaptureRequestBody(uint64_t request_id, uint64_t body_size, const std::string& body) {
+        if (!enabled_ || request_id == 0) {
+            return;
+        }
+        TraceUtils::RecordBuilder builder(TraceUtils::REQUEST_BODY, BodyFlags(body, body_size), Now(), request_id, 0);
+        builder.Put<uint64_t>(body_size);
+        if (capture_bodies_) {
+            builder.PutString(body);
+        } else {
+            builder.PutString("", 0);
+        }
+        writer.Append(builder.Finish());
+    }
+
+    // the body is kept only if captureBodies(), otherwise pass "" with its size.
+    // a body shorter than body_size (cut at TraceUtils::MAX_BODY_SIZE) is marked truncated.
+    void CaptureResponse(uint64_t request_id, int status, const std::string& headers, uint64_t body_size,
+                         const std::string& body, uint64_t upstream_ns) {
+        if (!enabled_ || request_id == 0) {
+            return;
+        }
+        TraceUtils::RecordBuilder builder(TraceUtils::RESPONSE, BodyFlags(body, body_size), Now(), request_id, 0);
+        builder.Put<uint32_t>((uint32_t)status);
+        builder.Put<uint64_t>(body_size);
+        builder.Put<uint64_t>(upstream_ns);
+        builder.PutString(TraceUtils::RedactHeaders(headers));
+        if (capture_bodies_) {
+            builder.PutString(body);
+        } else {
+            builder.PutString("", 0);
+        }
+        writer.Append(builder.Finish());
+    }
+};
+
+#endif // TRACE_H
@@ -0,0 +1,250 @@
+// Replay a trace captured by the proxy (PROXY_TRACE_FILE=trace.bin ./server_proxy).
+// It starts a local stand-in for every origin in the trace, and re-drives the captured connections
+// against the proxy, every request is sent at its captured time.
+//
+// g++ -std=c++17 -O2 trace/replay_main.cpp -o proxy_replay -pthread -lz
+// ./proxy_replay trace.bin [options]
+//
+// options:
+//   --speed X           1 keeps the captured inter-arrival timing, 10 replays 10 times faster,
+//                       0 sends every request as soon as the previous response arrived (default 1)
+//   --proxy-port PORT   the port of the proxy (default 27779)
+//   --external          use a proxy which is already running on --proxy-port,
+//                       instead of starting one in this process
+//   --origin-port PORT  the first port of the origin stand-ins (default 19000)
+//   --access-log        keep the access log of the in-process proxy on
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../server_proxy/Server_proxy.hpp"
+#include "../benchmark/load_generator.hpp"
+#include "Trace.hpp"
+#include "replay_origin.hpp"
+
+namespace Replay {
+    struct Options {
+        double speed = 1;
+        int proxy_port = 27779;
+        bool external = false;
+        int origin_port = 19000;
+        bool access_log = false;
+    };
+
+    struct Result {
+        std::mutex mutex_;
+        std::vector<double> latencies; // us
+        std::atomic<size_t> errors{0};
+        std::atomic<size_t> bytes{0};
+    };
+
+    inline double Percentile(std::vector<double>& values, double p) {
+        if (values.empty()) {
+            return 0;
+        }
+        return values[(size_t)(p * (values.size() - 1))];
+    }
+
+    inline int ConnectProxy(int port) {
+        int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+        if (sockfd < 0) {
+            return -1;
+        }
+        int opt = 1;
+        setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        struct timeval timeout;
+        timeout.tv_sec = 10;
+        timeout.tv_usec = 0;
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        sockaddr_in proxy_addr;
+        memset(&proxy_addr, 0, sizeof(proxy_addr));
+        proxy_addr.sin_family = AF_INET;
+        proxy_addr.sin_port = htons(port);
+        inet_pton(AF_INET, "127.0.0.1", &proxy_addr.sin_addr);
+        if (connect(sockfd, (sockaddr*)&proxy_addr, sizeof(proxy_addr)) < 0) {
+            close(sockfd);
+            return -1;
+        }
+        return sockfd;
+    }
+
+    // point the captured request to the local stand-in of its origin.
+    // the body goes after the headers, the captured one, or one of the captured size;
+    // a chunked body is sent as a single chunk.
+    inline std::string RewriteRequest(const TraceUtils::RequestRecord& request, int local_port) {
+        std::string local_host = "127.0.0.1:" + std::to_string(local_port);
+        std::string headers = request.headers;
+        size_t line_end = headers.find("\r\n");
+        headers.replace(0, line_end, request.method + " http://" + local_host + ReplayUtils::PathOf(request.url) + " HTTP/1.1");
+        headers = ReplayUtils::RemoveHeader(headers.substr(0, headers.size() - 2), "Host");
+        headers.insert(headers.find("\r\n") + 2, "Host: " + local_host + "\r\n");
+        headers += "\r\n";
+
+        std::string body = request.body_captured && !request.body_truncated ? request.body
+                                                                             : std::string(request.body_size, 'x');
+        std::string transfer_encoding = ReplayUtils::HeaderValue(headers, "Transfer-Encoding");
+        if (!transfer_encoding.empty() && strcasecmp(transfer_encoding.c_str(), "identity") != 0) {
+            char chunk_size[32];
+            snprintf(chunk_size, sizeof(chunk_size), "%zx\r\n", body.size());
+            return body.empty() ? headers + "0\r\n\r\n" : headers + chunk_size + body + "\r\n0\r\n\r\n";
+        }
+        return headers + body;
+    }
+
+    // replay one client connection, the requests are sorted by time.
+    inline void ReplayConnection(const std::vector<const TraceUtils::RequestRecord*>& requests, uint64_t trace_start_ns,
+                                 std::chrono::steady_clock::time_point replay_start, const Options& options,
+                                 ReplayOrigin& origin, Result& result) {
+        int sockfd = -1;
+        std::string recv_msg;
+        std::vector<double> latencies;
+        for (auto* request : requests) {
+            if (options.speed > 0) {
+                auto offset = std::chrono::nanoseconds((int64_t)((request->timestamp_ns - trace_start_ns) / options.speed));
+                std::this_thread::sleep_until(replay_start + offset);
+            }
+            if (sockfd == -1) {
+                sockfd = ConnectProxy(options.proxy_port);
+                recv_msg.clear();
+                if (sockfd == -1) {
+                    result.errors++;
+                    continue;
+                }
+            }
+            std::string data = RewriteRequest(*request, origin.LocalPort(request->host, request->port));
+            auto start = std::chrono::steady_clock::now();
+            long response_size = -1;
+            if (send(sockfd, data.data(), data.size(), MSG_NOSIGNAL) == (ssize_t)data.size()) {
+                response_size = LoadGenerator::ReadResponse(sockfd, recv_msg);
+            }
+            auto end = std::chrono::steady_clock::now();
+            if (response_size < 0) {
+                result.errors++;
+                close(sockfd);
+                sockfd = -1;
+                continue;
+            }
+            result.bytes += response_size;
+            latencies.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+        }
+        if (sockfd != -1) {
+            close(sockfd);
+        }
+        std::lock_guard<std::mutex> lock_guard_(result.mutex_);
+        result.latencies.insert(result.latencies.end(), latencies.begin(), latencies.end());
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s trace.bin [--speed X] [--proxy-port PORT] [--external] [--origin-port PORT]\n", argv[0]);
+        return 1;
+    }
+    Replay::Options options;
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--speed" && has_value) {
+            options.speed = std::atof(argv[++i]);
+        } else if (arg == "--proxy-port" && has_value) {
+            options.proxy_port = std::atoi(argv[++i]);
+        } else if (arg == "--external") {
+            options.external = true;
+        } else if (arg == "--origin-port" && has_value) {
+            options.origin_port = std::atoi(argv[++i]);
+        } else if (arg == "--access-log") {
+            options.access_log = true;
+        } else {
+            fprintf(stderr, "unknown option: %s\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    TraceReader trace;
+    if (!trace.Load(argv[1])) {
+        fprintf(stderr, "%s\n", trace.error.c_str());
+        return 1;
+    }
+    if (trace.requests.empty()) {
+        fprintf(stderr, "no request in the trace\n");
+        return 1;
+    }
+
+    ReplayOrigin origin(trace, options.origin_port);
+    if (!origin.start()) {
+        fprintf(stderr, "failed to start the origin stand-ins from port %d: %s\n", options.origin_port, strerror(errno));
+        return 1;
+    }
+
+    Logger::instance().setAccessLog(options.access_log);
+    ServerProxy server_proxy("127.0.0.1", options.proxy_port);
+    if (!options.external) {
+        if (server_proxy.start() != ServerProxy::StatusCode::SUCCESS) {
+            fprintf(stderr, "failed to start the proxy on port %d\n", options.proxy_port);
+            return 1;
+        }
+        std::thread(&ServerProxy::run, &server_proxy).detach();
+    }
+
+    // group the requests by their client connection.
+    std::map<uint64_t, std::vector<const TraceUtils::RequestRecord*>> connections;
+    uint64_t trace_start_ns = trace.requests.front().timestamp_ns;
+    for (auto& request : trace.requests) {
+        connections[request.connection_id].push_back(&request);
+        trace_start_ns = std::min(trace_start_ns, request.timestamp_ns);
+    }
+    for (auto& connection : connections) {
+        std::sort(connection.second.begin(), connection.second.end(),
+                  [](auto* a, auto* b) { return a->timestamp_ns < b->timestamp_ns; });
+    }
+
+    printf("== replay ==\n");
+    printf("%zu requests, %zu responses, %zu connections, %zu origins, speed %.1f%s\n",
+           trace.requests.size(), trace.responses.size(), connections.size(), origin.OriginCount(),
+           options.speed, options.speed > 0 ? "x" : " (as fast as possible)");
+
+    Replay::Result result;
+    auto replay_start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (auto& connection : connections) {
+        threads.emplace_back(Replay::ReplayConnection, std::cref(connection.second), trace_start_ns, replay_start,
+                             std::cref(options), std::ref(origin), std::ref(result));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - replay_start).count();
+
+    std::vector<double> captured_upstream;
+    for (auto& response : trace.responses) {
+        captured_upstream.push_back(response.upstream_ns / 1e3);
+    }
+    std::sort(captured_upstream.begin(), captured_upstream.end());
+    std::sort(result.latencies.begin(), result.latencies.end());
+
+    printf("requests:        %zu (errors: %zu, unmatched: %zu)\n", result.latencies.size(), result.errors.load(), origin.Unmatched());
+    printf("duration:        %.3f s, %.1f req/s, %.2f MB/s\n", seconds, result.latencies.size() / seconds, result.bytes / seconds / 1e6);
+    printf("replay latency:  p50 %.1f us, p99 %.1f us, p999 %.1f us\n", Replay::Percentile(result.latencies, 0.5),
+           Replay::Percentile(result.latencies, 0.99), Replay::Percentile(result.latencies, 0.999));
+    printf("captured upstream latency: p50 %.1f us, p99 %.1f us, p999 %.1f us\n", Replay::Percentile(captured_upstream, 0.5),
+           Replay::Percentile(captured_upstream, 0.99), Replay::Percentile(captured_upstream, 0.999));
+
+    Logger::instance().flush();
+    fflush(stdout);
+    // the proxy threads are detached and blocked in accept/recv, dont wait for them.
+    std::_Exit(result.errors > 0 ? 2 : 0);
+}
@@ -0,0 +1,279 @@
+#ifndef REPLAY_ORIGIN_H
+#define REPLAY_ORIGIN_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <strings.h>
+#include <thread>
+#include <vector>
+
+#include "Trace.hpp"
+#include "../http_handler/body_framer.hpp"
+
+namespace ReplayUtils {
+    // "http://host:port/path?query" -> "/path?query", a path is returned as it is.
+    inline std::string PathOf(const std::string& url) {
+        size_t scheme_pos = url.find("://");
+        if (scheme_pos == std::string::npos) {
+            return url;
+        }
+        size_t path_pos = url.find('/', scheme_pos + 3);
+        return path_pos == std::string::npos ? "/" : url.substr(path_pos);
+    }
+
+    // find the value of a header field, case insensitive, "" if not found.
+    inline std::string HeaderValue(const std::string& headers, const std::string& field) {
+        size_t pos = 0;
+        while ((pos = headers.find("\r\n", pos)) != std::string::npos) {
+            pos += 2;
+            if (strncasecmp(headers.c_str() + pos, field.c_str(), field.size()) == 0 &&
+                headers[pos + field.size()] == ':') {
+                size_t value_pos = headers.find_first_not_of(' ', pos + field.size() + 1);
+                size_t value_end = headers.find("\r\n", pos);
+                if (value_pos == std::string::npos || value_pos > value_end) {
+                    return "";
+                }
+                return headers.substr(value_pos, value_end - value_pos);
+            }
+        }
+        return "";
+    }
+
+    inline std::string RemoveHeader(const std::string& headers, const std::string& field) {
+        std::string result;
+        size_t pos = 0, line_end;
+        while ((line_end = headers.find("\r\n", pos)) != std::string::npos) {
+            if (!(strncasecmp(headers.c_str() + pos, field.c_str(), field.size()) == 0 &&
+                  headers[pos + field.size()] == ':')) {
+                result.append(headers, pos, line_end + 2 - pos);
+            }
+            pos = line_end + 2;
+        }
+        return result;
+    }
+}
+
+// ReplayOrigin is a local stand-in for all the origin servers in a trace.
+// Every captured host gets its own local port, so the proxy opens its connections
+// the same way as it did for the real hosts.
+// A request is answered with the response captured for the same host, method and path
+// (in capture order, and round robin if it is requested more times than captured).
+// If the bodies were not captured, a body of the captured size is generated.
+class ReplayOrigin {
+public:
+    ReplayOrigin(const TraceReader& trace, int base_port = 19000) : base_port{base_port} {
+        std::map<uint64_t, const TraceUtils::ResponseRecord*> response_of;
+        for (auto& response : trace.responses) {
+            response_of[response.request_id] = &response;
+        }
+        for (auto& request : trace.requests) {
+            std::string origin_key = request.host + ":" + std::to_string(request.port);
+            if (origins_index.find(origin_key) == origins_index.end()) {
+                origins_index[origin_key] = origins.size();
+                origins.push_back(std::make_unique<Origin>());
+                origins.back()->port = base_port + (int)origins.size() - 1;
+            }
+            auto it = response_of.find(request.request_id);
+            if (it == response_of.end()) {
+                continue; // the response was never received.
+            }
+            Origin& origin = *origins[origins_index[origin_key]];
+            origin.responses[request.method + " " + ReplayUtils::PathOf(request.url)].push_back(BuildResponse(*it->second));
+        }
+    }
+
+    ~ReplayOrigin() {
+        stop();
+    }
+
+    bool start() {
+        for (auto& origin : origins) {
+            origin->server_socket = socket(AF_INET, SOCK_STREAM, 0);
+            if (origin->server_socket == -1) {
+                return false;
+            }
+            int opt = 1;
+            setsockopt(origin->server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+            sockaddr_in server_addr;
+            memset(&server_addr, 0, sizeof(server_addr));
+            server_addr.sin_family = AF_INET;
+            server_addr.sin_port = htons(origin->port);
+            inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr);
+            if (bind(origin->server_socket, (sockaddr*)&server_addr, sizeof(server_addr)) == -1 ||
+                listen(origin->server_socket, 128) == -1) {
+                return false;
+            }
+            std::thread(&ReplayOrigin::run, this, origin.get()).detach();
+        }
+        return true;
+    }
+
+    void stop() {
+        for (auto& origin : origins) {
+            if (origin->server_socket != -1) {
+                shutdown(origin->server_socket, SHUT_RDWR);
+                close(origin->server_socket);
+                origin->server_socket = -1;
+            }
+        }
+    }
+
+    // the local port standing in for host:port, -1 if the host is not in the trace.
+    int LocalPort(const std::string& host, int port) {
+        auto it = origins_index.find(host + ":" + std::to_string(port));
+        return it == origins_index.end() ? -1 : origins[it->second]->port;
+    }
+
+    size_t OriginCount() {
+        return origins.size();
+    }
+
+    size_t Served() {
+        return served.load();
+    }
+
+    size_t Unmatched() {
+        return unmatched.load();
+    }
+
+private:
+    struct CapturedResponse {
+        std::string data;
+        bool close_after; // the connection is closed after this response
+    };
+
+    struct Origin {
+        int port;
+        int server_socket = -1;
+        // "METHOD /path" -> responses
+        std::map<std::string, std::vector<CapturedResponse>> responses;
+        std::map<std::string, size_t> cursors;
+        std::mutex cursors_mutex;
+    };
+
+    int base_port;
+    std::map<std::string, size_t> origins_index;
+    std::vector<std::unique_ptr<Origin>> origins;
+    std::atomic<size_t> served{0};
+    std::atomic<size_t> unmatched{0};
+
+    static CapturedResponse BuildResponse(const TraceUtils::ResponseRecord& response) {
+        CapturedResponse captured;
+        std::string headers = response.headers;
+        std::string connection = ReplayUtils::HeaderValue(headers, "Connection");
+        bool has_length = !ReplayUtils::HeaderValue(headers, "Content-Length").empty();
+        bool chunked = !ReplayUtils::HeaderValue(headers, "Transfer-Encoding").empty();
+        captured.close_after = strcasecmp(connection.c_str(), "close") == 0 || (!has_length && !chunked);
+
+        if (response.body_captured && !response.body_truncated) {
+            captured.data = headers + response.body;
+            return captured;
+        }
+        // only the size is known, the chunked framing cannot be rebuilt, use Content-Length instead.
+        if (chunked) {
+            headers = ReplayUtils::RemoveHeader(headers, "Transfer-Encoding");
+            headers.insert(headers.size() - 2, "Content-Length: " + std::to_string(response.body_size) + "\r\n");
+            captured.close_after = strcasecmp(connection.c_str(), "close") == 0;
+        }
+        captured.data = headers + std::string(response.body_size, 'x');
+        return captured;
+    }
+
+    const CapturedResponse* Match(Origin& origin, const std::string& key) {
+        auto it = origin.responses.find(key);
+        if (it == origin.responses.end()) {
+            return nullptr;
+        }
+        size_t index;
+        {
+            std::lock_guard<std::mutex> lock_guard_(origin.cursors_mutex);
+            index = origin.cursors[key]++;
+        }
+        return &it->second[index % it->second.size()];
+    }
+
+    void run(Origin* origin) {
+        while (true) {
+            int client_socket = accept(origin->server_socket, nullptr, nullptr);
+            if (client_socket == -1) {
+                return;
+            }
+            int opt = 1;
+            setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+            std::thread(&ReplayOrigin::handle_client, this, origin, client_socket).detach();
+        }
+    }
+
+    void handle_client(Origin* origin, int client_socket) {
+        static const std::string not_found = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+        char buffer[4096];
+        std::string recv_msg;
+        std::string::size_type pos;
+        // the headers of the request whose body is being skipped.
+        std::string headers;
+        BodyFramer body_framer;
+        bool in_body = false;
+        while (true) {
+            ssize_t bytes_received = recv(client_socket, buffer, sizeof(buffer), 0);
+            if (bytes_received <= 0) {
+                break;
+            }
+            recv_msg.append(buffer, bytes_received);
+            while (true) {
+                if (!in_body) {
+                    if ((pos = recv_msg.find("\r\n\r\n")) == std::string::npos) {
+                        break;
+                    }
+                    headers = recv_msg.substr(0, pos + 4);
+                    recv_msg.erase(0, pos + 4);
+                    body_framer = BodyFramer(ReplayUtils::HeaderValue(headers, "Transfer-Encoding"),
+                                             ReplayUtils::HeaderValue(headers, "Content-Length"));
+                    in_body = true;
+                }
+                // skip the request body as it arrives, if any.
+                recv_msg.erase(0, body_framer.Consume(recv_msg.data(), recv_msg.size()));
+                if (body_framer.HasError()) {
+                    close(client_socket);
+                    return;
+                }
+                if (!body_framer.Done()) {
+                    break;
+                }
+                in_body = false;
+
+                size_t method_end = headers.find(' ');
+                size_t url_end = headers.find(' ', method_end + 1);
+                std::string method = headers.substr(0, method_end);
+                std::string url = headers.substr(method_end + 1, url_end - method_end - 1);
+                const CapturedResponse* response = Match(*origin, method + " " + ReplayUtils::PathOf(url));
+
+                const std::string& data = response != nullptr ? response->data : not_found;
+                if (response == nullptr) {
+                    unmatched++;
+                }
+                if (send(client_socket, data.data(), data.size(), MSG_NOSIGNAL) != (ssize_t)data.size()) {
+                    close(client_socket);
+                    return;
+                }
+                served++;
+                if (response != nullptr && response->close_after) {
+                    close(client_socket);
+                    return;
+                }
+            }
+        }
+        close(client_socket);
+    }
+};
+
+#endif // REPLAY_ORIGIN_H
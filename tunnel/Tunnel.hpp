@@ -0,0 +1,402 @@
+#ifndef TUNNEL_H
+#define TUNNEL_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "../logger/Logger.hpp"
+#include "../dns/Dns_cache.hpp"
+#include "../admission/Admission_control.hpp"
+
+// Tunnels of the CONNECT requests (HTTPS through the proxy).
+// After "200 Connection Established", the bytes are relayed between the client and the server as they are.
+//
+// All the tunnels are relayed by one epoll thread, with no thread per tunnel or per direction.
+// Every direction has its own pipe, the bytes are spliced socket -> pipe -> socket in the kernel,
+// they are never copied to the user space.
+// If one side shuts down its writing (half-close), the other side gets a shutdown(SHUT_WR) once
+// the pipe is drained, and the other direction keeps going until it ends too.
+// A tunnel which has had no events on either socket for the idle timeout is closed.
+
+// the capacity of a pipe (the Linux default), and the most bytes spliced in one call.
+constexpr size_t TUNNEL_PIPE_SIZE = 65536;
+constexpr int TUNNEL_MAX_EVENTS = 64;
+constexpr int TUNNEL_CONNECT_TIMEOUT_SEC = 10;
+constexpr int TUNNEL_DEFAULT_IDLE_SEC = 300;
+// how often the idle tunnels are looked for.
+constexpr int TUNNEL_SWEEP_MS = 1000;
+
+namespace TunnelUtils {
+    // the settings, from the environment variables:
+    // PROXY_CONNECT_PORTS: the ports a CONNECT may go to, "443,8443" or "*" for any, default 443
+    // PROXY_TUNNEL_IDLE_SEC: close a tunnel without any bytes for this long, 0 never, default 300
+    struct Config {
+        std::unordered_set<int> ports = {443};
+        bool any_port = false;
+        int idle_sec = TUNNEL_DEFAULT_IDLE_SEC;
+
+        Config() {
+            const char* env = std::getenv("PROXY_CONNECT_PORTS");
+            if (env != nullptr) {
+                ports.clear();
+                std::istringstream iss(env);
+                std::string port;
+                while (std::getline(iss, port, ',')) {
+                    port.erase(std::remove_if(port.begin(), port.end(), ::isspace), port.end());
+                    if (port == "*") {
+                        any_port = true;
+                    } else if (std::atoi(port.c_str()) > 0) {
+                        ports.insert(std::atoi(port.c_str()));
+                    }
+                }
+            }
+            env = std::getenv("PROXY_TUNNEL_IDLE_SEC");
+            if (env != nullptr && std::atoi(env) >= 0) {
+                idle_sec = std::atoi(env);
+            }
+        }
+    };
+
+    inline Config& GetConfig() {
+        static Config config;
+        return config;
+    }
+
+    // a CONNECT to any other port is refused, the proxy must not be a way into arbitrary services.
+    inline bool PortAllowed(int port) {
+        Config& config = GetConfig();
+        return config.any_port || config.ports.count(port) != 0;
+    }
+
+    // how a tunnel has ended.
+    enum End {
+        CLOSED = 0, // both directions have ended
+        BROKEN,     // an error on one of the sockets
+        IDLE        // no bytes for the idle timeout
+    };
+
+    inline const char* EndName(End end) {
+        switch (end) {
+            case BROKEN: return "broken";
+            case IDLE: return "idle";
+            default: return "closed";
+        }
+    }
+
+    // one direction of a tunnel, src -> pipe -> dst.
+    struct Direction {
+        int src;
+        int dst;
+        int pipe_read = -1;
+        int pipe_write = -1;
+        size_t in_pipe = 0; // the bytes in the pipe, not written to dst yet.
+        bool src_closed = false;
+        bool dst_shutdown = false;
+        uint64_t bytes = 0;
+
+        bool Done() {
+            return dst_shutdown;
+        }
+    };
+
+    struct Tunnel {
+        int client_socket;
+        int server_socket;
+        std::string host;
+        int port;
+        Direction upstream;   // client -> server
+        Direction downstream; // server -> client
+        std::chrono::steady_clock::time_point started_at;
+        double connect_ms;
+        // the last event on one of the sockets.
+        std::chrono::steady_clock::time_point active_at;
+    };
+
+    // the counters of all the tunnels.
+    struct Stats {
+        std::atomic<uint64_t> opened{0};
+        std::atomic<uint64_t> active{0};
+        std::atomic<uint64_t> bytes_upstream{0};
+        std::atomic<uint64_t> bytes_downstream{0};
+    };
+
+    // connect to host:port, return the socket, or -1.
+    // it waits at most TUNNEL_CONNECT_TIMEOUT_SEC, the client thread is blocked meanwhile.
+    inline int Connect(const std::string& host, int port) {
+        sockaddr_in server_addr;
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(port);
+        if (!DnsCache::instance().Resolve(host, server_addr.sin_addr)) {
+            LOG_WARN_LIMITED("[Tunnel]: Error resolving hostname! Host: %s", host.c_str());
+            return -1;
+        }
+        int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+        if (sockfd >= 0) {
+            // SO_SNDTIMEO also limits connect().
+            struct timeval timeout;
+            timeout.tv_sec = TUNNEL_CONNECT_TIMEOUT_SEC;
+            timeout.tv_usec = 0;
+            setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        }
+        if (sockfd < 0 || connect(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+            LOG_WARN_LIMITED("[Tunnel]: Host: %s:%d Failed to connect: %s", host.c_str(), port, strerror(errno));
+            if (sockfd >= 0) {
+                close(sockfd);
+            }
+            return -1;
+        }
+        int opt = 1;
+        setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        return sockfd;
+    }
+}
+
+class TunnelEngine {
+private:
+    int epoll_fd = -1;
+    TunnelUtils::Stats stats;
+    // all the open tunnels, for the idle timeout. added by Add(), removed by the engine thread.
+    std::mutex mutex_;
+    std::unordered_set<TunnelUtils::Tunnel*> tunnels;
+
+    TunnelEngine() {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd == -1) {
+            LOG_ERROR("[Tunnel]: Failed to create epoll: %s", strerror(errno));
+            return;
+        }
+        std::thread(&TunnelEngine::run, this).detach();
+    }
+
+    static bool SetNonBlocking(int fd) {
+        int flags = fcntl(fd, F_GETFL, 0);
+        return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+    }
+
+    static bool OpenPipe(TunnelUtils::Direction& direction) {
+        int fds[2];
+        if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+            return false;
+        }
+        direction.pipe_read = fds[0];
+        direction.pipe_write = fds[1];
+        return true;
+    }
+
+    static void ClosePipe(TunnelUtils::Direction& direction) {
+        if (direction.pipe_read != -1) {
+            close(direction.pipe_read);
+            close(direction.pipe_write);
+        }
+    }
+
+    // move as many bytes as possible in one direction, until both sockets would block.
+    // the sockets are edge triggered, so stopping before EAGAIN would lose the event.
+    // return false if the connection is broken.
+    bool pump(TunnelUtils::Direction& direction) {
+        while (!direction.Done()) {
+            bool progress = false;
+            if (!direction.src_closed && direction.in_pipe < TUNNEL_PIPE_SIZE) {
+                ssize_t n = splice(direction.src, nullptr, direction.pipe_write, nullptr,
+                                   TUNNEL_PIPE_SIZE - direction.in_pipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (n > 0) {
+                    direction.in_pipe += n;
+                    progress = true;
+                } else if (n == 0) {
+                    direction.src_closed = true;
+                    progress = true;
+                } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    return false;
+                }
+            }
+            if (direction.in_pipe > 0) {
+                ssize_t n = splice(direction.pipe_read, nullptr, direction.dst, nullptr,
+                                   direction.in_pipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (n > 0) {
+                    direction.in_pipe -= n;
+                    direction.bytes += n;
+                    progress = true;
+                } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                    return false;
+                }
+            }
+            if (direction.src_closed && direction.in_pipe == 0) {
+                // half-close: everything from src has been written, tell dst there is no more.
+                shutdown(direction.dst, SHUT_WR);
+                direction.dst_shutdown = true;
+            }
+            if (!progress) {
+                break;
+            }
+        }
+        return true;
+    }
+
+    void finish(TunnelUtils::Tunnel* tunnel, TunnelUtils::End end) {
+        {
+            std::lock_guard<std::mutex> lock_guard_(mutex_);
+            tunnels.erase(tunnel);
+        }
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, tunnel->client_socket, nullptr);
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, tunnel->server_socket, nullptr);
+        // the client connection has been counted since it was accepted.
+        AdmissionControl::instance().ReleaseConnection(tunnel->client_socket);
+        close(tunnel->client_socket);
+        close(tunnel->server_socket);
+        ClosePipe(tunnel->upstream);
+        ClosePipe(tunnel->downstream);
+
+        double duration_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - tunnel->started_at).count();
+        stats.active--;
+        stats.bytes_upstream += tunnel->upstream.bytes;
+        stats.bytes_downstream += tunnel->downstream.bytes;
+        LOG_DEBUG("[Tunnel]: %s:%d %s, client->server %llu bytes, server->client %llu bytes, %.3f ms",
+                  tunnel->host.c_str(), tunnel->port, TunnelUtils::EndName(end),
+                  (unsigned long long)tunnel->upstream.bytes, (unsigned long long)tunnel->downstream.bytes, duration_ms);
+        Logger::instance().access(tunnel->client_socket, "CONNECT", tunnel->host,
+                                  tunnel->host + ":" + std::to_string(tunnel->port), end == TunnelUtils::CLOSED ? "200" : std::string("200-") + TunnelUtils::EndName(end),
+                                  tunnel->upstream.bytes + tunnel->downstream.bytes, tunnel->connect_ms, duration_ms);
+        delete tunnel;
+    }
+
+    // close the tunnels which have had no events for the idle timeout.
+    void sweep() {
+        auto idle_since = std::chrono::steady_clock::now() - std::chrono::seconds(TunnelUtils::GetConfig().idle_sec);
+        std::vector<TunnelUtils::Tunnel*> idle;
+        {
+            std::lock_guard<std::mutex> lock_guard_(mutex_);
+            for (auto* tunnel : tunnels) {
+                if (tunnel->active_at < idle_since) {
+                    idle.push_back(tunnel);
+                }
+            }
+        }
+        for (auto* tunnel : idle) {
+            finish(tunnel, TunnelUtils::IDLE);
+        }
+    }
+
+    void run() {
+        epoll_event events[TUNNEL_MAX_EVENTS];
+        bool idle_timeout = TunnelUtils::GetConfig().idle_sec > 0;
+        auto swept_at = std::chrono::steady_clock::now();
+        while (true) {
+            int n = epoll_wait(epoll_fd, events, TUNNEL_MAX_EVENTS, idle_timeout ? TUNNEL_SWEEP_MS : -1);
+            if (n == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                LOG_ERROR("[Tunnel]: epoll_wait failed: %s", strerror(errno));
+                return;
+            }
+            for (int i = 0; i < n; i++) {
+                auto* tunnel = static_cast<TunnelUtils::Tunnel*>(events[i].data.ptr);
+                // both sockets of a tunnel point to it, it may have been finished by the other one.
+                // (the events of a closed socket are not reported after epoll_ctl DEL,
+                // but they may be in this batch already)
+                if (tunnel == nullptr) {
+                    continue;
+                }
+                tunnel->active_at = std::chrono::steady_clock::now();
+                bool ok = (events[i].events & EPOLLERR) == 0 && pump(tunnel->upstream) && pump(tunnel->downstream);
+                if (!ok || (tunnel->upstream.Done() && tunnel->downstream.Done())) {
+                    // dont touch the tunnel in the rest of this batch.
+                    for (int j = i + 1; j < n; j++) {
+                        if (events[j].data.ptr == tunnel) {
+                            events[j].data.ptr = nullptr;
+                        }
+                    }
+                    finish(tunnel, ok ? TunnelUtils::CLOSED : TunnelUtils::BROKEN);
+                }
+            }
+            if (idle_timeout && std::chrono::steady_clock::now() - swept_at >= std::chrono::milliseconds(TUNNEL_SWEEP_MS)) {
+                sweep();
+                swept_at = std::chrono::steady_clock::now();
+            }
+        }
+    }
+
+public:
+    TunnelEngine(const TunnelEngine&) = delete;
+    TunnelEngine& operator=(const TunnelEngine&) = delete;
+
+    static TunnelEngine& instance() {
+        // never destroyed, the engine thread may still be running at exit.
+        static TunnelEngine* engine = new TunnelEngine();
+        return *engine;
+    }
+
+    TunnelUtils::Stats& GetStats() {
+        return stats;
+    }
+
+    // relay client_socket <-> server_socket until both sides are closed.
+    // the engine owns both sockets from now on, and closes them at the end.
+    // return false (and close nothing) if the tunnel cannot be set up.
+    bool Add(int client_socket, int server_socket, const std::string& host, int port, double connect_ms) {
+        if (epoll_fd == -1 || !SetNonBlocking(client_socket) || !SetNonBlocking(server_socket)) {
+            return false;
+        }
+        auto* tunnel = new TunnelUtils::Tunnel{client_socket, server_socket, host, port,
+                                               {client_socket, server_socket}, {server_socket, client_socket},
+                                               std::chrono::steady_clock::now(), connect_ms,
+                                               std::chrono::steady_clock::now()};
+        if (!OpenPipe(tunnel->upstream) || !OpenPipe(tunnel->downstream)) {
+            LOG_ERROR_LIMITED("[Tunnel]: Failed to create pipe: %s", strerror(errno));
+            ClosePipe(tunnel->upstream);
+            ClosePipe(tunnel->downstream);
+            delete tunnel;
+            return false;
+        }
+        stats.opened++;
+        stats.active++;
+        // before the sockets are in epoll, the engine thread may finish the tunnel right after.
+        {
+            std::lock_guard<std::mutex> lock_guard_(mutex_);
+            tunnels.insert(tunnel);
+        }
+        // edge triggered, the first events come right after adding, as both sockets are writable.
+        epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = tunnel;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &event) == -1 ||
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &event) == -1) {
+            LOG_ERROR_LIMITED("[Tunnel]: Failed to add the sockets to epoll: %s", strerror(errno));
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client_socket, nullptr);
+            {
+                std::lock_guard<std::mutex> lock_guard_(mutex_);
+                tunnels.erase(tunnel);
+            }
+            stats.opened--;
+            stats.active--;
+            ClosePipe(tunnel->upstream);
+            ClosePipe(tunnel->downstream);
+            delete tunnel;
+            return false;
+        }
+        return true;
+    }
+};
+
+#endif // TUNNEL_H